@@ -0,0 +1,45 @@
+#include "alloc_count.hpp"
+
+#ifdef SEALFS_COUNT_ALLOCS
+
+#include <stdlib.h>
+
+#include <new>
+
+// One thread local increment per allocation, but it still replaces the allocator for the whole daemon, so only in
+// builds meant for measuring
+static thread_local uint64_t allocations = 0;
+
+uint64_t SealFS::thread_allocations(){
+    return allocations;
+}
+
+void* operator new(size_t size){
+    ++allocations;
+    if(void* p = malloc(size ? size : 1)){
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size){
+    return operator new(size);
+}
+
+void operator delete(void* p) noexcept{
+    free(p);
+}
+
+void operator delete[](void* p) noexcept{
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept{
+    free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept{
+    free(p);
+}
+
+#endif // SEALFS_COUNT_ALLOCS
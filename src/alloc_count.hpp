@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstdint>
+
+namespace SealFS{
+
+// Heap allocations the calling thread has made through operator new so far. Only counted in builds with
+// SEALFS_COUNT_ALLOCS defined (e.g. bazel build --copt=-DSEALFS_COUNT_ALLOCS //src:sealfs), where alloc_count.cpp
+// replaces the global operator new; everywhere else it is 0 and allocation stays untouched. The request workers use
+// the difference across a request to report allocations per request (user.sealfs.workers), which is expected to
+// stay at 0 on the steady-state read, write and lookup paths.
+#ifdef SEALFS_COUNT_ALLOCS
+inline constexpr bool COUNTING_ALLOCATIONS = true;
+uint64_t thread_allocations();
+#else
+inline constexpr bool COUNTING_ALLOCATIONS = false;
+inline uint64_t thread_allocations(){ return 0; }
+#endif
+
+} // namespace SealFS
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <cstddef>
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace SealFS{
+
+// Per-thread scratch buffers for building replies, in power of two size classes from 4 KiB to 16 MiB. A buffer goes
+// back to the free list of the thread releasing it, so once a worker has seen its largest request, handling
+// requests stops touching the heap. Anything bigger than the largest class is allocated and freed as usual. What a
+// thread keeps idle is capped at MAX_POOLED bytes across all classes, buffers released past that are freed.
+class BufferPool{
+public:
+    static constexpr size_t MIN_SHIFT = 12;
+    static constexpr size_t MAX_SHIFT = 24;
+    static constexpr size_t CLASSES = MAX_SHIFT - MIN_SHIFT + 1;
+    // Free buffers kept per class and thread, more than this many in flight at once are freed on release
+    static constexpr size_t KEEP = 4;
+    // Bytes of free buffers kept per thread, across all classes. Enough for one of the largest class.
+    static constexpr size_t MAX_POOLED = size_t(1) << MAX_SHIFT;
+
+    class Buffer{
+    public:
+        Buffer() = default;
+        Buffer(Buffer&& oth) noexcept : mem(std::move(oth.mem)), cls(oth.cls), cap(oth.cap){ oth.cap = 0; }
+        Buffer& operator=(Buffer&& oth) noexcept{
+            if(this != &oth){
+                release();
+                mem = std::move(oth.mem);
+                cls = oth.cls;
+                cap = oth.cap;
+                oth.cap = 0;
+            }
+            return *this;
+        }
+        ~Buffer(){ release(); }
+
+        inline char* data(){ return mem.get(); }
+        inline const char* data() const { return mem.get(); }
+        inline size_t capacity() const { return cap; }
+
+    private:
+        friend class BufferPool;
+        Buffer(std::unique_ptr<char[]> mem_, size_t cls_, size_t cap_) : mem(std::move(mem_)), cls(cls_), cap(cap_){}
+
+        void release(){
+            if(mem && cls < CLASSES){
+                BufferPool::local().put(cls, std::move(mem));
+            }
+            mem.reset();
+            cap = 0;
+        }
+
+        std::unique_ptr<char[]> mem;
+        size_t cls = CLASSES; // CLASSES for buffers outside the pool
+        size_t cap = 0;
+    };
+
+    // A buffer of at least size bytes from this thread's pool
+    static Buffer get(size_t size){
+        const size_t cls = class_of(size);
+        if(cls >= CLASSES){
+            return Buffer(std::make_unique_for_overwrite<char[]>(size), CLASSES, size);
+        }
+        auto& list = local().free[cls];
+        const size_t cap = size_t(1) << (cls + MIN_SHIFT);
+        if(list.empty()){
+            return Buffer(std::make_unique_for_overwrite<char[]>(cap), cls, cap);
+        }
+        Buffer buf(std::move(list.back()), cls, cap);
+        list.pop_back();
+        local().pooled -= cap;
+        return buf;
+    }
+
+    // Grow buf to at least size bytes, keeping its first used bytes
+    static void grow(Buffer& buf, size_t size, size_t used){
+        if(size <= buf.capacity()){
+            return;
+        }
+        Buffer bigger = get(std::max(size, buf.capacity() * 2));
+        if(used > 0){
+            std::copy(buf.data(), buf.data() + used, bigger.data());
+        }
+        buf = std::move(bigger);
+    }
+
+private:
+    static BufferPool& local(){
+        thread_local BufferPool pool;
+        return pool;
+    }
+
+    static size_t class_of(size_t size){
+        size_t cls = 0;
+        while(cls < CLASSES && (size_t(1) << (cls + MIN_SHIFT)) < size){
+            ++cls;
+        }
+        return cls;
+    }
+
+    void put(size_t cls, std::unique_ptr<char[]> mem){
+        auto& list = free[cls];
+        const size_t cap = size_t(1) << (cls + MIN_SHIFT);
+        if(list.size() < KEEP && pooled + cap <= MAX_POOLED){
+            if(list.capacity() == 0){
+                list.reserve(KEEP);
+            }
+            list.push_back(std::move(mem));
+            pooled += cap;
+        }
+    }
+
+    std::array<std::vector<std::unique_ptr<char[]>>, CLASSES> free;
+    size_t pooled = 0; // Bytes in free
+};
+
+} // namespace SealFS
@@ -0,0 +1,926 @@
+#include "checksum.hpp"
+#include "state.hpp"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <iterator>
+
+using namespace SealFS;
+
+namespace{
+
+constexpr uint32_t POLY = 0x82f63b78; // CRC-32C, reflected
+
+// The hardware paths run three independent CRCs over adjacent LONG (then SHORT) byte stretches to keep the CRC
+// unit busy, then fold them together by shifting each partial CRC over the zeros that follow it
+constexpr size_t LONG = 8192;
+constexpr size_t SHORT = 256;
+
+uint32_t gf2_matrix_times(const uint32_t* mat, uint32_t vec){
+    uint32_t sum = 0;
+    while(vec){
+        if(vec & 1){
+            sum ^= *mat;
+        }
+        vec >>= 1;
+        ++mat;
+    }
+    return sum;
+}
+
+void gf2_matrix_square(uint32_t* square, const uint32_t* mat){
+    for(int n = 0; n < 32; ++n){
+        square[n] = gf2_matrix_times(mat, mat[n]);
+    }
+}
+
+// Operator appending len (a power of two) zero bytes to a raw CRC register
+void zeros_op(uint32_t* even, size_t len){
+    uint32_t odd[32];
+    odd[0] = POLY; // One zero bit
+    uint32_t row = 1;
+    for(int n = 1; n < 32; ++n){
+        odd[n] = row;
+        row <<= 1;
+    }
+    gf2_matrix_square(even, odd); // Two zero bits
+    gf2_matrix_square(odd, even); // Four
+
+    // Each square doubles the zeros, starting from one byte
+    do{
+        gf2_matrix_square(even, odd);
+        len >>= 1;
+        if(len == 0){
+            return;
+        }
+        gf2_matrix_square(odd, even);
+        len >>= 1;
+    } while(len);
+
+    std::copy(odd, odd + 32, even);
+}
+
+struct crc_tables{
+    uint32_t bytes[8][256]; // Slicing-by-8
+    uint32_t shift_long[4][256];
+    uint32_t shift_short[4][256];
+
+    crc_tables(){
+        for(uint32_t n = 0; n < 256; ++n){
+            uint32_t crc = n;
+            for(int k = 0; k < 8; ++k){
+                crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+            }
+            bytes[0][n] = crc;
+        }
+        for(uint32_t n = 0; n < 256; ++n){
+            for(int k = 1; k < 8; ++k){
+                bytes[k][n] = (bytes[k - 1][n] >> 8) ^ bytes[0][bytes[k - 1][n] & 0xff];
+            }
+        }
+        fill_shift(shift_long, LONG);
+        fill_shift(shift_short, SHORT);
+    }
+
+    static void fill_shift(uint32_t table[4][256], size_t len){
+        uint32_t op[32];
+        zeros_op(op, len);
+        for(uint32_t n = 0; n < 256; ++n){
+            for(int k = 0; k < 4; ++k){
+                table[k][n] = gf2_matrix_times(op, n << (8 * k));
+            }
+        }
+    }
+
+    static inline uint32_t shift(const uint32_t table[4][256], uint32_t crc){
+        return table[0][crc & 0xff] ^ table[1][(crc >> 8) & 0xff] ^ table[2][(crc >> 16) & 0xff] ^ table[3][crc >> 24];
+    }
+};
+
+const crc_tables& tables(){
+    static const crc_tables t;
+    return t;
+}
+
+inline uint64_t load64(const unsigned char* p){
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+uint32_t crc32c_table(uint32_t crc, const void* data, size_t len){
+    const auto& t = tables().bytes;
+    const unsigned char* next = static_cast<const unsigned char*>(data);
+    uint32_t c = ~crc;
+
+    if constexpr(std::endian::native == std::endian::little){
+        while(len && (reinterpret_cast<uintptr_t>(next) & 7)){
+            c = (c >> 8) ^ t[0][(c ^ *next++) & 0xff];
+            --len;
+        }
+        while(len >= 8){
+            const uint64_t word = load64(next) ^ c;
+            c = t[7][word & 0xff] ^ t[6][(word >> 8) & 0xff] ^ t[5][(word >> 16) & 0xff] ^ t[4][(word >> 24) & 0xff]
+              ^ t[3][(word >> 32) & 0xff] ^ t[2][(word >> 40) & 0xff] ^ t[1][(word >> 48) & 0xff] ^ t[0][word >> 56];
+            next += 8;
+            len -= 8;
+        }
+    }
+    while(len){
+        c = (c >> 8) ^ t[0][(c ^ *next++) & 0xff];
+        --len;
+    }
+    return ~c;
+}
+
+// step8/step1 are the CPU's CRC32C instructions, the rest is the same for every architecture
+#define SEALFS_CRC32C_HW(name, target, step8, step1)                                                                  \
+target uint32_t name(uint32_t crc, const void* data, size_t len){                                                    \
+    const auto& t = tables();                                                                                        \
+    const unsigned char* next = static_cast<const unsigned char*>(data);                                             \
+    uint64_t crc0 = ~crc;                                                                                            \
+    while(len && (reinterpret_cast<uintptr_t>(next) & 7)){                                                           \
+        crc0 = step1(crc0, *next++);                                                                                 \
+        --len;                                                                                                       \
+    }                                                                                                                \
+    for(size_t stretch : {LONG, SHORT}){                                                                             \
+        const auto& shift = stretch == LONG ? t.shift_long : t.shift_short;                                          \
+        while(len >= 3 * stretch){                                                                                   \
+            uint64_t crc1 = 0;                                                                                       \
+            uint64_t crc2 = 0;                                                                                       \
+            const unsigned char* end = next + stretch;                                                               \
+            do{                                                                                                      \
+                crc0 = step8(crc0, load64(next));                                                                    \
+                crc1 = step8(crc1, load64(next + stretch));                                                          \
+                crc2 = step8(crc2, load64(next + 2 * stretch));                                                      \
+                next += 8;                                                                                           \
+            } while(next < end);                                                                                     \
+            crc0 = crc_tables::shift(shift, static_cast<uint32_t>(crc0)) ^ crc1;                                     \
+            crc0 = crc_tables::shift(shift, static_cast<uint32_t>(crc0)) ^ crc2;                                     \
+            next += 2 * stretch;                                                                                     \
+            len -= 3 * stretch;                                                                                      \
+        }                                                                                                            \
+    }                                                                                                                \
+    while(len >= 8){                                                                                                 \
+        crc0 = step8(crc0, load64(next));                                                                            \
+        next += 8;                                                                                                   \
+        len -= 8;                                                                                                    \
+    }                                                                                                                \
+    while(len){                                                                                                      \
+        crc0 = step1(crc0, *next++);                                                                                 \
+        --len;                                                                                                       \
+    }                                                                                                                \
+    return ~static_cast<uint32_t>(crc0);                                                                             \
+}
+
+#if defined(__x86_64__)
+#define SSE42_STEP8(crc, word) _mm_crc32_u64(crc, word)
+#define SSE42_STEP1(crc, byte) _mm_crc32_u8(static_cast<uint32_t>(crc), byte)
+SEALFS_CRC32C_HW(crc32c_sse42, __attribute__((target("sse4.2"))), SSE42_STEP8, SSE42_STEP1)
+#elif defined(__aarch64__)
+#define ARMV8_STEP8(crc, word) __crc32cd(static_cast<uint32_t>(crc), word)
+#define ARMV8_STEP1(crc, byte) __crc32cb(static_cast<uint32_t>(crc), byte)
+#if defined(__clang__)
+SEALFS_CRC32C_HW(crc32c_armv8, __attribute__((target("crc"))), ARMV8_STEP8, ARMV8_STEP1)
+#else
+SEALFS_CRC32C_HW(crc32c_armv8, __attribute__((target("+crc"))), ARMV8_STEP8, ARMV8_STEP1)
+#endif
+#endif
+
+struct crc_impl{
+    uint32_t (*fn)(uint32_t, const void*, size_t);
+    const char* name;
+};
+
+crc_impl pick_impl(){
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse4.2")){
+        return {crc32c_sse42, "sse4.2"};
+    }
+#elif defined(__aarch64__)
+    if(getauxval(AT_HWCAP) & HWCAP_CRC32){
+        return {crc32c_armv8, "armv8"};
+    }
+#endif
+    return {crc32c_table, "table"};
+}
+
+const crc_impl& impl(){
+    static const crc_impl i = pick_impl();
+    return i;
+}
+
+// CRC of len zero bytes continuing from crc
+uint32_t crc32c_zeros(uint32_t crc, size_t len){
+    static const char zeros[CHECKSUM_BLOCK] = {};
+    while(len){
+        const size_t n = std::min<size_t>(len, sizeof(zeros));
+        crc = crc32c(crc, zeros, n);
+        len -= n;
+    }
+    return crc;
+}
+
+uint32_t zero_block_crc(){
+    static const uint32_t crc = crc32c_zeros(0, CHECKSUM_BLOCK);
+    return crc;
+}
+
+inline size_t block_count(off_t size){
+    return static_cast<size_t>(block_ceil(size) / CHECKSUM_BLOCK);
+}
+
+// pread until len bytes or EOF, -1 on error
+ssize_t pread_full(int fd, char* buf, size_t len, off_t off){
+    size_t done = 0;
+    while(done < len){
+        const ssize_t bytes = traced_pread(fd, buf + done, len - done, off + done);
+        if(bytes == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        if(bytes == 0){
+            break;
+        }
+        done += bytes;
+    }
+    return done;
+}
+
+// Sidecar layout, native endianness: header, one CRC per block, then the CRC of everything before it
+constexpr char SIDECAR_MAGIC[8] = {'S', 'E', 'A', 'L', 'S', 'U', 'M', '1'};
+constexpr uint32_t SIDECAR_VALID = 1;
+constexpr uint32_t SIDECAR_SETTLED = 2; // No write could have landed after the recorded mtime without moving it
+
+struct sidecar_header{
+    char magic[8];
+    uint32_t block;
+    uint32_t flags;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t count;
+};
+
+} // namespace
+
+uint32_t SealFS::crc32c(uint32_t crc, const void* data, size_t len){
+    return impl().fn(crc, data, len);
+}
+
+const char* SealFS::crc32c_impl(){
+    return impl().name;
+}
+
+
+ObjectSums::ObjectSums(std::filesystem::path data_path_, bool valid_) : data_path(std::move(data_path_)), is_valid(valid_){}
+
+ObjectSums::~ObjectSums(){
+    if(fd != -1){
+        close(fd);
+    }
+}
+
+int ObjectSums::object_fd(){
+    if(fd == -1){
+        fd = traced_open(data_path.c_str(), O_RDONLY | O_CLOEXEC);
+    }
+    return fd;
+}
+
+void ObjectSums::relocate(std::filesystem::path to){
+    std::lock_guard<std::mutex> lk(m);
+    if(fd != -1){
+        close(fd);
+        fd = -1;
+    }
+    data_path = std::move(to);
+    // A rebuild() reading the old copy can't be told apart from one racing a write
+    ++seq;
+}
+
+bool ObjectSums::valid(){
+    std::lock_guard<std::mutex> lk(m);
+    return is_valid;
+}
+
+uint64_t ObjectSums::read_seq(){
+    std::lock_guard<std::mutex> lk(m);
+    return seq;
+}
+
+uint64_t ObjectSums::get_version(){
+    std::lock_guard<std::mutex> lk(m);
+    return version;
+}
+
+off_t ObjectSums::get_size(){
+    std::lock_guard<std::mutex> lk(m);
+    return size;
+}
+
+void ObjectSums::begin_write(){
+    std::lock_guard<std::mutex> lk(m);
+    ++in_flight;
+    ++seq;
+}
+
+void ObjectSums::finish(){
+    --in_flight;
+    ++seq;
+    ++version;
+}
+
+std::optional<uint32_t> ObjectSums::reread(off_t start, off_t end){
+    const int object = object_fd();
+    if(object == -1){
+        return std::nullopt;
+    }
+    BufferPool::Buffer buf = BufferPool::get(end - start);
+    if(pread_full(object, buf.data(), end - start, start) != end - start){
+        return std::nullopt;
+    }
+    return crc32c(0, buf.data(), end - start);
+}
+
+void ObjectSums::recompute(off_t start){
+    const auto crc = reread(start, std::min(start + CHECKSUM_BLOCK, size));
+    if(crc){
+        crcs[start / CHECKSUM_BLOCK] = *crc;
+    }
+    else{
+        is_valid = false;
+    }
+}
+
+void ObjectSums::zero_extend(off_t to){
+    while(size < to){
+        const off_t start = block_floor(size);
+        const off_t stop = std::min(start + CHECKSUM_BLOCK, to);
+        if(size != start){
+            crcs.back() = crc32c_zeros(crcs.back(), stop - size);
+        }
+        else{
+            crcs.push_back(stop - start == CHECKSUM_BLOCK ? zero_block_crc() : crc32c_zeros(0, stop - start));
+        }
+        size = stop;
+    }
+}
+
+void ObjectSums::end_write(off_t off, const char* data, size_t len){
+    std::lock_guard<std::mutex> lk(m);
+    if(is_valid && len > 0){
+        // Anything between the old end and off is a hole
+        if(off > size){
+            zero_extend(off);
+        }
+        const off_t old_size = size;
+        const off_t end = off + len;
+        if(end > size){
+            size = end;
+            crcs.resize(block_count(size));
+        }
+
+        for(off_t start = block_floor(off); start < end && is_valid; start += CHECKSUM_BLOCK){
+            const off_t stop = std::min(start + CHECKSUM_BLOCK, size);
+            const off_t wstart = std::max(start, off);
+            const off_t wstop = std::min(stop, end);
+            if(wstart == start && wstop == stop){
+                crcs[start / CHECKSUM_BLOCK] = crc32c(0, data + (start - off), stop - start);
+            }
+            else if(wstart == old_size && wstop == stop){
+                // Appending to a partial last block, the CRC picks up where it left off
+                crcs[start / CHECKSUM_BLOCK] = crc32c(crcs[start / CHECKSUM_BLOCK], data + (wstart - off), wstop - wstart);
+            }
+            else{
+                recompute(start);
+            }
+        }
+    }
+    finish();
+}
+
+void ObjectSums::end_zero(off_t off, off_t len){
+    std::lock_guard<std::mutex> lk(m);
+    const off_t end = std::min(off + len, size);
+    for(off_t start = block_floor(off); is_valid && start < end; start += CHECKSUM_BLOCK){
+        const off_t stop = std::min(start + CHECKSUM_BLOCK, size);
+        if(off <= start && stop <= end){
+            crcs[start / CHECKSUM_BLOCK] = stop - start == CHECKSUM_BLOCK ? zero_block_crc() : crc32c_zeros(0, stop - start);
+        }
+        else{
+            recompute(start);
+        }
+    }
+    finish();
+}
+
+void ObjectSums::end_extend(off_t new_size){
+    std::lock_guard<std::mutex> lk(m);
+    if(is_valid && new_size > size){
+        zero_extend(new_size);
+    }
+    finish();
+}
+
+void ObjectSums::end_truncate(off_t new_size){
+    std::lock_guard<std::mutex> lk(m);
+    if(is_valid){
+        if(new_size >= size){
+            zero_extend(new_size);
+        }
+        else{
+            size = new_size;
+            crcs.resize(block_count(size));
+            if(size != block_floor(size)){
+                recompute(block_floor(size));
+            }
+        }
+    }
+    finish();
+}
+
+void ObjectSums::end_unchanged(){
+    std::lock_guard<std::mutex> lk(m);
+    finish();
+}
+
+verify_t ObjectSums::verify(std::optional<uint64_t> read_seq, off_t off, const char* data, size_t len, size_t asked, off_t* bad){
+    std::lock_guard<std::mutex> lk(m);
+    if(!is_valid){
+        return verify_t::UNCHECKED;
+    }
+    if(read_seq && (*read_seq != seq || in_flight > 0)){
+        return verify_t::RACED;
+    }
+
+    const off_t got = off + len;
+    for(off_t start = off; start < off + static_cast<off_t>(asked) && start < size; start += CHECKSUM_BLOCK){
+        const off_t stop = std::min(start + CHECKSUM_BLOCK, size);
+        // A short read inside what the sums cover means the object lost its tail
+        if(stop > got || crc32c(0, data + (start - off), stop - start) != crcs[start / CHECKSUM_BLOCK]){
+            if(bad){
+                *bad = start;
+            }
+            return verify_t::MISMATCH;
+        }
+    }
+    return verify_t::OK;
+}
+
+bool ObjectSums::rebuild(const std::function<bool(size_t)>& pace){
+    uint64_t start_seq;
+    std::filesystem::path path;
+    {
+        std::lock_guard<std::mutex> lk(m);
+        if(in_flight > 0){
+            return false;
+        }
+        start_seq = seq;
+        path = data_path;
+    }
+    // Its own fd, the shared one is only used under m (relocate() may close it)
+    const int object = traced_open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if(object == -1 || fstat(object, &st) == -1){
+        if(object != -1){
+            close(object);
+        }
+        return false;
+    }
+
+    std::vector<uint32_t> fresh;
+    fresh.reserve(block_count(st.st_size));
+    BufferPool::Buffer buf = BufferPool::get(CHECKSUM_BLOCK);
+    bool complete = true;
+    for(off_t start = 0; complete && start < st.st_size; start += CHECKSUM_BLOCK){
+        const off_t len = std::min<off_t>(CHECKSUM_BLOCK, st.st_size - start);
+        complete = pread_full(object, buf.data(), len, start) == len;
+        if(complete){
+            fresh.push_back(crc32c(0, buf.data(), len));
+            complete = pace(len);
+        }
+    }
+    close(object);
+    if(!complete){
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lk(m);
+    if(seq != start_seq || in_flight > 0){
+        return false;
+    }
+    size = st.st_size;
+    crcs = std::move(fresh);
+    is_valid = true;
+    ++version;
+    return true;
+}
+
+void ObjectSums::copy_from(ObjectSums& other){
+    std::scoped_lock lk(m, other.m);
+    is_valid = other.is_valid;
+    size = other.size;
+    crcs = other.crcs;
+    ++version;
+}
+
+std::pair<std::string, uint64_t> ObjectSums::serialize(){
+    std::lock_guard<std::mutex> lk(m);
+
+    // Sums are only trusted again after a restart if the object's mtime still says nothing touched it since. That
+    // only holds if a write made after this point can't leave the mtime where it is, i.e. the clock file timestamps
+    // come from has already moved past it.
+    sidecar_header header{};
+    memcpy(header.magic, SIDECAR_MAGIC, sizeof(header.magic));
+    header.block = CHECKSUM_BLOCK;
+    header.size = size;
+    header.count = crcs.size();
+    struct stat st;
+    const int object = object_fd();
+    if(is_valid && object != -1 && fstat(object, &st) == 0 && st.st_size == size){
+        header.flags = SIDECAR_VALID;
+        header.mtime_sec = st.st_mtim.tv_sec;
+        header.mtime_nsec = st.st_mtim.tv_nsec;
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME_COARSE, &now);
+        if(in_flight == 0 && (now.tv_sec > st.st_mtim.tv_sec || (now.tv_sec == st.st_mtim.tv_sec && now.tv_nsec > st.st_mtim.tv_nsec))){
+            header.flags |= SIDECAR_SETTLED;
+        }
+    }
+
+    std::string out(sizeof(header) + crcs.size() * sizeof(uint32_t) + sizeof(uint32_t), '\0');
+    memcpy(out.data(), &header, sizeof(header));
+    if(!crcs.empty()){
+        memcpy(out.data() + sizeof(header), crcs.data(), crcs.size() * sizeof(uint32_t));
+    }
+    const uint32_t trailer = crc32c(0, out.data(), out.size() - sizeof(uint32_t));
+    memcpy(out.data() + out.size() - sizeof(uint32_t), &trailer, sizeof(trailer));
+    return {std::move(out), version};
+}
+
+bool ObjectSums::deserialize(const std::string& sidecar){
+    sidecar_header header;
+    if(sidecar.size() < sizeof(header) + sizeof(uint32_t)){
+        return false;
+    }
+    memcpy(&header, sidecar.data(), sizeof(header));
+    uint32_t trailer;
+    memcpy(&trailer, sidecar.data() + sidecar.size() - sizeof(trailer), sizeof(trailer));
+    if(memcmp(header.magic, SIDECAR_MAGIC, sizeof(header.magic)) != 0 || header.block != CHECKSUM_BLOCK
+       || header.count != block_count(header.size) || sidecar.size() != sizeof(header) + header.count * sizeof(uint32_t) + sizeof(uint32_t)
+       || crc32c(0, sidecar.data(), sidecar.size() - sizeof(trailer)) != trailer){
+        return false;
+    }
+    if((header.flags & (SIDECAR_VALID | SIDECAR_SETTLED)) != (SIDECAR_VALID | SIDECAR_SETTLED)){
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lk(m);
+    struct stat st;
+    const int object = object_fd();
+    if(object == -1 || fstat(object, &st) == -1 || st.st_size != static_cast<off_t>(header.size)
+       || st.st_mtim.tv_sec != header.mtime_sec || st.st_mtim.tv_nsec != header.mtime_nsec){
+        return false;
+    }
+    size = header.size;
+    crcs.resize(header.count);
+    if(header.count){
+        memcpy(crcs.data(), sidecar.data() + sizeof(header), header.count * sizeof(uint32_t));
+    }
+    is_valid = true;
+    return true;
+}
+
+
+ChecksumStore::ChecksumStore(DataTiers& tiers, const std::filesystem::path& sums_dir, std::shared_ptr<spdlog::logger> logger, bool enabled)
+    : tiers(tiers), sums_dir(sums_dir), logger(std::move(logger)), is_enabled(enabled){
+    if(is_enabled){
+        this->logger->info("Checksumming data in {} byte blocks, crc32c: {}", CHECKSUM_BLOCK, crc32c_impl());
+    }
+}
+
+ChecksumStore::~ChecksumStore(){
+    stop_scrubber();
+}
+
+std::filesystem::path ChecksumStore::sidecar_path(uint32_t data_id) const{
+    return sums_dir / (std::to_string(data_id) + ".sum");
+}
+
+std::shared_ptr<ObjectSums> ChecksumStore::get(uint32_t data_id){
+    if(!is_enabled){
+        return nullptr;
+    }
+    {
+        std::lock_guard<std::mutex> lk(m);
+        auto it = loaded.find(data_id);
+        if(it != loaded.end()){
+            if(auto sums = it->second.lock()){
+                return sums;
+            }
+        }
+    }
+
+    // Loaded outside the lock, whoever gets back to it first wins
+    const auto path = tiers.path(data_id);
+    auto sums = std::make_shared<ObjectSums>(path, false);
+    std::string sidecar;
+    if(traced_read_file(sidecar_path(data_id).c_str(), sidecar)){
+        if(!sums->deserialize(sidecar)){
+            logger->info("Checksums of data object {} are stale, left to the scrubber to rebuild", data_id);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lk(m);
+        auto& slot = loaded[data_id];
+        if(auto existing = slot.lock()){
+            return existing;
+        }
+        slot = sums;
+        if(loaded.size() >= sweep_at){
+            std::erase_if(loaded, [](const auto& entry){ return entry.second.expired(); });
+            sweep_at = std::max<size_t>(1024, 2 * loaded.size());
+        }
+    }
+    // A migration that landed while these were loading found nothing to relocate()
+    if(auto now = tiers.path(data_id); now != path){
+        sums->relocate(std::move(now));
+    }
+    return sums;
+}
+
+std::shared_ptr<ObjectSums> ChecksumStore::create(uint32_t data_id, std::optional<uint32_t> src){
+    if(!is_enabled){
+        return nullptr;
+    }
+    auto sums = std::make_shared<ObjectSums>(tiers.path(data_id), true);
+    if(src){
+        sums->copy_from(*get(*src));
+    }
+    std::lock_guard<std::mutex> lk(m);
+    loaded[data_id] = sums;
+    pinned[data_id] = sums;
+    return sums;
+}
+
+void ChecksumStore::pin(uint32_t data_id){
+    if(auto sums = get(data_id)){
+        std::lock_guard<std::mutex> lk(m);
+        pinned[data_id] = std::move(sums);
+    }
+}
+
+std::optional<std::pair<std::string, uint64_t>> ChecksumStore::serialize(uint32_t data_id){
+    std::shared_ptr<ObjectSums> sums;
+    {
+        std::lock_guard<std::mutex> lk(m);
+        auto it = pinned.find(data_id);
+        if(it == pinned.end()){
+            return std::nullopt;
+        }
+        sums = it->second;
+    }
+    return sums->serialize();
+}
+
+void ChecksumStore::persisted(uint32_t data_id, uint64_t version){
+    std::lock_guard<std::mutex> lk(m);
+    auto it = pinned.find(data_id);
+    if(it != pinned.end() && it->second->get_version() == version){
+        pinned.erase(it);
+    }
+}
+
+void ChecksumStore::relocate(uint32_t data_id){
+    std::shared_ptr<ObjectSums> sums;
+    {
+        std::lock_guard<std::mutex> lk(m);
+        auto it = loaded.find(data_id);
+        if(it == loaded.end() || !(sums = it->second.lock())){
+            return;
+        }
+    }
+    sums->relocate(tiers.path(data_id));
+}
+
+void ChecksumStore::forget(uint32_t data_id){
+    std::lock_guard<std::mutex> lk(m);
+    pinned.erase(data_id);
+    loaded.erase(data_id);
+}
+
+void ChecksumStore::record_mismatch(uint32_t data_id, off_t block, bool scrub){
+    ++(scrub ? scrub_mismatches : read_mismatches);
+    logger->error("Checksum mismatch in data object {} at offset {} ({})", data_id, block, scrub ? "scrub" : "read");
+    std::lock_guard<std::mutex> lk(m);
+    bad_blocks.push_back({data_id, block});
+    if(bad_blocks.size() > MAX_BAD_BLOCKS){
+        bad_blocks.pop_front();
+    }
+}
+
+void ChecksumStore::start_scrubber(size_t mb_per_sec, unsigned interval, std::function<void(uint32_t)> rebuilt){
+    if(!is_enabled || mb_per_sec == 0){
+        return;
+    }
+    on_rebuilt = std::move(rebuilt);
+    scrubber = std::jthread([this, mb_per_sec, interval](std::stop_token stop){ scrub_loop(stop, mb_per_sec, interval); });
+}
+
+void ChecksumStore::stop_scrubber(){
+    if(scrubber.joinable()){
+        scrubber.request_stop();
+        scrub_cv.notify_all();
+        scrubber.join();
+    }
+}
+
+void ChecksumStore::scrub_loop(std::stop_token stop, size_t mb_per_sec, unsigned interval){
+    const double bytes_per_sec = static_cast<double>(mb_per_sec) * 1024 * 1024;
+
+    while(!stop.stop_requested()){
+        scrubbing = true;
+        const auto start = std::chrono::steady_clock::now();
+        const uint64_t mismatches_before = scrub_mismatches;
+
+        std::vector<uint32_t> ids;
+        std::vector<uint32_t> sidecars;
+        try{
+            for(const auto& dir : tiers.dirs()){
+                for(const auto& entry : std::filesystem::directory_iterator(dir)){
+                    if(auto data_id = parse_id_filename<uint32_t>(entry.path().filename().native(), ".data")){
+                        ids.push_back(*data_id);
+                    }
+                }
+            }
+            for(const auto& entry : std::filesystem::directory_iterator(sums_dir)){
+                if(auto data_id = parse_id_filename<uint32_t>(entry.path().filename().native(), ".sum")){
+                    sidecars.push_back(*data_id);
+                }
+            }
+        }
+        catch(const std::exception& e){
+            logger->error("[scrub] Failed to list data objects: {}", e.what());
+        }
+        // An object being migrated can show up on both tiers
+        std::sort(ids.begin(), ids.end());
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+        // Sidecars whose object is gone, left behind by a crash between removing the two
+        for(uint32_t data_id : sidecars){
+            if(!std::binary_search(ids.begin(), ids.end(), data_id) && !tiers.exists(data_id)){
+                std::lock_guard<std::mutex> lk(m);
+                if(!loaded.contains(data_id)){
+                    std::error_code ec;
+                    std::filesystem::remove(sidecar_path(data_id), ec);
+                }
+            }
+        }
+
+        // Sleep off whatever the pass is ahead of its budget
+        uint64_t paced = 0;
+        auto pace = [&](size_t bytes){
+            paced += bytes;
+            const auto due = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(paced / bytes_per_sec));
+            if(due > std::chrono::steady_clock::now()){
+                std::unique_lock<std::mutex> lk(scrub_mutex);
+                scrub_cv.wait_until(lk, stop, due, []{ return false; });
+            }
+            return !stop.stop_requested();
+        };
+
+        for(uint32_t data_id : ids){
+            if(stop.stop_requested()){
+                break;
+            }
+            scrub_object(data_id, pace);
+        }
+        scrubbing = false;
+        if(stop.stop_requested()){
+            break;
+        }
+
+        ++scrub_passes;
+        logger->info("[scrub] Pass over {} data objects done in {}s, {} mismatches", ids.size(),
+                     std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - start).count(), scrub_mismatches - mismatches_before);
+
+        std::unique_lock<std::mutex> lk(scrub_mutex);
+        scrub_cv.wait_for(lk, stop, std::chrono::seconds(interval), []{ return false; });
+    }
+}
+
+void ChecksumStore::scrub_object(uint32_t data_id, const std::function<bool(size_t)>& pace){
+    auto sums = get(data_id);
+    if(!sums){
+        return;
+    }
+
+    if(!sums->valid()){
+        if(sums->rebuild(pace)){
+            ++scrub_rebuilt;
+            logger->info("[scrub] Rebuilt checksums of data object {}", data_id);
+            if(on_rebuilt){
+                on_rebuilt(data_id);
+            }
+        }
+        else{
+            ++scrub_busy;
+        }
+        return;
+    }
+
+    const int fd = traced_open(tiers.path(data_id).c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd == -1){
+        return;
+    }
+    // Bit rot is on the disk, not in the page cache. Only objects nobody has open are dropped from it first, hot
+    // files are checked against whatever the cache holds and get a proper read once they go cold.
+    bool cold;
+    {
+        std::lock_guard<std::mutex> lk(m);
+        cold = sums.use_count() == 1 + (pinned.contains(data_id) ? 1 : 0);
+    }
+    if(cold){
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+
+    BufferPool::Buffer buf = BufferPool::get(CHECKSUM_BLOCK);
+    for(off_t start = 0; start < sums->get_size(); start += CHECKSUM_BLOCK){
+        const uint64_t seq = sums->read_seq();
+        const size_t asked = std::min<off_t>(CHECKSUM_BLOCK, sums->get_size() - start);
+        const ssize_t bytes = pread_full(fd, buf.data(), asked, start);
+        if(bytes == -1){
+            logger->error("[scrub] Failed to read data object {} at {}: {}", data_id, start, strerror(errno));
+            break;
+        }
+
+        off_t bad;
+        const verify_t res = sums->verify(seq, start, buf.data(), bytes, asked, &bad);
+        if(res == verify_t::MISMATCH){
+            record_mismatch(data_id, bad, true);
+        }
+        else if(res == verify_t::RACED){
+            ++scrub_busy;
+        }
+        else if(res == verify_t::UNCHECKED){
+            break;
+        }
+        scrub_bytes += bytes;
+        if(!pace(bytes)){
+            break;
+        }
+    }
+    ++scrub_objects;
+
+    if(cold){
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    close(fd);
+}
+
+nlohmann::json ChecksumStore::stats_json(){
+    nlohmann::json bad = nlohmann::json::array();
+    {
+        std::lock_guard<std::mutex> lk(m);
+        for(const auto& b : bad_blocks){
+            bad.push_back({{"data_id", b.data_id}, {"offset", b.block}});
+        }
+    }
+    return {
+        {"enabled", is_enabled},
+        {"crc32c", crc32c_impl()},
+        {"block_size", CHECKSUM_BLOCK},
+        {"read_mismatches", read_mismatches.load()},
+        {"scrub", {
+            {"running", scrubber.joinable()},
+            {"scrubbing", scrubbing.load()},
+            {"passes", scrub_passes.load()},
+            {"objects", scrub_objects.load()},
+            {"bytes", scrub_bytes.load()},
+            {"mismatches", scrub_mismatches.load()},
+            {"rebuilt", scrub_rebuilt.load()},
+            {"busy", scrub_busy.load()}
+        }},
+        {"bad_blocks", std::move(bad)}
+    };
+}
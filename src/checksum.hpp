@@ -0,0 +1,187 @@
+#pragma once
+
+#include "tier.hpp"
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stop_token>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <filesystem>
+
+#include <spdlog/spdlog.h>
+#include <nlohmann/json.hpp>
+
+namespace SealFS{
+
+// CRC32C (Castagnoli) of len bytes continuing from crc (0 to start), zlib crc32() style. Uses the SSE4.2 or ARMv8
+// CRC instructions when the CPU has them, three streams at a time, and a slicing-by-8 table otherwise.
+uint32_t crc32c(uint32_t crc, const void* data, size_t len);
+// Which of those crc32c() runs on: "sse4.2", "armv8" or "table"
+const char* crc32c_impl();
+
+// Data objects are checksummed in blocks of this many bytes, the last block of an object covers whatever is left
+static constexpr off_t CHECKSUM_BLOCK = 64 * 1024;
+
+inline off_t block_floor(off_t off){ return off & ~(CHECKSUM_BLOCK - 1); }
+inline off_t block_ceil(off_t off){ return (off + CHECKSUM_BLOCK - 1) & ~(CHECKSUM_BLOCK - 1); }
+
+enum class verify_t { OK, MISMATCH, RACED, UNCHECKED };
+
+// Block checksums of one data object. Writers bracket every change to the object with begin_write() and one of
+// the end_*() calls, holding the affected blocks (whole blocks, see block_floor/ceil) in the inode's range lock
+// throughout. Readers verify without locking anything: they note read_seq() before reading and verify() tells them
+// if a write may have overlapped, in which case they retry or fall back to the range lock.
+class ObjectSums{
+public:
+    // data_path is the object itself, opened on demand to read back blocks only partially overwritten
+    ObjectSums(std::filesystem::path data_path, bool valid);
+    ~ObjectSums();
+
+    ObjectSums(const ObjectSums&) = delete;
+    ObjectSums& operator=(const ObjectSums&) = delete;
+
+    // The object was moved to another tier, read it back from there from now on
+    void relocate(std::filesystem::path to);
+
+    // Sums that are missing or stale (object written outside the daemon, crash right after a write) don't verify
+    // anything until the scrubber rebuilds them
+    bool valid();
+
+    void begin_write();
+    // len bytes of data were written at off
+    void end_write(off_t off, const char* data, size_t len);
+    // [off, off + len) now reads as zeros, without growing the object (hole punching)
+    void end_zero(off_t off, off_t len);
+    // The object was zero extended to size, if it was any shorter
+    void end_extend(off_t size);
+    // The object was truncated (or zero extended) to size
+    void end_truncate(off_t size);
+    // Nothing was changed after all (the write failed)
+    void end_unchanged();
+
+    uint64_t read_seq();
+    // Check the len bytes a read of asked bytes at the block aligned off returned against the sums. seq is
+    // read_seq() from before the read, or nullopt when the caller holds the range lock over the blocks so no write
+    // to them can be in flight. *bad is set to the offset of the first bad block on MISMATCH.
+    verify_t verify(std::optional<uint64_t> seq, off_t off, const char* data, size_t len, size_t asked, off_t* bad = nullptr);
+
+    // Recompute everything from the object, for the scrubber. Gives up (false) if a write starts in the meantime or
+    // pace, called with the size of every block read, returns false.
+    bool rebuild(const std::function<bool(size_t)>& pace);
+
+    // Sidecar file contents, along with the version they capture
+    std::pair<std::string, uint64_t> serialize();
+    // Parse a sidecar, false if it is corrupt or no longer matches the object
+    bool deserialize(const std::string& sidecar);
+    uint64_t get_version();
+    off_t get_size();
+
+    // Copy other's sums, for a reflinked or byte for byte copy of its object
+    void copy_from(ObjectSums& other);
+
+private:
+    void zero_extend(off_t to);
+    // CRC of [start, end) read back from the object, nullopt on a short read or error
+    std::optional<uint32_t> reread(off_t start, off_t end);
+    // Refresh the block starting at start from the object, giving up on the sums if it can't be read
+    void recompute(off_t start);
+    void finish();
+    int object_fd();
+
+    std::mutex m;
+    std::filesystem::path data_path;
+    int fd = -1;
+    bool is_valid;
+    off_t size = 0; // Bytes the sums cover
+    std::vector<uint32_t> crcs; // One per block
+    unsigned in_flight = 0; // Writes between begin_write() and end_*()
+    uint64_t seq = 0; // Bumped by every begin_write() and end_*()
+    uint64_t version = 0; // Bumped by every change to the sums
+};
+
+struct bad_block{
+    uint32_t data_id;
+    off_t block; // Byte offset
+};
+
+// Checksums of every data object, kept as meta/sums/<data_id>.sum sidecars written along with the data they cover
+// (see SealFSData::sync_data_object) and loaded on first use. Also runs the background scrubber.
+class ChecksumStore{
+public:
+    // Objects are found wherever tiers has them
+    ChecksumStore(DataTiers& tiers, const std::filesystem::path& sums_dir, std::shared_ptr<spdlog::logger> logger, bool enabled);
+    ~ChecksumStore();
+
+    inline bool enabled() const { return is_enabled; }
+    std::filesystem::path sidecar_path(uint32_t data_id) const;
+
+    // Sums of data_id, nullptr if checksumming is off
+    std::shared_ptr<ObjectSums> get(uint32_t data_id);
+    // Sums for a data object that was just created empty (valid), or as a copy of src (valid if src's are). Pinned,
+    // the caller has to mark the object dirty.
+    std::shared_ptr<ObjectSums> create(uint32_t data_id, std::optional<uint32_t> src = std::nullopt);
+    // Keep data_id's sums in memory until persisted() says they made it to disk
+    void pin(uint32_t data_id);
+    // Sidecar for a pinned data_id, nullopt if there is nothing new to write
+    std::optional<std::pair<std::string, uint64_t>> serialize(uint32_t data_id);
+    // The sidecar serialized at version is durable, unpin unless the sums changed since
+    void persisted(uint32_t data_id, uint64_t version);
+    // The data object is gone
+    void forget(uint32_t data_id);
+    // The data object moved to another tier
+    void relocate(uint32_t data_id);
+
+    void record_mismatch(uint32_t data_id, off_t block, bool scrub);
+
+    // Walk every data object at no more than mb_per_sec, verifying valid sums and rebuilding the rest, then sleep
+    // interval seconds and go again. rebuilt is called with each data object whose sums were rebuilt, so they get
+    // persisted.
+    void start_scrubber(size_t mb_per_sec, unsigned interval, std::function<void(uint32_t)> rebuilt);
+    void stop_scrubber();
+
+    // Verification and scrub counters, for user.sealfs.checksums
+    nlohmann::json stats_json();
+
+private:
+    void scrub_loop(std::stop_token stop, size_t mb_per_sec, unsigned interval);
+    void scrub_object(uint32_t data_id, const std::function<bool(size_t)>& pace);
+
+    DataTiers& tiers;
+    std::filesystem::path sums_dir;
+    std::shared_ptr<spdlog::logger> logger;
+    bool is_enabled;
+
+    std::mutex m;
+    std::unordered_map<uint32_t, std::weak_ptr<ObjectSums>> loaded;
+    size_t sweep_at = 1024; // Drop expired entries from loaded once it grows to this size
+    std::unordered_map<uint32_t, std::shared_ptr<ObjectSums>> pinned;
+    std::deque<bad_block> bad_blocks; // Most recent mismatches, oldest first
+    static constexpr size_t MAX_BAD_BLOCKS = 64;
+
+    std::atomic<uint64_t> read_mismatches = 0;
+    std::atomic<uint64_t> scrub_passes = 0;
+    std::atomic<uint64_t> scrub_objects = 0;
+    std::atomic<uint64_t> scrub_bytes = 0;
+    std::atomic<uint64_t> scrub_mismatches = 0;
+    std::atomic<uint64_t> scrub_rebuilt = 0;
+    std::atomic<uint64_t> scrub_busy = 0; // Blocks or objects skipped because they were being written
+    std::atomic<bool> scrubbing = false;
+
+    std::function<void(uint32_t)> on_rebuilt;
+    std::mutex scrub_mutex;
+    std::condition_variable_any scrub_cv;
+    std::jthread scrubber;
+};
+
+} // namespace SealFS
@@ -0,0 +1,252 @@
+#include "state.hpp"
+
+#include <errno.h>
+
+#include <algorithm>
+#include <format>
+#include <string_view>
+
+using namespace SealFS;
+
+// A clone is a directory that reads from a snapshot of its source until it is first looked up. Cloning takes that
+// snapshot (hidden, unless the source already is inside one) and marks the empty destination directory, nothing
+// under the source is touched. Looking the clone up copies one level of entries over: files share their data
+// objects with the source through data_sharers, subdirectories become lazy clones of their own. The snapshot goes
+// away once the last directory reading from it has been filled in.
+
+int SealFSData::clone_dir(fuse_ino_t dst, const std::string& src_path, uid_t uid, gid_t gid){
+    auto check_dst = [&]() -> int{
+        if(is_snapshot_ino(dst)){
+            return EROFS;
+        }
+        if(dst == ROOT_INODE){
+            return EINVAL;
+        }
+        auto ent = lookup_entry(dst);
+        if(!ent){
+            return ENOENT;
+        }
+        if(ent.value().get().type != sealfs_ino_t::DIR){
+            return ENOTDIR;
+        }
+        if(!may_access(ent.value().get().st, uid, gid, W_OK)){
+            return EACCES;
+        }
+        return ent.value().get().children.value().empty() ? 0 : ENOTEMPTY;
+    };
+
+    auto start_clone = [&](fuse_ino_t src, snapshot_t& snap) -> int{
+        auto j = read_partition_at(src, snap.gen);
+        if(!j){
+            logger->error("Clone source {} is missing from snapshot {}", src, snap.id);
+            return EIO;
+        }
+        usage_t usage;
+        try{
+            usage = j->at("dir").at("usage").get<usage_t>();
+        }
+        catch(const std::exception& e){
+            logger->error("Failed to read usage of clone source {}: {}", src, e.what());
+            return EIO;
+        }
+
+        // Until it is filled in, the clone accounts for what its source did
+        auto& ent = lookup_entry(dst).value().get();
+        ent.clone_src = src;
+        ent.clone_snap = snap.id;
+        usage_t delta = usage;
+        delta += -ent.usage;
+        ent.usage = usage;
+        mark_dirty(ent);
+        super_dirty = true;
+        account(ent.parent, delta);
+
+        logger->info("Directory {} is now a clone of {} as of generation {}", dst, src, snap.gen);
+        return 0;
+    };
+
+    std::string pin_name;
+    fuse_ino_t src = ROOT_INODE;
+    {
+        auto guard = lock_state();
+        std::string_view rest = src_path;
+        while(!rest.empty()){
+            const size_t slash = rest.find('/');
+            const std::string name(rest.substr(0, slash));
+            rest = slash == std::string_view::npos ? std::string_view{} : rest.substr(slash + 1);
+            if(name.empty() || name == "."){
+                continue;
+            }
+            // Same as the kernel's path walk would have asked for
+            auto dir_ent = lookup_entry(src);
+            if(dir_ent && !may_access(dir_ent.value().get().st, uid, gid, X_OK)){
+                return EACCES;
+            }
+            if((src = lookup(src, name.c_str())) == INVALID_INODE){
+                return ENOENT;
+            }
+        }
+
+        auto src_ent = lookup_entry(src);
+        if(!src_ent || src == SNAPSHOTS_DIR_INO){
+            return src_ent ? EINVAL : ENOENT;
+        }
+        if(src_ent.value().get().type != sealfs_ino_t::DIR){
+            return ENOTDIR;
+        }
+        // The clone lists the source's entries, so it takes what reading them would
+        if(!may_access(src_ent.value().get().st, uid, gid, R_OK | X_OK)){
+            return EACCES;
+        }
+        if(int err = check_dst()){
+            return err;
+        }
+
+        // Anything under .snapshots is frozen already, read straight from that snapshot
+        if(is_snapshot_ino(src)){
+            snapshot_t* snap = find_snapshot(snapshot_id_of(src));
+            if(!snap){
+                return ENOENT;
+            }
+            ++snap->clone_refs;
+            return start_clone(snapshot_orig_ino(src), *snap);
+        }
+
+        pin_name = std::format("/{}.{}", next_snapshot_id, pin_requests++);
+        pending_snapshots.push_back(pin_name);
+    }
+
+    const int err = commit();
+
+    auto guard = lock_state();
+    auto pin = std::find_if(snapshots.begin(), snapshots.end(), [&](const snapshot_t& s){ return s.name == pin_name; });
+    if(pin == snapshots.end()){
+        return err ? err : EIO;
+    }
+    pin->unclaimed = false;
+    super_dirty = true;
+
+    // dst may have been filled or removed while the lock was dropped
+    int dst_err = check_dst();
+    if(!dst_err){
+        dst_err = start_clone(src, *pin);
+    }
+    if(dst_err){
+        --pin->clone_refs;
+        release_pins();
+    }
+    return dst_err;
+}
+
+void SealFSData::materialize_clone(fuse_ino_t dir_ino){
+    inode_entry& dir = inodes.at(dir_ino);
+    fuse_ino_t src = dir.clone_src;
+    const uint32_t pin_id = dir.clone_snap;
+
+    // Cleared up front, everything below may come back through lookup_entry
+    dir.clone_src = INVALID_INODE;
+    dir.clone_snap = 0;
+    mark_dirty(dir);
+    super_dirty = true;
+
+    auto release_pin = [&]{
+        if(snapshot_t* pin = find_snapshot(pin_id)){
+            --pin->clone_refs;
+            release_pins();
+        }
+    };
+
+    snapshot_t* snap = find_snapshot(pin_id);
+    children_map src_children;
+    std::unordered_map<fuse_ino_t, inode_entry> files;
+    try{
+        auto j = snap ? read_clone_source(src, snap) : std::nullopt;
+        if(!j){
+            throw std::runtime_error("source is gone");
+        }
+        src_children = j->at("dir").at("children").get<children_map>();
+        for(const auto& file : j->at("files")){
+            inode_entry ent = file.get<inode_entry>();
+            const fuse_ino_t ino = ent.ino;
+            files.emplace(ino, std::move(ent));
+        }
+    }
+    catch(const std::exception& e){
+        logger->error("Failed to fill in cloned directory {}, leaving it empty: {}", dir_ino, e.what());
+        release_pin();
+        return;
+    }
+
+    children_map children;
+    usage_t usage{0, 0, 1};
+    for(const auto& [name, child] : src_children){
+        inode_entry ent;
+        auto file = files.find(child);
+        if(file != files.end()){
+            ent = std::move(file->second);
+            ent.ino = ent.st.st_ino = next_ino++;
+            ent.parent = dir_ino;
+            if(!ent.is_inline()){
+                adopt_data(ent);
+            }
+            usage += file_usage(ent);
+        }
+        else{
+            // Only the subdirectory's own entry is needed now, its contents wait until it is looked up
+            auto sub = read_partition_at(child, snap->gen);
+            try{
+                if(!sub){
+                    throw std::runtime_error("missing from its snapshot");
+                }
+                ent = sub->at("dir").get<inode_entry>();
+            }
+            catch(const std::exception& e){
+                logger->error("Dropping {} from cloned directory {}: {}", name, dir_ino, e.what());
+                continue;
+            }
+            ent.ino = ent.st.st_ino = next_ino++;
+            ent.parent = dir_ino;
+            ent.children.emplace();
+            ent.clone_src = child;
+            ent.clone_snap = snap->id;
+            ++snap->clone_refs;
+            usage += ent.usage;
+        }
+        ent.nlookup = 0;
+
+        const fuse_ino_t ino = ent.ino;
+        children.emplace(name, ino);
+        mark_dirty(inodes.insert_or_assign(ino, std::move(ent)).first->second);
+    }
+
+    auto& filled = inodes.at(dir_ino);
+    filled.children = std::move(children);
+    usage_t delta = usage;
+    delta += -filled.usage;
+    filled.usage = usage;
+    const fuse_ino_t parent = filled.parent;
+    logger->info("Filled in cloned directory {} with {} entries", dir_ino, filled.children->size());
+
+    account(parent, delta);
+    release_pin();
+}
+
+void SealFSData::adopt_data(const inode_entry& ent){
+    super_dirty = true;
+
+    auto sharers = data_sharers.find(ent.data_id);
+    if(sharers != data_sharers.end()){
+        sharers->second.push_back(ent.ino);
+        return;
+    }
+
+    // The live tree dropped it since the snapshot, the clone is its only user now
+    if(std::erase_if(retired_data, [&](const gen_range& r){ return r.id == ent.data_id; }) > 0){
+        return;
+    }
+
+    // Still owned by some live file, which can't be found without walking the tree. INVALID_INODE stands in for
+    // it until it lets go, see drop_sharer.
+    data_sharers.emplace(ent.data_id, std::vector<fuse_ino_t>{INVALID_INODE, ent.ino});
+    shared_sizes[ent.data_id] = ent.st.st_size;
+}
@@ -0,0 +1,155 @@
+#include "dispatch.hpp"
+#include "state.hpp"
+#include "alloc_count.hpp"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <bit>
+#include <chrono>
+#include <memory>
+
+using namespace SealFS;
+
+// CPUs for each of workers workers (0 = one per allowed CPU), -1 where they aren't pinned
+static std::vector<int> assign_cpus(unsigned workers, bool pin){
+    std::vector<int> allowed;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if(sched_getaffinity(0, sizeof(set), &set) == 0){
+        for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu){
+            if(CPU_ISSET(cpu, &set)){
+                allowed.push_back(cpu);
+            }
+        }
+    }
+    if(allowed.empty()){
+        allowed.push_back(-1);
+        pin = false;
+    }
+
+    std::vector<int> cpus(workers ? workers : allowed.size());
+    for(size_t i = 0; i < cpus.size(); ++i){
+        cpus[i] = pin ? allowed[i % allowed.size()] : -1;
+    }
+    return cpus;
+}
+
+Dispatcher::Dispatcher(struct fuse_session* se, SealFSData& fs, unsigned workers, bool pin)
+    : se(se), fs(fs), cpus(assign_cpus(workers, pin)), stats(cpus.size()){
+    for(size_t i = 0; i < cpus.size(); ++i){
+        stats[i].cpu = cpus[i];
+    }
+}
+
+int Dispatcher::run(){
+    fs.log_info("Dispatching on {} workers{}", cpus.size(), cpus.front() == -1 ? ", unpinned" : "");
+
+    workers.reserve(cpus.size());
+    for(size_t i = 0; i < cpus.size(); ++i){
+        workers.emplace_back([this, i]{ work(i); });
+    }
+
+    // The first worker to leave (signal, unmount or error) ends the session. The rest may be blocked in read()
+    // with nothing left to arrive, which is where they are cancelled, exactly like fuse_session_loop_mt does.
+    {
+        std::unique_lock<std::mutex> lk(exit_mutex);
+        exit_cv.wait(lk, [&]{ return exited > 0; });
+    }
+    fuse_session_exit(se);
+    for(auto& worker : workers){
+        pthread_cancel(worker.native_handle());
+    }
+    for(auto& worker : workers){
+        worker.join();
+    }
+    workers.clear();
+
+    fs.log_info("Dispatcher stopped: {}", stats_json().dump());
+    return error;
+}
+
+void Dispatcher::work(size_t id){
+    worker_stats& st = stats[id];
+    if(st.cpu != -1){
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(st.cpu, &set);
+        if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0){
+            fs.log_warn("Failed to pin worker {} to CPU {}, it runs unpinned", id, st.cpu);
+        }
+    }
+
+    // libfuse allocates mem on the first receive and reuses it from then on. Freed on the way out, cancelled or not.
+    struct fuse_buf buf;
+    memset(&buf, 0, sizeof(buf));
+    std::unique_ptr<void, decltype(&free)> buf_mem(nullptr, &free);
+    int res = 0;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    while(!fuse_session_exited(se)){
+        // Only cancellable while waiting for a request, never half way through one
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        res = fuse_session_receive_buf(se, &buf);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+        if(res == -EINTR){
+            continue;
+        }
+        if(res <= 0){
+            break;
+        }
+        if(buf_mem.get() != buf.mem){
+            buf_mem.release();
+            buf_mem.reset(buf.mem);
+        }
+
+        const uint64_t allocs = thread_allocations();
+        const auto start = std::chrono::steady_clock::now();
+        fuse_session_process_buf(se, &buf);
+        const uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        st.allocations.store(st.allocations.load(std::memory_order_relaxed) + thread_allocations() - allocs, std::memory_order_relaxed);
+
+        st.requests.store(st.requests.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        st.busy_ns.store(st.busy_ns.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+        if(ns > st.max_ns.load(std::memory_order_relaxed)){
+            st.max_ns.store(ns, std::memory_order_relaxed);
+        }
+        const size_t bucket = std::min<size_t>(std::bit_width(ns / 1000), LATENCY_BUCKETS - 1);
+        st.latency[bucket].store(st.latency[bucket].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    // ENODEV is the kernel telling us the filesystem was unmounted
+    std::lock_guard<std::mutex> lk(exit_mutex);
+    if(res < 0 && res != -ENODEV && error == 0){
+        error = res;
+    }
+    ++exited;
+    exit_cv.notify_one();
+}
+
+nlohmann::json Dispatcher::stats_json() const{
+    nlohmann::json workers_json = nlohmann::json::array();
+    for(const auto& st : stats){
+        nlohmann::json latency = nlohmann::json::array();
+        for(const auto& bucket : st.latency){
+            latency.push_back(bucket.load(std::memory_order_relaxed));
+        }
+        nlohmann::json worker{
+            {"cpu", st.cpu},
+            {"requests", st.requests.load(std::memory_order_relaxed)},
+            {"busy_us", st.busy_ns.load(std::memory_order_relaxed) / 1000},
+            {"max_us", st.max_ns.load(std::memory_order_relaxed) / 1000},
+            {"latency_log2_us", std::move(latency)}
+        };
+        // Left out rather than reported as 0 when nothing counts them
+        if(COUNTING_ALLOCATIONS){
+            worker["allocations"] = st.allocations.load(std::memory_order_relaxed);
+        }
+        workers_json.push_back(std::move(worker));
+    }
+    return workers_json;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "common.hpp"
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+namespace SealFS{
+
+class SealFSData;
+
+// Request latency histogram buckets: bucket 0 counts requests that took under a microsecond, bucket i > 0 those
+// that took [2^(i-1), 2^i) microseconds, the last one everything slower
+static constexpr size_t LATENCY_BUCKETS = 24;
+
+// Written only by the worker owning it, read by anyone. Cache line aligned so workers never share a line.
+struct alignas(64) worker_stats{
+    int cpu = -1; // Meant to be pinned to, -1 if not pinned
+    std::atomic<uint64_t> requests = 0;
+    std::atomic<uint64_t> busy_ns = 0;
+    std::atomic<uint64_t> max_ns = 0;
+    std::atomic<uint64_t> allocations = 0; // Heap allocations made while handling requests
+    std::array<std::atomic<uint64_t>, LATENCY_BUCKETS> latency{};
+};
+
+// Replacement for fuse_session_loop_mt: a fixed set of workers, each pinned to its own core, each with a receive
+// buffer that lives as long as it does. All of them read from the session fd, so whichever worker is idle takes the
+// next request and a backed up core never holds anything up (the kernel's input queue is shared, cloned fds only
+// split where replies are matched up). Nothing is spawned or reaped while serving.
+class Dispatcher{
+private:
+    struct fuse_session* se;
+    SealFSData& fs;
+    std::vector<int> cpus; // One per worker, -1 for unpinned
+    std::vector<worker_stats> stats;
+    std::vector<std::thread> workers;
+
+    std::mutex exit_mutex;
+    std::condition_variable exit_cv;
+    size_t exited = 0;
+    int error = 0;
+
+    void work(size_t id);
+
+public:
+    // workers == 0 runs one per CPU this process may run on. With pin, worker i is bound to the i-th of those CPUs.
+    Dispatcher(struct fuse_session* se, SealFSData& fs, unsigned workers, bool pin);
+
+    Dispatcher(const Dispatcher&) = delete;
+    Dispatcher& operator=(const Dispatcher&) = delete;
+
+    // Serve until the session exits (unmount or signal). Returns 0 or a negated errno, like fuse_session_loop_mt.
+    int run();
+
+    // Per-worker counters as JSON, for user.sealfs.workers
+    nlohmann::json stats_json() const;
+};
+
+} // namespace SealFS
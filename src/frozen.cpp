@@ -0,0 +1,266 @@
+#include "frozen.hpp"
+#include "trace.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <algorithm>
+#include <charconv>
+#include <deque>
+#include <numeric>
+
+using namespace SealFS;
+
+namespace{
+
+// Hash and displace: a name lands in bucket name_hash >> 32 mod buckets, and a bucket with displacement d puts
+// its names in slot mix(name_hash + d * GOLDEN) mod n. Displacements are found greedily, biggest buckets first.
+static constexpr uint32_t NAMES_PER_BUCKET = 4;
+static constexpr uint32_t MAX_DISPLACEMENT = 1 << 16;
+static constexpr uint64_t GOLDEN = 0x9e3779b97f4a7c15ULL;
+
+inline uint64_t name_hash(std::string_view name){
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for(unsigned char c : name){
+        h = (h ^ c) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+inline uint64_t mix(uint64_t x){
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+inline uint32_t bucket_of(uint64_t h, uint32_t buckets){
+    return static_cast<uint32_t>((h >> 32) % buckets);
+}
+
+inline uint32_t slot_of(uint64_t h, uint32_t disp, uint32_t n){
+    return static_cast<uint32_t>(mix(h + disp * GOLDEN) % n);
+}
+
+} // namespace
+
+FrozenImage::~FrozenImage(){
+    if(data_fd != -1){
+        close(data_fd);
+    }
+    if(cold_fd != -1){
+        close(cold_fd);
+    }
+}
+
+std::unique_ptr<FrozenImage> FrozenImage::build(SealFSData& fs){
+    std::unique_ptr<FrozenImage> img(new FrozenImage(fs));
+    size_t unhashed = 0;
+
+    {
+        auto guard = fs.lock_state();
+
+        img->data_fd = open((fs.get_persistence_root() / "data").c_str(), O_RDONLY | O_DIRECTORY);
+        if(img->data_fd == -1){
+            fs.log_error("Failed to open data directory for frozen image: {}", strerror(errno));
+            return nullptr;
+        }
+        if(fs.get_tiers().enabled()){
+            img->cold_fd = open((fs.get_persistence_root() / COLD_DIR_NAME).c_str(), O_RDONLY | O_DIRECTORY);
+            if(img->cold_fd == -1){
+                fs.log_error("Failed to open capacity tier for frozen image: {}", strerror(errno));
+                return nullptr;
+            }
+        }
+
+        const auto root = fs.lookup_entry(ROOT_INODE);
+        if(!root){
+            fs.log_error("No root directory to freeze");
+            return nullptr;
+        }
+        img->usage = root.value().get().usage;
+        img->used_bytes = fs.used_bytes(img->usage);
+        img->nodes.push_back({root.value().get().st, 0, INLINE_DATA_ID});
+
+        // Breadth first, a directory's children are appended in one go so they stay contiguous
+        std::deque<std::pair<fuse_ino_t, uint32_t>> queue{{ROOT_INODE, 0}};
+        while(!queue.empty()){
+            auto [ino, index] = queue.front();
+            queue.pop_front();
+
+            // Copied out, paging in the children below may touch the map
+            std::vector<std::pair<std::string, fuse_ino_t>> names;
+            {
+                const auto dir = fs.lookup_entry(ino);
+                if(!dir || !dir.value().get().children){
+                    fs.log_error("Directory {} vanished while freezing", ino);
+                    return nullptr;
+                }
+                const auto& kids = dir.value().get().children.value();
+                names.assign(kids.begin(), kids.end());
+            }
+            std::sort(names.begin(), names.end());
+
+            const uint32_t first = img->children.size();
+            for(const auto& [name, child] : names){
+                const auto ent = fs.lookup_entry(child);
+                if(!ent){
+                    fs.log_error("Leaving {} out of frozen directory {}, its entry is missing", name, ino);
+                    continue;
+                }
+                const inode_entry& e = ent.value().get();
+
+                const uint32_t node = img->nodes.size();
+                frozen_node n{e.st, index, e.data_id};
+                if(e.is_inline()){
+                    n.first = img->blob.size();
+                    n.count = e.inline_data.size();
+                    img->blob += e.inline_data;
+                }
+                else if(e.type == sealfs_ino_t::DIR){
+                    queue.emplace_back(child, node);
+                }
+                img->nodes.push_back(n);
+
+                img->children.push_back({img->blob.size(), static_cast<uint32_t>(name.size()), node});
+                img->blob += name;
+            }
+
+            frozen_node& dir = img->nodes[index];
+            dir.first = first;
+            dir.count = img->children.size() - first;
+            img->slots.resize(img->children.size());
+            if(dir.count > 0 && !img->build_hash(dir)){
+                ++unhashed;
+            }
+            img->build_dirents(index);
+        }
+    }
+
+    // Filling in lazily cloned directories above dirtied the tree
+    if(fs.commit() != 0){
+        fs.log_warn("Failed to commit directories filled in while freezing, they will be filled in again next mount");
+    }
+
+    img->nodes.shrink_to_fit();
+    img->children.shrink_to_fit();
+    img->blob.shrink_to_fit();
+    img->dirents.shrink_to_fit();
+    fs.log_info("Froze {} inodes, {} bytes of names and inline data, {} bytes of directory listings, {} directories without a perfect hash",
+        img->nodes.size(), img->blob.size(), img->dirents.size(), unhashed);
+    return img;
+}
+
+bool FrozenImage::build_hash(frozen_node& dir){
+    const uint32_t n = dir.count;
+    const uint32_t buckets = (n + NAMES_PER_BUCKET - 1) / NAMES_PER_BUCKET;
+
+    std::vector<uint64_t> hashes(n);
+    std::vector<std::vector<uint32_t>> members(buckets);
+    for(uint32_t i = 0; i < n; ++i){
+        const frozen_child& c = children[dir.first + i];
+        hashes[i] = name_hash(std::string_view(blob).substr(c.name_first, c.name_len));
+        members[bucket_of(hashes[i], buckets)].push_back(i);
+    }
+
+    std::vector<uint32_t> order(buckets);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b){ return members[a].size() > members[b].size(); });
+
+    std::vector<bool> taken(n);
+    std::vector<uint32_t> disp(buckets, 0);
+    std::vector<uint32_t> tried;
+    for(uint32_t b : order){
+        if(members[b].empty()){
+            break;
+        }
+        uint32_t d = 0;
+        for(; d < MAX_DISPLACEMENT; ++d){
+            tried.clear();
+            bool fits = true;
+            for(uint32_t i : members[b]){
+                const uint32_t slot = slot_of(hashes[i], d, n);
+                if(taken[slot] || std::find(tried.begin(), tried.end(), slot) != tried.end()){
+                    fits = false;
+                    break;
+                }
+                tried.push_back(slot);
+            }
+            if(fits){
+                break;
+            }
+        }
+        if(d == MAX_DISPLACEMENT){
+            return false;
+        }
+        disp[b] = d;
+        for(size_t k = 0; k < members[b].size(); ++k){
+            taken[tried[k]] = true;
+            slots[dir.first + tried[k]] = members[b][k];
+        }
+    }
+
+    dir.disp_first = disps.size();
+    dir.buckets = buckets;
+    disps.insert(disps.end(), disp.begin(), disp.end());
+    return true;
+}
+
+void FrozenImage::build_dirents(uint32_t index){
+    const size_t start = dirents.size();
+    auto add = [&](const char* name, const struct stat& st){
+        // fuse_add_direntry doesn't use req, and only reads the type and ino out of st
+        const size_t len = fuse_add_direntry(nullptr, nullptr, 0, name, nullptr, 0);
+        const size_t at = dirents.size();
+        dirents.resize(at + len);
+        fuse_add_direntry(nullptr, dirents.data() + at, len, name, &st, at + len - start);
+    };
+
+    const frozen_node& dir = nodes[index];
+    add(".", dir.st);
+    add("..", nodes[dir.parent].st);
+    std::string name;
+    for(uint64_t i = dir.first; i < dir.first + dir.count; ++i){
+        const frozen_child& c = children[i];
+        name.assign(blob, c.name_first, c.name_len);
+        add(name.c_str(), nodes[c.node].st);
+    }
+
+    nodes[index].dirents_first = start;
+    nodes[index].dirents_len = dirents.size() - start;
+}
+
+fuse_ino_t FrozenImage::lookup(const frozen_node& dir, std::string_view name) const{
+    if(dir.count == 0){
+        return 0;
+    }
+
+    const frozen_child* kids = children.data() + dir.first;
+    auto name_of = [&](const frozen_child& c){ return std::string_view(blob.data() + c.name_first, c.name_len); };
+
+    if(dir.buckets > 0){
+        const uint64_t h = name_hash(name);
+        const uint32_t slot = slot_of(h, disps[dir.disp_first + bucket_of(h, dir.buckets)], dir.count);
+        const frozen_child& c = kids[slots[dir.first + slot]];
+        return name_of(c) == name ? c.node + 1 : 0;
+    }
+
+    const frozen_child* end = kids + dir.count;
+    const frozen_child* it = std::lower_bound(kids, end, name, [&](const frozen_child& c, std::string_view n){ return name_of(c) < n; });
+    return it != end && name_of(*it) == name ? it->node + 1 : 0;
+}
+
+int FrozenImage::open_data(uint32_t data_id) const{
+    char path[16];
+    auto [end, ec] = std::to_chars(path, path + sizeof(path) - 6, data_id);
+    memcpy(end, ".data", 6);
+    SEALFS_TRACE1(io__open__start, path);
+    int fd = openat(data_fd, path, O_RDONLY);
+    if(fd == -1 && errno == ENOENT && cold_fd != -1){
+        fd = openat(cold_fd, path, O_RDONLY);
+    }
+    SEALFS_TRACE1(io__open__done, fd == -1 ? -errno : fd);
+    return fd;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "common.hpp"
+#include "state.hpp"
+
+#include <sys/stat.h>
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace SealFS{
+
+// One inode of a frozen image. Directories own [first, first + count) of FrozenImage::children, inline files
+// keep their contents at [first, first + count) of FrozenImage::blob. Offsets into blob and dirents are 64 bit, either
+// can grow past 4 GiB on a big enough tree.
+struct frozen_node{
+    struct stat st;
+    uint32_t parent; // Node index, the root is its own parent
+    uint32_t data_id;
+    uint64_t first = 0;
+    uint32_t count = 0;
+    // Directories only: perfect hash displacements in [disp_first, disp_first + buckets) of FrozenImage::disps
+    // (buckets == 0 if none could be built, lookups then binary search), readdir reply in FrozenImage::dirents
+    uint32_t disp_first = 0;
+    uint32_t buckets = 0;
+    uint64_t dirents_first = 0;
+    uint64_t dirents_len = 0;
+};
+
+struct frozen_child{
+    uint64_t name_first; // Into FrozenImage::blob
+    uint32_t name_len;
+    uint32_t node;
+};
+
+// Read-only compiled copy of a SealFSData tree for -o frozen mounts. Everything is laid out in a handful of flat
+// arrays once at mount: packed stat records, children sorted by name, a minimal perfect hash (hash and displace)
+// over each directory's names and its complete readdir reply. Nothing changes afterwards, so serving lookup,
+// getattr and readdir takes no lock and allocates nothing.
+class FrozenImage{
+private:
+    SealFSData* fs; // Only for logging and config, never touched while serving
+    std::vector<frozen_node> nodes;
+    std::vector<frozen_child> children;
+    std::vector<uint32_t> slots; // Parallel to children: hash slot -> index of the child within its directory
+    std::vector<uint32_t> disps;
+    std::string blob; // Names and inline contents
+    std::vector<char> dirents; // Packed fuse_direntrys, offsets relative to each directory's own reply
+    usage_t usage;
+    int64_t used_bytes = 0; // Shared objects counted once, see SealFSData::used_bytes
+    int data_fd = -1;
+    int cold_fd = -1; // Capacity tier, if there is one. Objects don't move while frozen (see migrate_loop).
+
+    FrozenImage(SealFSData& fs) : fs(&fs){}
+
+    // Build dir's perfect hash over its (already sorted) children, false if no displacement works for some bucket
+    bool build_hash(frozen_node& dir);
+    void build_dirents(uint32_t dir);
+
+public:
+    ~FrozenImage();
+
+    FrozenImage(const FrozenImage&) = delete;
+    FrozenImage& operator=(const FrozenImage&) = delete;
+
+    // Page in the whole tree and compile it, nullptr on failure. Lazily cloned directories are filled in (and
+    // committed) first, the only write a frozen mount ever makes. Must be called without the state lock held.
+    static std::unique_ptr<FrozenImage> build(SealFSData& fs);
+
+    // FUSE node ids are node index + 1, so the root is FUSE_ROOT_ID. nullptr for anything else.
+    inline const frozen_node* node(fuse_ino_t ino) const{
+        return ino - 1 < nodes.size() ? &nodes[ino - 1] : nullptr;
+    }
+    // Node id of name in dir, 0 if there is none
+    fuse_ino_t lookup(const frozen_node& dir, std::string_view name) const;
+
+    inline std::string_view inline_data(const frozen_node& file) const { return std::string_view(blob).substr(file.first, file.count); }
+    inline std::string_view dir_reply(const frozen_node& dir) const { return std::string_view(dirents.data() + dir.dirents_first, dir.dirents_len); }
+    // Read-only fd on a data object, -1 (errno set) on failure
+    int open_data(uint32_t data_id) const;
+
+    inline const usage_t& get_usage() const { return usage; }
+    inline int64_t get_used_bytes() const { return used_bytes; }
+    inline SealFSData& get_fs() const { return *fs; }
+};
+
+} // namespace SealFS
@@ -0,0 +1,261 @@
+#include "common.hpp"
+#include "frozen.hpp"
+#include "ll_ops.hpp"
+#include "trace.hpp"
+
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string_view>
+
+// Ops for -o frozen mounts, served straight out of a FrozenImage. Nothing in the image ever changes, so there is
+// no locking, no per-request logging, and the kernel is told to cache entries, attributes, listings and file
+// contents for as long as it likes.
+
+// Seconds, effectively forever
+static constexpr double FROZEN_TIMEOUT = 1e9;
+
+// Inline files have no fd behind their handle
+static constexpr uint64_t INLINE_FH = static_cast<uint64_t>(-1);
+
+static inline const SealFS::FrozenImage* image_of(fuse_req_t req){
+    return static_cast<const SealFS::FrozenImage*>(fuse_req_userdata(req));
+}
+
+static void frozen_init(void* userdata, struct fuse_conn_info *conn){
+    const SealFS::FrozenImage* img = static_cast<const SealFS::FrozenImage*>(userdata);
+    SealFS::SealFSData& fs = img->get_fs();
+
+    const size_t readahead_kb = fs.get_config().readahead_kb;
+    if(readahead_kb > 0){
+        conn->max_readahead = std::min<size_t>(conn->max_readahead, readahead_kb * 1024);
+    }
+
+    // Reads reply with the data object's fd, which libfuse can splice instead of copying
+    if(conn->capable & FUSE_CAP_SPLICE_WRITE){
+        conn->want |= FUSE_CAP_SPLICE_WRITE;
+    }
+    fs.log_info("[frozen_init] max_readahead: {} splice: {}", conn->max_readahead, (conn->want & FUSE_CAP_SPLICE_WRITE) != 0);
+}
+
+static void frozen_lookup(fuse_req_t req, fuse_ino_t parent, const char* name){
+    SEALFS_TRACE_OP("lookup", parent);
+    const SealFS::FrozenImage* img = image_of(req);
+    const SealFS::frozen_node* dir = img->node(parent);
+    if(!dir){
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    if(!S_ISDIR(dir->st.st_mode)){
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+
+    // A miss is replied as a cacheable negative entry (ino 0), the name can't appear later
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.ino = img->lookup(*dir, name);
+    e.entry_timeout = FROZEN_TIMEOUT;
+    if(e.ino != 0){
+        e.attr = img->node(e.ino)->st;
+        e.attr_timeout = FROZEN_TIMEOUT;
+    }
+    fuse_reply_entry(req, &e);
+}
+
+// Node ids are never reused or dropped, nothing to count
+static void frozen_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup){
+    SEALFS_TRACE_OP("forget", ino);
+    (void) ino;
+    (void) nlookup;
+    fuse_reply_none(req);
+}
+
+static void frozen_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+    SEALFS_TRACE_OP("getattr", ino);
+    (void) fi;
+    const SealFS::frozen_node* node = image_of(req)->node(ino);
+    if(!node){
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    fuse_reply_attr(req, &node->st, FROZEN_TIMEOUT);
+}
+
+static void frozen_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi){
+    SEALFS_TRACE_OP("opendir", ino);
+    const SealFS::frozen_node* node = image_of(req)->node(ino);
+    if(!node){
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    if(!S_ISDIR(node->st.st_mode)){
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    fi->fh = 0;
+    fi->keep_cache = 1;
+    fi->cache_readdir = 1;
+    fuse_reply_open(req, fi);
+}
+
+// Every directory's whole reply is compiled in, readdir only picks the window the kernel asked for
+static void frozen_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi){
+    SEALFS_TRACE_OP("readdir", ino);
+    (void) fi;
+    const SealFS::FrozenImage* img = image_of(req);
+    const SealFS::frozen_node* node = img->node(ino);
+    if(!node || !S_ISDIR(node->st.st_mode)){
+        fuse_reply_err(req, node ? ENOTDIR : ENOENT);
+        return;
+    }
+
+    const std::string_view reply = img->dir_reply(*node);
+    if(off >= static_cast<off_t>(reply.size())){
+        fuse_reply_buf(req, NULL, 0);
+        return;
+    }
+    fuse_reply_buf(req, reply.data() + off, std::min(size, reply.size() - off));
+}
+
+static void frozen_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+    SEALFS_TRACE_OP("open", ino);
+    const SealFS::FrozenImage* img = image_of(req);
+    const SealFS::frozen_node* node = img->node(ino);
+    if(!node){
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    if(S_ISDIR(node->st.st_mode)){
+        fuse_reply_err(req, EISDIR);
+        return;
+    }
+    if((fi->flags & O_ACCMODE) != O_RDONLY || (fi->flags & O_TRUNC)){
+        fuse_reply_err(req, EROFS);
+        return;
+    }
+
+    if(node->data_id == SealFS::INLINE_DATA_ID){
+        fi->fh = INLINE_FH;
+    }
+    else{
+        int fd = img->open_data(node->data_id);
+        if(fd == -1){
+            img->get_fs().log_error("[frozen_open] Failed to open data object {} of ino {}: {}", node->data_id, ino, strerror(errno));
+            fuse_reply_err(req, EIO);
+            return;
+        }
+        fi->fh = fd;
+    }
+    fi->keep_cache = 1;
+    fuse_reply_open(req, fi);
+}
+
+static void frozen_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi){
+    SEALFS_TRACE_OP("read", ino);
+    if(fi->fh == INLINE_FH){
+        const std::string_view data = image_of(req)->inline_data(*image_of(req)->node(ino));
+        if(off >= static_cast<off_t>(data.size())){
+            fuse_reply_buf(req, NULL, 0);
+        }
+        else{
+            fuse_reply_buf(req, data.data() + off, std::min(size, data.size() - off));
+        }
+        return;
+    }
+
+    // Hand libfuse the fd, it splices into the reply where it can instead of bouncing through a buffer
+    struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
+    buf.buf[0].flags = static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+    buf.buf[0].fd = static_cast<int>(fi->fh);
+    buf.buf[0].pos = off;
+    fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
+}
+
+static void frozen_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+    SEALFS_TRACE_OP("release", ino);
+    (void) ino;
+    if(fi->fh != INLINE_FH){
+        close(static_cast<int>(fi->fh));
+    }
+    fuse_reply_err(req, 0);
+}
+
+static void frozen_statfs(fuse_req_t req, fuse_ino_t ino){
+    SEALFS_TRACE_OP("statfs", ino);
+    (void) ino;
+    const SealFS::FrozenImage* img = image_of(req);
+
+    struct statvfs backing;
+    if(statvfs(img->get_fs().get_persistence_root().c_str(), &backing) == -1){
+        fuse_reply_err(req, errno);
+        return;
+    }
+
+    const SealFS::usage_t& usage = img->get_usage();
+    const unsigned long frsize = backing.f_frsize ? backing.f_frsize : backing.f_bsize;
+    const fsblkcnt_t used = (img->get_used_bytes() + frsize - 1) / frsize;
+
+    struct statvfs st;
+    memset(&st, 0, sizeof(st));
+    st.f_bsize = backing.f_bsize;
+    st.f_frsize = frsize;
+    st.f_blocks = used;
+    st.f_files = usage.inodes;
+    st.f_namemax = 255;
+    st.f_flag = ST_RDONLY;
+
+    fuse_reply_statfs(req, &st);
+}
+
+// Anything that would change the tree. The mount is also made with -o ro, so the kernel mostly turns these away
+// before they get here.
+static void frozen_setattr(fuse_req_t req, fuse_ino_t, struct stat*, int, struct fuse_file_info*){ fuse_reply_err(req, EROFS); }
+static void frozen_mknod(fuse_req_t req, fuse_ino_t, const char*, mode_t, dev_t){ fuse_reply_err(req, EROFS); }
+static void frozen_mkdir(fuse_req_t req, fuse_ino_t, const char*, mode_t){ fuse_reply_err(req, EROFS); }
+static void frozen_unlink(fuse_req_t req, fuse_ino_t, const char*){ fuse_reply_err(req, EROFS); }
+static void frozen_symlink(fuse_req_t req, const char*, fuse_ino_t, const char*){ fuse_reply_err(req, EROFS); }
+static void frozen_rename(fuse_req_t req, fuse_ino_t, const char*, fuse_ino_t, const char*, unsigned int){ fuse_reply_err(req, EROFS); }
+static void frozen_link(fuse_req_t req, fuse_ino_t, fuse_ino_t, const char*){ fuse_reply_err(req, EROFS); }
+static void frozen_write(fuse_req_t req, fuse_ino_t, const char*, size_t, off_t, struct fuse_file_info*){ fuse_reply_err(req, EROFS); }
+static void frozen_setxattr(fuse_req_t req, fuse_ino_t, const char*, const char*, size_t, int){ fuse_reply_err(req, EROFS); }
+static void frozen_removexattr(fuse_req_t req, fuse_ino_t, const char*){ fuse_reply_err(req, EROFS); }
+static void frozen_create(fuse_req_t req, fuse_ino_t, const char*, mode_t, struct fuse_file_info*){ fuse_reply_err(req, EROFS); }
+static void frozen_fallocate(fuse_req_t req, fuse_ino_t, int, off_t, off_t, struct fuse_file_info*){ fuse_reply_err(req, EROFS); }
+
+const struct fuse_lowlevel_ops sealfs_frozen_oper = {
+    .init = frozen_init,
+    .lookup = frozen_lookup,
+    .forget = frozen_forget,
+    .getattr = frozen_getattr,
+    .setattr = frozen_setattr,
+
+    .mknod = frozen_mknod,
+    .mkdir = frozen_mkdir,
+    .unlink = frozen_unlink,
+    .rmdir = frozen_unlink,
+    .symlink = frozen_symlink,
+    .rename = frozen_rename,
+    .link = frozen_link,
+
+    .open = frozen_open,
+    .read = frozen_read,
+    .write = frozen_write,
+
+    .release = frozen_release,
+
+    .opendir = frozen_opendir,
+    .readdir = frozen_readdir,
+    .statfs = frozen_statfs,
+    .setxattr = frozen_setxattr,
+    .removexattr = frozen_removexattr,
+
+    .create = frozen_create,
+
+    .fallocate = frozen_fallocate,
+};
@@ -0,0 +1,290 @@
+#include "fsck.hpp"
+#include "state.hpp"
+#include "parallel.hpp"
+
+#include <chrono>
+#include <fstream>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+using namespace SealFS;
+
+namespace{
+
+struct file_ref{
+    fuse_ino_t ino;
+    fuse_ino_t partition;
+    uint32_t data_id;
+    off_t size;
+};
+
+// What one worker collected from the partitions it parsed
+struct partition_scan{
+    std::vector<file_ref> files;
+    std::vector<fuse_ino_t> dirs; // Partitions that parsed fine
+    std::vector<std::pair<fuse_ino_t, fuse_ino_t>> child_dirs; // (parent, child) directory links
+};
+
+// Don't flood the log on a badly broken root, counts in the report stay exact
+static constexpr size_t MAX_LOGGED_PROBLEMS = 1000;
+
+std::optional<json> read_partition(const std::filesystem::path& meta_dir, fuse_ino_t ino){
+    std::ifstream in(meta_dir / (std::to_string(ino) + ".json"));
+    if(!in.is_open()){
+        return std::nullopt;
+    }
+    json j;
+    in >> j;
+    return j;
+}
+
+} // namespace
+
+size_t fsck_report::problems() const{
+    return bad_partitions + missing_partitions + orphan_partitions + missing_data + size_mismatches + orphan_data + unexpected_files;
+}
+
+Fsck::Fsck(const std::filesystem::path& meta_dir, DataTiers& tiers, std::shared_ptr<spdlog::logger> logger, unsigned workers, uint32_t data_id_limit)
+    : meta_dir(meta_dir), tiers(tiers), logger(std::move(logger)), workers(workers ? workers : default_worker_count()), data_id_limit(data_id_limit){}
+
+const fsck_report& Fsck::run_sync(){
+    run(std::stop_token{}, false);
+    return report;
+}
+
+void Fsck::start_async(std::function<bool(uint32_t)> changing_){
+    changing = std::move(changing_);
+    runner = std::jthread([this](std::stop_token stop){
+        run(stop, true);
+    });
+}
+
+void Fsck::run(std::stop_token stop, bool live){
+    const auto start = std::chrono::steady_clock::now();
+    std::atomic<size_t> logged = 0;
+
+    auto problem = [&]<typename... Args>(std::atomic<size_t>& counter, fmt::format_string<Args...> fmt, Args&&... args){
+        ++counter;
+        if(logged.fetch_add(1, std::memory_order_relaxed) < MAX_LOGGED_PROBLEMS){
+            logger->warn(fmt, std::forward<Args>(args)...);
+        }
+    };
+
+    logger->info("[fsck] Starting {} check of {} with {} workers", live ? "background" : "startup", meta_dir.parent_path().string(), workers);
+
+    std::vector<fuse_ino_t> partition_inos;
+    std::vector<std::pair<uint32_t, std::filesystem::path>> data_files;
+    try{
+        for(const auto& entry : std::filesystem::directory_iterator(meta_dir)){
+            if(auto ino = parse_id_filename<fuse_ino_t>(entry.path().filename().native(), ".json")){
+                partition_inos.push_back(*ino);
+            }
+        }
+        for(const auto& dir : tiers.dirs()){
+            for(const auto& entry : std::filesystem::directory_iterator(dir)){
+                const std::string fname = entry.path().filename().string();
+                // A copy the migrator is still writing, or one a crash left behind for the next mount to clean up
+                if(fname.ends_with(STAGING_SUFFIX)){
+                    continue;
+                }
+                auto data_id = parse_id_filename<uint32_t>(fname, ".data");
+                if(!data_id || !entry.is_regular_file()){
+                    problem(report.unexpected_files, "[fsck] Unexpected entry in {}: {}", dir.string(), fname);
+                    continue;
+                }
+                data_files.emplace_back(*data_id, entry.path());
+            }
+        }
+    }
+    catch(const std::exception& e){
+        logger->error("[fsck] Failed to list persistence root: {}", e.what());
+        report.done = true;
+        return;
+    }
+    report.partitions_total = partition_inos.size();
+    report.data_total = data_files.size();
+
+    // Parse every partition and stat every data object concurrently
+    std::vector<partition_scan> scans(workers);
+    parallel_for(partition_inos.size(), workers, stop, [&](unsigned worker, size_t i){
+        const fuse_ino_t ino = partition_inos[i];
+        auto& scan = scans[worker];
+        try{
+            auto j = read_partition(meta_dir, ino);
+            if(!j){
+                // Directory removed since we listed meta/
+                if(!live){
+                    problem(report.bad_partitions, "[fsck] Partition {} vanished during check", ino);
+                }
+                ++report.partitions_checked;
+                return;
+            }
+
+            inode_entry dir = j->at("dir").get<inode_entry>();
+            if(dir.ino != ino || dir.type != sealfs_ino_t::DIR || !dir.children){
+                problem(report.bad_partitions, "[fsck] Partition {} does not describe directory {}", ino, ino);
+                ++report.partitions_checked;
+                return;
+            }
+
+            std::unordered_set<fuse_ino_t> file_inos;
+            for(const auto& file : j->at("files")){
+                const fuse_ino_t file_ino = file.at("ino").get<fuse_ino_t>();
+                const uint32_t data_id = file.at("data_id").get<uint32_t>();
+                file_inos.insert(file_ino);
+                if(data_id != INLINE_DATA_ID){
+                    scan.files.push_back({file_ino, ino, data_id, file.at("st").at("size").get<off_t>()});
+                }
+            }
+            for(const auto& [name, child] : dir.children.value()){
+                if(!file_inos.contains(child)){
+                    scan.child_dirs.emplace_back(ino, child);
+                }
+            }
+            scan.dirs.push_back(ino);
+        }
+        catch(const std::exception& e){
+            problem(report.bad_partitions, "[fsck] Failed to parse partition {}: {}", ino, e.what());
+        }
+        ++report.partitions_checked;
+    });
+    logger->info("[fsck] Parsed {}/{} partitions", report.partitions_checked.load(), report.partitions_total.load());
+
+    std::vector<std::optional<uintmax_t>> data_sizes(data_files.size());
+    parallel_for(data_files.size(), workers, stop, [&](unsigned, size_t i){
+        std::error_code ec;
+        auto size = std::filesystem::file_size(data_files[i].second, ec);
+        if(!ec){
+            data_sizes[i] = size;
+        }
+        ++report.data_checked;
+    });
+    logger->info("[fsck] Checked {}/{} data objects", report.data_checked.load(), report.data_total.load());
+
+    if(stop.stop_requested()){
+        logger->info("[fsck] Cancelled");
+        report.done = true;
+        return;
+    }
+
+    std::unordered_map<uint32_t, uintmax_t> sizes;
+    sizes.reserve(data_files.size());
+    for(size_t i = 0; i < data_files.size(); ++i){
+        if(data_sizes[i]){
+            sizes.emplace(data_files[i].first, *data_sizes[i]);
+        }
+    }
+
+    std::unordered_set<fuse_ino_t> dirs;
+    std::unordered_set<fuse_ino_t> linked_dirs;
+    for(const auto& scan : scans){
+        dirs.insert(scan.dirs.begin(), scan.dirs.end());
+        for(const auto& [parent, child] : scan.child_dirs){
+            linked_dirs.insert(child);
+        }
+    }
+
+    // When live, anything odd may just be a concurrent modification, so look again before calling it a problem
+    auto still_referenced = [&](fuse_ino_t partition, fuse_ino_t ino, uint32_t data_id) -> std::optional<off_t>{
+        try{
+            auto j = read_partition(meta_dir, partition);
+            if(!j) return std::nullopt;
+            for(const auto& file : j->at("files")){
+                if(file.at("ino").get<fuse_ino_t>() == ino && file.at("data_id").get<uint32_t>() == data_id){
+                    return file.at("st").at("size").get<off_t>();
+                }
+            }
+        }
+        catch(const std::exception&){}
+        return std::nullopt;
+    };
+
+    for(const auto& scan : scans){
+        for(const auto& [parent, child] : scan.child_dirs){
+            if(!dirs.contains(child) && !(live && std::filesystem::exists(meta_dir / (std::to_string(child) + ".json")))){
+                problem(report.missing_partitions, "[fsck] Directory {} under {} has no partition", child, parent);
+            }
+        }
+    }
+
+    for(fuse_ino_t dir : dirs){
+        if(dir == ROOT_INODE || linked_dirs.contains(dir)){
+            continue;
+        }
+        if(live){
+            try{
+                auto j = read_partition(meta_dir, dir);
+                if(!j) continue;
+                auto parent_j = read_partition(meta_dir, j->at("dir").at("parent").get<fuse_ino_t>());
+                if(parent_j && parent_j->at("dir").at("children").contains(j->at("dir").at("name").get<std::string>())){
+                    continue;
+                }
+            }
+            catch(const std::exception&){}
+        }
+        problem(report.orphan_partitions, "[fsck] Partition {} is not referenced by any directory", dir);
+    }
+
+    // Data objects the live tree dropped but a snapshot still reads are only referenced from partition versions
+    std::unordered_set<uint32_t> referenced;
+    try{
+        std::ifstream in(meta_dir / "super.json");
+        if(in.is_open()){
+            json super;
+            in >> super;
+            for(const auto& range : super.value("retired_data", json::array())){
+                referenced.insert(range.at(0).get<uint32_t>());
+            }
+        }
+    }
+    catch(const std::exception& e){
+        logger->warn("[fsck] Failed to read retired data objects from super.json: {}", e.what());
+    }
+    for(const auto& scan : scans){
+        for(const auto& file : scan.files){
+            referenced.insert(file.data_id);
+
+            auto it = sizes.find(file.data_id);
+            if(it == sizes.end()){
+                if(live && (!still_referenced(file.partition, file.ino, file.data_id) || tiers.exists(file.data_id))){
+                    continue;
+                }
+                problem(report.missing_data, "[fsck] Ino {} references missing data object {}", file.ino, file.data_id);
+            }
+            else if(static_cast<uintmax_t>(file.size) != it->second){
+                if(live){
+                    auto size = still_referenced(file.partition, file.ino, file.data_id);
+                    std::error_code ec;
+                    auto data_size = std::filesystem::file_size(tiers.path(file.data_id), ec);
+                    if(!size || ec || static_cast<uintmax_t>(*size) == data_size || changing(file.data_id)){
+                        continue;
+                    }
+                }
+                problem(report.size_mismatches, "[fsck] Ino {} has size {} but data object {} has size {}", file.ino, file.size, file.data_id, it->second);
+            }
+        }
+    }
+
+    for(const auto& [data_id, size] : sizes){
+        if(data_id >= data_id_limit || referenced.contains(data_id)){
+            continue;
+        }
+        if(live && !tiers.exists(data_id)){
+            continue;
+        }
+        problem(report.orphan_data, "[fsck] Data object {} ({} bytes) is not referenced by any file", data_id, size);
+    }
+
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    if(report.problems()){
+        logger->error("[fsck] Found {} problems in {} partitions and {} data objects ({} ms)", report.problems(), report.partitions_total.load(), report.data_total.load(), elapsed.count());
+    }
+    else{
+        logger->info("[fsck] Clean: {} partitions and {} data objects ({} ms)", report.partitions_total.load(), report.data_total.load(), elapsed.count());
+    }
+    report.done = true;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "common.hpp"
+#include "tier.hpp"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <filesystem>
+#include <functional>
+
+#include <spdlog/spdlog.h>
+
+namespace SealFS{
+
+// Counters filled in by a Fsck run, readable while an async run is still going
+struct fsck_report{
+    std::atomic<size_t> partitions_checked = 0;
+    std::atomic<size_t> partitions_total = 0;
+    std::atomic<size_t> data_checked = 0;
+    std::atomic<size_t> data_total = 0;
+
+    std::atomic<size_t> bad_partitions = 0; // Unreadable, or not describing the directory they are named after
+    std::atomic<size_t> missing_partitions = 0; // Directory referenced by a parent but without a partition
+    std::atomic<size_t> orphan_partitions = 0; // Partition no directory references
+    std::atomic<size_t> missing_data = 0; // File whose data object does not exist
+    std::atomic<size_t> size_mismatches = 0; // File whose st_size differs from its data object's size
+    std::atomic<size_t> orphan_data = 0; // Data object no file references
+    std::atomic<size_t> unexpected_files = 0; // Anything in a data tier that isn't a <n>.data regular file
+
+    std::atomic<bool> done = false;
+
+    size_t problems() const;
+};
+
+// Consistency check of a persistence root: every partition parses and is reachable, every file's data object exists
+// with the expected size, and every data object is referenced. Works purely off what is on disk, so it can run while
+// the tree is mounted and being modified; problems seen in that mode are re-checked before being reported.
+class Fsck{
+private:
+    std::filesystem::path meta_dir;
+    DataTiers& tiers;
+    std::shared_ptr<spdlog::logger> logger;
+    unsigned workers;
+    // Data ids at or past this were allocated after the check started, so aren't expected to be referenced yet
+    uint32_t data_id_limit;
+
+    fsck_report report;
+    std::jthread runner;
+    // Live runs only: whether a data object may be written or have its size committed right now
+    std::function<bool(uint32_t)> changing;
+
+    void run(std::stop_token stop, bool live);
+
+public:
+    Fsck(const std::filesystem::path& meta_dir, DataTiers& tiers, std::shared_ptr<spdlog::logger> logger, unsigned workers, uint32_t data_id_limit);
+
+    // Check on the calling thread, returns once done
+    const fsck_report& run_sync();
+    // Check on a background thread while the tree is mounted, progress/results via get_report(). A size mismatch
+    // on an object changing() says may be in flux is left alone, on disk it is allowed to run ahead of its metadata
+    // until the next commit.
+    void start_async(std::function<bool(uint32_t)> changing);
+
+    inline const fsck_report& get_report() const { return report; }
+};
+
+} // namespace SealFS
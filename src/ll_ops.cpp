@@ -1,6 +1,8 @@
 #include "common.hpp"
 #include "state.hpp"
 #include "ll_ops.hpp"
+#include "trace.hpp"
+#include "dispatch.hpp"
 
 #include <sys/stat.h>
 #include <time.h>
@@ -11,16 +13,163 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <assert.h>
+#include <linux/falloc.h>
+#include <sys/statvfs.h>
 
 #include <iostream>
 #include <format>
 
-void sealfs_init(void* userdata, struct fuse_conn_info *conn){
-    (void) conn;
+// Wrap fd, open on ent's data object, for a handle. Its checksums are checked on every read unless the file opted out.
+static std::shared_ptr<SealFS::OpenObject> make_object(SealFS::SealFSData* fs, const SealFS::inode_entry& ent, int fd){
+    auto obj = std::make_shared<SealFS::OpenObject>(fd, ent.data_id);
+    obj->sums = fs->get_checksums().get(ent.data_id);
+    obj->verify = obj->sums && !ent.noverify;
+    return obj;
+}
+
+// Open the data file behind a handle that was opened while its file was still inline, returns 0 or an errno
+static int open_backing_fd(SealFS::SealFSData* fs, const SealFS::inode_entry& ent, SealFS::FileHandle* h){
+    int fd = fs->open_object(ent.data_id, h->flags & O_ACCMODE);
+    if(fd == -1){
+        fs->log_error("Failed to get fd for data object {} of ino {}", ent.data_id, ent.ino);
+        return errno;
+    }
+    h->set_object(make_object(fs, ent, fd));
+    return 0;
+}
+
+// Let go of a handle's object if it is not ent's data object anymore (CoW broken, truncated). Requests still using
+// it keep its fd open until they are done. Call with the state lock held.
+static void drop_stale_fd(SealFS::SealFSData* fs, const SealFS::inode_entry& ent, SealFS::FileHandle* h){
+    std::shared_ptr<SealFS::OpenObject> keep = h->obj;
+    if(keep && (ent.is_inline() || keep->data_id != ent.data_id)){
+        fs->put_object(keep->data_id);
+        keep.reset();
+    }
+    h->set_object(std::move(keep));
+}
+
+// Point f->obj at ino's current data object so it can be written, first giving the file a private copy if a CoW copy
+// or snapshot still shares the object, and count the write in flight (SealFSData::end_data_write() once it's done).
+// Call with the state lock held, it may be dropped meanwhile. Returns 0, an errno, or EAGAIN if the file went back
+// to being inline while it was, the caller then starts over.
+static int prepare_data_write(SealFS::SealFSData* fs, std::unique_lock<std::mutex>& guard, fuse_ino_t ino, SealFS::FileHandle* f){
+    for(;;){
+        const auto cur_ent = fs->lookup_entry(ino);
+        if(!cur_ent){
+            return ENOENT;
+        }
+        auto& ent = cur_ent.value().get();
+        if(ent.is_inline()){
+            return EAGAIN;
+        }
+        if(fs->needs_cow(ent)){
+            int err = fs->break_cow(ino, guard);
+            if(err){
+                return err;
+            }
+            continue;
+        }
+
+        // The fd is on the object the file had when it was opened or last written, which it may have moved off since
+        drop_stale_fd(fs, ent, f);
+        if(!f->obj){
+            int err = open_backing_fd(fs, ent, f);
+            if(err){
+                return err;
+            }
+        }
+
+        // A snapshot was just taken, the object may need CoW now
+        if(!fs->begin_data_write(guard)){
+            continue;
+        }
+        return 0;
+    }
+}
+
+// Handles that can write keep their inode's mappings out of use until they are released
+static SealFS::FileHandle* new_handle(SealFS::SealFSData* fs, fuse_ino_t ino, int flags, std::shared_ptr<SealFS::OpenObject> obj){
+    SealFS::FileHandle* h = new SealFS::FileHandle();
+    h->flags = flags;
+    h->io = fs->get_inode_io(ino);
+    h->set_object(std::move(obj));
+    if((flags & O_ACCMODE) != O_RDONLY){
+        ++h->io->writers;
+    }
+    return h;
+}
 
+// With passthrough negotiated, hand the backing fd of a read-only handle to the kernel so its reads skip the daemon.
+// Writes always come through the daemon, which has to give the file a private copy before one lands in an object a
+// CoW copy or snapshot still shares. A passthrough reader stays on the object it was opened on, so none is handed
+// out while the file is open for writing. The kernel refuses to mix passthrough and page cached handles on one
+// inode, or passthrough handles on different backing files, so a handle that can't join the inode's current mode
+// falls back to direct I/O through the daemon.
+static void setup_io_mode(SealFS::SealFSData* fs, fuse_req_t req, struct fuse_file_info* fi, SealFS::FileHandle* h){
+    SealFS::InodeIO& io = *h->io;
+    if(!fs->is_passthrough_active()){
+        return;
+    }
+
+#ifdef FUSE_CAP_PASSTHROUGH
+    if(h->obj && io.cached_handles == 0 && (h->flags & O_ACCMODE) == O_RDONLY && io.writers == 0){
+        if(io.backing_id == 0){
+            int backing_id = fuse_passthrough_open(req, h->obj->fd);
+            if(backing_id > 0){
+                io.backing_id = backing_id;
+                io.backing_data_id = h->obj->data_id;
+            }
+            else{
+                fs->log_warn("fuse_passthrough_open failed for data object {}, serving it through the daemon", h->obj->data_id);
+            }
+        }
+        if(io.backing_id != 0 && io.backing_data_id == h->obj->data_id){
+            ++io.backing_refs;
+            h->passthrough = true;
+            fi->backing_id = io.backing_id;
+            return;
+        }
+    }
+#endif
+
+    if(io.backing_id != 0){
+        fi->direct_io = 1;
+        return;
+    }
+    ++io.cached_handles;
+    h->cached = true;
+}
+
+// Reads through passthrough and page cached handles mostly never reach the daemon to update atime, so opening one
+// for reading counts as the access
+static void touch_on_open(SealFS::SealFSData* fs, fuse_ino_t ino, SealFS::inode_entry& ent, SealFS::FileHandle* h){
+    if((h->passthrough || h->cached) && (h->flags & O_ACCMODE) != O_WRONLY && !SealFS::is_snapshot_ino(ino)){
+        fs->touch_atime(ent, h->io.get());
+    }
+}
+
+void sealfs_init(void* userdata, struct fuse_conn_info *conn){
     SealFS::SealFSData* fs = static_cast<SealFS::SealFSData*>(userdata);
+    auto guard = fs->lock_state();
     fs->log_info("[sealfs_init]");
 
+    // The kernel offers its maximum, larger kernel readahead means fewer and bigger reads for sequential streams
+    const size_t readahead_kb = fs->get_config().readahead_kb;
+    if(readahead_kb > 0){
+        conn->max_readahead = std::min<size_t>(conn->max_readahead, readahead_kb * 1024);
+    }
+    fs->log_info("max_readahead: {}", conn->max_readahead);
+
+#ifdef FUSE_CAP_PASSTHROUGH
+    // Checksums are computed and verified in the daemon, the kernel can't do that for us
+    if(fs->get_config().passthrough && !fs->get_config().checksum && (conn->capable & FUSE_CAP_PASSTHROUGH)){
+        conn->want |= FUSE_CAP_PASSTHROUGH;
+        fs->set_passthrough_active(true);
+    }
+#endif
+    fs->log_info("passthrough: {}", fs->is_passthrough_active());
+
 
     // TODO: delete at some point...
     if(!fs->is_initialized()){
@@ -49,9 +198,11 @@ void sealfs_init(void* userdata, struct fuse_conn_info *conn){
 }
 
 void sealfs_lookup(fuse_req_t req, fuse_ino_t parent, const char* name){
+    SEALFS_TRACE_OP("lookup", parent);
     struct fuse_entry_param e;
 
     SealFS::SealFSData* fs = static_cast<SealFS::SealFSData*>(fuse_req_userdata(req));
+    auto guard = fs->lock_state();
     fs->log_info("[sealfs_lookup] parent: {} name: {}", parent, name);
 
     memset(&e, 0, sizeof(e));
@@ -72,14 +223,19 @@ void sealfs_lookup(fuse_req_t req, fuse_ino_t parent, const char* name){
         e.attr = unwrapped_entry.st;
         fs->log_info("ret fields are name: {} ino: {} st_ino: {}", unwrapped_entry.name, unwrapped_entry.ino, unwrapped_entry.st.st_ino);
 
+        fs->add_lookup(unwrapped_entry);
         fuse_reply_entry(req, &e);
     }
+
+    fs->evict_if_needed();
 }
 
 void sealfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+    SEALFS_TRACE_OP("getattr", ino);
     (void) fi;
 
     SealFS::SealFSData* fs = static_cast<SealFS::SealFSData*>(fuse_req_userdata(req));
+    auto guard = fs->lock_state();
     fs->log_info("[sealfs_getattr] ino: {}", ino);
 
     const auto ret = fs->lookup_entry(ino);
@@ -97,7 +253,108 @@ void sealfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
     }
 }
 
+// Attribute changes only touch the inode_entry, truncation goes through SealFSData::truncate so shared data objects
+// are never modified or copied in full
+void sealfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi){
+    SEALFS_TRACE_OP("setattr", ino);
+    SealFS::SealFSData* fs = static_cast<SealFS::SealFSData*>(fuse_req_userdata(req));
+    auto guard = fs->lock_state();
+    fs->log_info("[sealfs_setattr] ino: {} to_set: {}", ino, to_set);
+
+    if(SealFS::is_snapshot_ino(ino)){
+        fuse_reply_err(req, EROFS);
+        return;
+    }
+
+    auto cur_ent = fs->lookup_entry(ino);
+    if(!cur_ent){
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    const struct stat& cur_st = cur_ent.value().get().st;
+
+    // Same rules as the kernel's: only the owner changes mode and times, only root gives a file away
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    const bool root = ctx->uid == 0;
+    const bool owner = root || ctx->uid == cur_st.st_uid;
+    const bool writable = root || (ctx->uid == cur_st.st_uid && (cur_st.st_mode & S_IWUSR)) || (ctx->gid == cur_st.st_gid && (cur_st.st_mode & S_IWGRP)) || (cur_st.st_mode & S_IWOTH);
+    const bool set_times = ((to_set & FUSE_SET_ATTR_ATIME) && !(to_set & FUSE_SET_ATTR_ATIME_NOW))
+                           || ((to_set & FUSE_SET_ATTR_MTIME) && !(to_set & FUSE_SET_ATTR_MTIME_NOW));
+    if((((to_set & FUSE_SET_ATTR_MODE) || set_times) && !owner)
+       || ((to_set & FUSE_SET_ATTR_UID) && !root && attr->st_uid != cur_st.st_uid)
+       || ((to_set & FUSE_SET_ATTR_GID) && !root && attr->st_gid != cur_st.st_gid && !(owner && attr->st_gid == ctx->gid))){
+        fuse_reply_err(req, EPERM);
+        return;
+    }
+    if((to_set & (FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME_NOW)) && !owner && !writable){
+        fuse_reply_err(req, EACCES);
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    if(to_set & FUSE_SET_ATTR_SIZE){
+        if(cur_ent.value().get().type != SealFS::sealfs_ino_t::FILE){
+            fuse_reply_err(req, EISDIR);
+            return;
+        }
+        if(attr->st_size < 0){
+            fuse_reply_err(req, EINVAL);
+            return;
+        }
+        // ftruncate was checked against the handle's open mode already
+        if(!fi && !writable){
+            fuse_reply_err(req, EACCES);
+            return;
+        }
+        if(attr->st_size != cur_st.st_size){
+            int err = fs->truncate(ino, guard, attr->st_size);
+            if(err){
+                fuse_reply_err(req, err);
+                return;
+            }
+            // The state lock may have been dropped while truncating
+            cur_ent = fs->lookup_entry(ino);
+            if(!cur_ent){
+                fuse_reply_err(req, ENOENT);
+                return;
+            }
+            cur_ent.value().get().st.st_mtim = now;
+        }
+    }
+
+    auto& unwrapped_ent = cur_ent.value().get();
+    struct stat& st = unwrapped_ent.st;
+    if(to_set & FUSE_SET_ATTR_MODE){
+        st.st_mode = (st.st_mode & S_IFMT) | (attr->st_mode & 07777);
+    }
+    if(to_set & FUSE_SET_ATTR_UID){
+        st.st_uid = attr->st_uid;
+    }
+    if(to_set & FUSE_SET_ATTR_GID){
+        st.st_gid = attr->st_gid;
+    }
+    if(to_set & FUSE_SET_ATTR_ATIME_NOW){
+        st.st_atim = now;
+    }
+    else if(to_set & FUSE_SET_ATTR_ATIME){
+        st.st_atim = attr->st_atim;
+    }
+    if(to_set & FUSE_SET_ATTR_MTIME_NOW){
+        st.st_mtim = now;
+    }
+    else if(to_set & FUSE_SET_ATTR_MTIME){
+        st.st_mtim = attr->st_mtim;
+    }
+    st.st_ctim = (to_set & FUSE_SET_ATTR_CTIME) ? attr->st_ctim : now;
+    fs->mark_dirty(unwrapped_ent);
+
+    fuse_reply_attr(req, &st, 1.0);
+}
+
 void sealfs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi){
+    SEALFS_TRACE_OP("opendir", ino);
     SealFS::SealFSData* fs = static_cast<SealFS::SealFSData*>(fuse_req_userdata(req));
     fs->log_info("[sealfs_opendir] ino: {}", ino);
 
@@ -108,10 +365,12 @@ void sealfs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi){
 }
 
 void sealfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi){
+    SEALFS_TRACE_OP("readdir", ino);
     // TODO: Maybe use? If needed might need to implement opendir
     (void) fi;
 
     SealFS::SealFSData* fs = static_cast<SealFS::SealFSData*>(fuse_req_userdata(req));
+    auto guard = fs->lock_state();
     fs->log_info("[sealfs_readdir] ino: {} size: {} off: {}", ino, size, off);
 
     SealFS::DirBuf buf(req);
@@ -130,11 +389,22 @@ void sealfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, stru
         buf.add_entry(fs, name.c_str(), child_ino);
     }
 
+    // Only the first chunk of a listing counts as an access
+    if(off == 0 && !SealFS::is_snapshot_ino(ino)){
+        if(const auto dir_ent = fs->lookup_entry(ino)){
+            fs->touch_atime(dir_ent.value().get());
+        }
+    }
+
     buf.reply(off, size);
+
+    fs->evict_if_needed();
 }
 
 void sealfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+    SEALFS_TRACE_OP("open", ino);
     SealFS::SealFSData* fs = static_cast<SealFS::SealFSData*>(fuse_req_userdata(req));
+    auto guard = fs->lock_state();
     fs->log_info("[sealfs_open] ino: {}", ino);
 
     const auto c_ent = fs->lookup_entry(ino);
@@ -145,7 +415,12 @@ void sealfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
         fuse_reply_err(req, EINVAL);
         return;
     }
-    const auto& unwrapped_ent = c_ent.value().get();
+    auto& unwrapped_ent = c_ent.value().get();
+
+    if(SealFS::is_snapshot_ino(ino) && (fi->flags & O_ACCMODE) != O_RDONLY){
+        fuse_reply_err(req, EROFS);
+        return;
+    }
 
     // Contains user uid and gid
     // We only check primary gid, secondary gid is not easily accessible via ctx
@@ -194,19 +469,53 @@ void sealfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
         unwrapped_ent.st.st_mode
     );
 
+    SealFS::inode_entry* opened = &unwrapped_ent;
     auto reply = [&](bool access){
-        if(access){
-            auto filepath = fs->get_data_ent_path(unwrapped_ent.data_id);
-            int fd = open(filepath.c_str(), fi->flags);
+        // O_TRUNC empties the file on the way in, never touching an object it shares. The backing file is then
+        // opened without it.
+        if(access && (fi->flags & O_TRUNC) && (fi->flags & O_ACCMODE) != O_RDONLY && unwrapped_ent.st.st_size != 0){
+            int err = fs->truncate(ino, guard, 0);
+            if(err){
+                fuse_reply_err(req, err);
+                return;
+            }
+            // The state lock may have been dropped while truncating
+            const auto t_ent = fs->lookup_entry(ino);
+            if(!t_ent){
+                fuse_reply_err(req, ENOENT);
+                return;
+            }
+            auto& truncated = t_ent.value().get();
+            clock_gettime(CLOCK_REALTIME, &truncated.st.st_mtim);
+            truncated.st.st_ctim = truncated.st.st_mtim;
+            fs->mark_dirty(truncated);
+            opened = &truncated;
+        }
+
+        if(access && opened->is_inline()){
+            // Served straight out of the inode_entry, no backing file to open
+            SealFS::FileHandle* h = new_handle(fs, ino, fi->flags, nullptr);
+            setup_io_mode(fs, req, fi, h);
+            touch_on_open(fs, ino, *opened, h);
+            fi->fh = reinterpret_cast<uint64_t>(h);
+            fs->log_info("Successfully opened inline file with ino: {}", ino);
+            fuse_reply_open(req, fi);
+        }
+        else if(access){
+            // A writer may open an object shared with CoW copies or snapshots, its first write gives the file a
+            // private copy (see prepare_data_write)
+            int fd = fs->open_object(opened->data_id, fi->flags & ~O_TRUNC);
             if(fd == -1){
-                fs->log_error("Failed to get fd for file {} with ino {}", filepath.c_str(), ino);
+                fs->log_error("Failed to get fd for data object {} of ino {}", opened->data_id, ino);
                 fuse_reply_err(req, errno);
                 return;
             }
             // TODO: make sure to delete and call close on fd when calling release()
-            SealFS::FileHandle* h = new SealFS::FileHandle{fd};
+            SealFS::FileHandle* h = new_handle(fs, ino, fi->flags, make_object(fs, *opened, fd));
+            setup_io_mode(fs, req, fi, h);
+            touch_on_open(fs, ino, *opened, h);
             fi->fh = reinterpret_cast<uint64_t>(h);
-            fs->log_info("Successfully opened file {} with ino: {}", filepath.c_str(), ino);
+            fs->log_info("Successfully opened data object {} with ino: {}", opened->data_id, ino);
             fuse_reply_open(req, fi);
         }
         else{
@@ -232,70 +541,509 @@ void sealfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
 }
 
 
+// Times a verified read goes back for another try when a write to the same object overlapped it, before waiting
+// for the writers in the range lock instead
+static constexpr int VERIFY_RETRIES = 3;
+
+// Read the whole blocks around [off, off + size) and check them against the object's checksums before replying
+// with the part that was asked for. Writers aren't locked out, a read that overlapped one is simply redone.
+static void reply_verified(SealFS::SealFSData* fs, fuse_req_t req, fuse_ino_t ino, SealFS::FileHandle* f, const SealFS::OpenObject& obj, size_t size, off_t off){
+    const off_t start = SealFS::block_floor(off);
+    const size_t asked = SealFS::block_ceil(off + size) - start;
+    SealFS::ObjectSums& sums = *obj.sums;
+
+    // Every byte gets hashed anyway, so these always go through a buffer rather than a mapping
+    SealFS::BufferPool::Buffer buf = SealFS::BufferPool::get(asked);
+    const char* data = buf.data();
+    ssize_t bytes = 0;
+    auto read_blocks = [&](){
+        bytes = SealFS::traced_pread(obj.fd, buf.data(), asked, start);
+        return bytes != -1;
+    };
+
+    off_t bad = 0;
+    SealFS::verify_t res = SealFS::verify_t::RACED;
+    for(int attempt = 0; attempt < VERIFY_RETRIES && res == SealFS::verify_t::RACED; ++attempt){
+        const uint64_t seq = sums.read_seq();
+        if(!read_blocks()){
+            fuse_reply_err(req, errno);
+            return;
+        }
+        res = sums.verify(seq, start, data, bytes, asked, &bad);
+    }
+    if(res == SealFS::verify_t::RACED){
+        SealFS::RangeGuard range(f->io->ranges, start, start + asked);
+        if(!read_blocks()){
+            fuse_reply_err(req, errno);
+            return;
+        }
+        res = sums.verify(std::nullopt, start, data, bytes, asked, &bad);
+    }
+
+    if(res == SealFS::verify_t::MISMATCH){
+        fs->get_checksums().record_mismatch(obj.data_id, bad, false);
+        fs->log_error("Read of ino {} at {} failed checksum verification", ino, off);
+        fuse_reply_err(req, EIO);
+        return;
+    }
+
+    const off_t skip = off - start;
+    if(bytes <= skip){
+        fuse_reply_buf(req, NULL, 0);
+    }
+    else{
+        fuse_reply_buf(req, data + skip, std::min<size_t>(size, bytes - skip));
+    }
+    f->ra.on_read(obj.fd, off, size, fs->get_config().readahead_kb * 1024);
+}
+
 // Currently does not support direct_io
 void sealfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi){
+    SEALFS_TRACE_OP("read", ino);
     SealFS::SealFSData* fs = static_cast<SealFS::SealFSData*>(fuse_req_userdata(req));
     fs->log_info("[sealfs_read] ino: {} size: {} off: {}", ino, size, off);
 
     SealFS::FileHandle *f = reinterpret_cast<SealFS::FileHandle*>(fi->fh);
 
+    // Most reads skip the state lock here, it is only taken once atime may need moving
+    if(!SealFS::is_snapshot_ino(ino) && fs->atime_due(*f->io)){
+        auto guard = fs->lock_state();
+        if(const auto cur_ent = fs->lookup_entry(ino)){
+            fs->touch_atime(cur_ent.value().get(), f->io.get());
+        }
+    }
+
+    // The file was inline when the handle was opened, or has moved to another data object since
+    std::shared_ptr<SealFS::OpenObject> obj = f->current_object();
+    if(!obj){
+        auto guard = fs->lock_state();
+        const auto cur_ent = fs->lookup_entry(ino);
+        if(!cur_ent){
+            fuse_reply_err(req, ENOENT);
+            return;
+        }
+        auto& unwrapped_ent = cur_ent.value().get();
+        drop_stale_fd(fs, unwrapped_ent, f);
+
+        if(unwrapped_ent.is_inline()){
+            const std::string& data = unwrapped_ent.inline_data;
+            if(off >= static_cast<off_t>(data.size())){
+                fuse_reply_buf(req, NULL, 0);
+            }
+            else{
+                fuse_reply_buf(req, data.data() + off, std::min(size, data.size() - off));
+            }
+            return;
+        }
+
+        // Another handle pushed the file out of line or moved it to another object since we opened it
+        if(!f->obj){
+            int err = open_backing_fd(fs, unwrapped_ent, f);
+            if(err){
+                fuse_reply_err(req, err);
+                return;
+            }
+        }
+        obj = f->obj;
+    }
+
+    if(obj->verify){
+        reply_verified(fs, req, ino, f, *obj, size, off);
+        return;
+    }
+
+    // Reply straight out of a mapping while nobody can write the file. The range lock keeps a truncation from
+    // pulling pages out from under it.
+    if(f->io->writers == 0 && fs->get_mmap_cache().enabled()){
+        SealFS::RangeGuard range(f->io->ranges, off, off + size);
+        if(auto mapping = fs->get_mmap_cache().get(obj->data_id, obj->fd)){
+            if(off >= static_cast<off_t>(mapping->len)){
+                fuse_reply_buf(req, NULL, 0);
+            }
+            else{
+                fuse_reply_buf(req, mapping->addr + off, std::min(size, mapping->len - off));
+            }
+            f->ra.on_read(obj->fd, off, size, fs->get_config().readahead_kb * 1024);
+            return;
+        }
+    }
+
     // TODO: Maybe cap size to MAX_READ_SIZE
 
-    std::unique_ptr<char[]> buf = std::make_unique<char[]>(size);
-    ssize_t bytes = pread(f->fd, buf.get(), size, off);
+    SealFS::BufferPool::Buffer buf = SealFS::BufferPool::get(size);
+    ssize_t bytes = SealFS::traced_pread(obj->fd, buf.data(), size, off);
     if(bytes == -1){
         fuse_reply_err(req, errno);
         return;
     }
 
-    fuse_reply_buf(req, buf.get(), bytes);
+    fuse_reply_buf(req, buf.data(), bytes);
+
+    f->ra.on_read(obj->fd, off, bytes, fs->get_config().readahead_kb * 1024);
 }
 
 void sealfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+    SEALFS_TRACE_OP("release", ino);
     SealFS::SealFSData* fs = static_cast<SealFS::SealFSData*>(fuse_req_userdata(req));
     fs->log_info("[sealfs_release] ino: {}", ino);
 
     SealFS::FileHandle* hptr = reinterpret_cast<SealFS::FileHandle*>(fi->fh);
+    {
+        auto guard = fs->lock_state();
+        if(hptr->obj){
+            fs->put_object(hptr->obj->data_id);
+        }
+        SealFS::InodeIO& io = *hptr->io;
+        if(hptr->passthrough){
+#ifdef FUSE_CAP_PASSTHROUGH
+            if(--io.backing_refs == 0){
+                fuse_passthrough_close(req, io.backing_id);
+                io.backing_id = 0;
+            }
+#endif
+        }
+        else if(hptr->cached){
+            --io.cached_handles;
+        }
+
+        if((hptr->flags & O_ACCMODE) != O_RDONLY){
+            --io.writers;
+            // The object may have grown since it was last mapped
+            if(hptr->obj){
+                fs->get_mmap_cache().invalidate(hptr->obj->data_id);
+            }
+        }
+        fs->put_inode_io(ino, hptr->io);
+    }
+    // Closes the fd, no request is left using it
     delete hptr;
 
     fuse_reply_err(req, 0);
 }
 
+// close() makes no durability promises and writes go straight to the data files, so there is nothing to push out
+void sealfs_flush(fuse_req_t req, fuse_ino_t ino, [[maybe_unused]] struct fuse_file_info *fi){
+    SEALFS_TRACE_OP("flush", ino);
+    SealFS::SealFSData* fs = static_cast<SealFS::SealFSData*>(fuse_req_userdata(req));
+    fs->log_info("[sealfs_flush] ino: {}", ino);
+
+    fuse_reply_err(req, 0);
+}
+
+// Data and metadata are committed together (metadata is what makes new data reachable), so datasync doesn't
+// buy anything cheaper. Concurrent fsyncs share a single commit.
+void sealfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, [[maybe_unused]] struct fuse_file_info *fi){
+    SEALFS_TRACE_OP("fsync", ino);
+    SealFS::SealFSData* fs = static_cast<SealFS::SealFSData*>(fuse_req_userdata(req));
+    fs->log_info("[sealfs_fsync] ino: {} datasync: {}", ino, datasync);
+
+    fuse_reply_err(req, fs->commit());
+}
+
+void sealfs_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync, [[maybe_unused]] struct fuse_file_info *fi){
+    SEALFS_TRACE_OP("fsyncdir", ino);
+    SealFS::SealFSData* fs = static_cast<SealFS::SealFSData*>(fuse_req_userdata(req));
+    fs->log_info("[sealfs_fsyncdir] ino: {} datasync: {}", ino, datasync);
+
+    fuse_reply_err(req, fs->commit());
+}
+
+// Only the metadata parts run under the state lock. The pwrite itself just holds its byte range, so writers to
+// disjoint parts of one file proceed in parallel and the size is settled afterwards with a max.
 void sealfs_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi){
+    SEALFS_TRACE_OP("write", ino);
     SealFS::SealFSData* fs = static_cast<SealFS::SealFSData*>(fuse_req_userdata(req));
     fs->log_info("[sealfs_write] ino: {} size: {} off: {}", ino, size, off);
 
     SealFS::FileHandle *f = reinterpret_cast<SealFS::FileHandle*>(fi->fh);
 
-    ssize_t bytes = pwrite(f->fd, buf, size, off);
+    // Held across the pwrite, another request on the handle may move it to another object meanwhile
+    std::shared_ptr<SealFS::OpenObject> obj;
+    {
+        auto guard = fs->lock_state();
+        for(;;){
+            const auto& cur_ent = fs->lookup_entry(ino);
+
+            if(!cur_ent){
+                fs->log_info("Could not find inode_entry corresponding to ino: {}", ino);
+                fuse_reply_err(req, ENOENT);
+                return;
+            }
+
+            auto& unwrapped_ent = cur_ent.value().get();
+
+            if(unwrapped_ent.is_inline()){
+                if(off + size <= fs->get_inline_threshold()){
+                    std::string& data = unwrapped_ent.inline_data;
+                    if(data.size() < off + size){
+                        data.resize(off + size, '\0');
+                    }
+                    memcpy(data.data() + off, buf, size);
+                    fs->set_size(unwrapped_ent, data.size());
+                    clock_gettime(CLOCK_REALTIME, &unwrapped_ent.st.st_mtim);
+                    unwrapped_ent.st.st_ctim = unwrapped_ent.st.st_mtim;
+                    fs->mark_dirty(unwrapped_ent);
+                    f->io->atime_due = 0;
+
+                    fuse_reply_write(req, size);
+                    return;
+                }
+
+                if(!fs->spill_inline(unwrapped_ent)){
+                    fuse_reply_err(req, EIO);
+                    return;
+                }
+            }
+
+            // EAGAIN: inline again by the time the lock was back, start over
+            int err = prepare_data_write(fs, guard, ino, f);
+            if(err == EAGAIN){
+                continue;
+            }
+            if(err){
+                fuse_reply_err(req, err);
+                return;
+            }
+            obj = f->obj;
+            break;
+        }
+    }
+
+    // Checksums cover whole blocks, so writers that share one take turns
+    SealFS::ObjectSums* sums = obj->sums.get();
+    ssize_t bytes;
+    int err;
+    {
+        SealFS::RangeGuard range(f->io->ranges, sums ? SealFS::block_floor(off) : off, sums ? SealFS::block_ceil(off + size) : off + size);
+        if(sums){
+            sums->begin_write();
+        }
+        bytes = SealFS::traced_pwrite(obj->fd, buf, size, off);
+        err = errno;
+        if(sums){
+            sums->end_write(off, buf, bytes == -1 ? 0 : bytes);
+        }
+    }
+    fs->get_mmap_cache().invalidate(obj->data_id);
+
+    auto guard = fs->lock_state();
+    fs->end_data_write();
     if(bytes == -1){
-        fuse_reply_err(req, errno);
+        fuse_reply_err(req, err);
         return;
     }
+
     const auto& cur_ent = fs->lookup_entry(ino);
+    if(cur_ent){
+        auto& unwrapped_ent = cur_ent.value().get();
+        // Overwrites don't grow the file and concurrent extenders may finish in any order
+        fs->set_size(unwrapped_ent, std::max<off_t>(unwrapped_ent.st.st_size, off + bytes));
+        // A size change already dirtied the partition, an overwrite only moves times and may wait under lazytime
+        clock_gettime(CLOCK_REALTIME, &unwrapped_ent.st.st_mtim);
+        unwrapped_ent.st.st_ctim = unwrapped_ent.st.st_mtim;
+        fs->mark_times_dirty(unwrapped_ent);
+        fs->mark_data_dirty(unwrapped_ent.data_id);
+        // The next read moves atime again under relatime
+        f->io->atime_due = 0;
+    }
 
-    if(!cur_ent){
-        fs->log_info("Could not find inode_entry corresponding to ino: {}", ino);
-        fuse_reply_err(req, errno);
+    fuse_reply_write(req, bytes);
+}
+
+// Preallocation and hole punching go straight to the backing file, so the host filesystem keeps the extent map
+void sealfs_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi){
+    SEALFS_TRACE_OP("fallocate", ino);
+    SealFS::SealFSData* fs = static_cast<SealFS::SealFSData*>(fuse_req_userdata(req));
+    fs->log_info("[sealfs_fallocate] ino: {} mode: {} offset: {} length: {}", ino, mode, offset, length);
+
+    const bool punch = mode == (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE);
+    if(mode != 0 && mode != FALLOC_FL_KEEP_SIZE && !punch){
+        fuse_reply_err(req, EOPNOTSUPP);
+        return;
+    }
+    if(offset < 0 || length <= 0){
+        fuse_reply_err(req, EINVAL);
         return;
     }
 
-    auto& unwrapped_ent = cur_ent.value().get();
-    unwrapped_ent.st.st_size += bytes;
+    SealFS::FileHandle *f = reinterpret_cast<SealFS::FileHandle*>(fi->fh);
+    const off_t end = offset + length;
+
+    std::shared_ptr<SealFS::OpenObject> obj;
+    {
+        auto guard = fs->lock_state();
+        for(;;){
+            const auto cur_ent = fs->lookup_entry(ino);
+            if(!cur_ent){
+                fuse_reply_err(req, ENOENT);
+                return;
+            }
+            auto& unwrapped_ent = cur_ent.value().get();
+
+            if(unwrapped_ent.is_inline()){
+                std::string& data = unwrapped_ent.inline_data;
+                if(punch){
+                    // Inline files have no holes, punching just zeroes what's there
+                    if(offset < static_cast<off_t>(data.size())){
+                        const size_t stop = std::min(static_cast<size_t>(end), data.size());
+                        memset(data.data() + offset, 0, stop - offset);
+                        fs->mark_dirty(unwrapped_ent);
+                    }
+                    fuse_reply_err(req, 0);
+                    return;
+                }
+
+                if(mode == FALLOC_FL_KEEP_SIZE || end <= static_cast<off_t>(data.size())){
+                    fuse_reply_err(req, 0);
+                    return;
+                }
+
+                if(static_cast<size_t>(end) <= fs->get_inline_threshold()){
+                    data.resize(end, '\0');
+                    fs->set_size(unwrapped_ent, data.size());
+                    fs->mark_dirty(unwrapped_ent);
+                    fuse_reply_err(req, 0);
+                    return;
+                }
+
+                if(!fs->spill_inline(unwrapped_ent)){
+                    fuse_reply_err(req, EIO);
+                    return;
+                }
+            }
 
-    fuse_reply_write(req, bytes);
+            // Same as for write(), the range may be in an object the file still shares
+            int err = prepare_data_write(fs, guard, ino, f);
+            if(err == EAGAIN){
+                continue;
+            }
+            if(err){
+                fuse_reply_err(req, err);
+                return;
+            }
+            obj = f->obj;
+            break;
+        }
+    }
+
+    SealFS::ObjectSums* sums = obj->sums.get();
+    int res;
+    int err;
+    {
+        SealFS::RangeGuard range(f->io->ranges, sums ? SealFS::block_floor(offset) : offset, sums ? SealFS::block_ceil(end) : end);
+        if(sums){
+            sums->begin_write();
+        }
+        res = fallocate(obj->fd, mode, offset, length);
+        err = errno;
+        if(sums){
+            if(res == -1 || mode == FALLOC_FL_KEEP_SIZE){
+                sums->end_unchanged();
+            }
+            else if(punch){
+                sums->end_zero(offset, length);
+            }
+            else{
+                sums->end_extend(end);
+            }
+        }
+    }
+    fs->get_mmap_cache().invalidate(obj->data_id);
+
+    auto guard = fs->lock_state();
+    fs->end_data_write();
+    if(res == -1){
+        fs->log_error("fallocate failed for ino {}: {}", ino, strerror(err));
+        fuse_reply_err(req, err);
+        return;
+    }
+
+    const auto cur_ent = fs->lookup_entry(ino);
+    if(cur_ent){
+        auto& unwrapped_ent = cur_ent.value().get();
+        if(mode == 0){
+            fs->set_size(unwrapped_ent, std::max<off_t>(unwrapped_ent.st.st_size, end));
+        }
+        fs->mark_dirty(unwrapped_ent);
+        fs->mark_data_dirty(unwrapped_ent.data_id);
+    }
+
+    fuse_reply_err(req, 0);
+}
+
+// The kernel resolves SEEK_SET/SEEK_CUR/SEEK_END itself, only SEEK_DATA and SEEK_HOLE get here
+void sealfs_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence, struct fuse_file_info *fi){
+    SEALFS_TRACE_OP("lseek", ino);
+    SealFS::SealFSData* fs = static_cast<SealFS::SealFSData*>(fuse_req_userdata(req));
+    fs->log_info("[sealfs_lseek] ino: {} off: {} whence: {}", ino, off, whence);
+
+    if(whence != SEEK_DATA && whence != SEEK_HOLE){
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+
+    SealFS::FileHandle *f = reinterpret_cast<SealFS::FileHandle*>(fi->fh);
+
+    std::shared_ptr<SealFS::OpenObject> obj = f->current_object();
+    if(!obj){
+        auto guard = fs->lock_state();
+        const auto cur_ent = fs->lookup_entry(ino);
+        if(!cur_ent){
+            fuse_reply_err(req, ENOENT);
+            return;
+        }
+        auto& unwrapped_ent = cur_ent.value().get();
+        drop_stale_fd(fs, unwrapped_ent, f);
+
+        if(unwrapped_ent.is_inline()){
+            // All data, with the only hole being the implicit one at EOF
+            const off_t size = unwrapped_ent.st.st_size;
+            if(off < 0 || off >= size){
+                fuse_reply_err(req, ENXIO);
+            }
+            else{
+                fuse_reply_lseek(req, whence == SEEK_DATA ? off : size);
+            }
+            return;
+        }
+
+        if(!f->obj){
+            int err = open_backing_fd(fs, unwrapped_ent, f);
+            if(err){
+                fuse_reply_err(req, err);
+                return;
+            }
+        }
+        obj = f->obj;
+    }
+
+    off_t res = lseek(obj->fd, off, whence);
+    if(res == -1){
+        fuse_reply_err(req, errno);
+        return;
+    }
+
+    fuse_reply_lseek(req, res);
 }
 
 void sealfs_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi){
+    SEALFS_TRACE_OP("create", parent);
     SealFS::SealFSData* fs = static_cast<SealFS::SealFSData*>(fuse_req_userdata(req));
+    auto guard = fs->lock_state();
     fs->log_info("[sealfs_create] parent: {} name: {} mode: {}", parent, name, mode);
 
+    if(SealFS::is_snapshot_ino(parent)){
+        fuse_reply_err(req, EROFS);
+        return;
+    }
+
     if(fs->lookup(parent, name) != SealFS::INVALID_INODE){
         fuse_reply_err(req, EEXIST);
         return;
     }
 
-    const auto& it = fs->create_inode_entry(parent, name, SealFS::sealfs_ino_t::FILE, mode);
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    const auto& it = fs->create_inode_entry(parent, name, SealFS::sealfs_ino_t::FILE, mode, ctx->uid, ctx->gid);
 
     if(!it){
         // TODO: Maybe make more specific at some point
@@ -303,7 +1051,7 @@ void sealfs_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t m
         return;
     }
 
-    const auto unwrapped_ent = it.value().get();
+    auto& unwrapped_ent = it.value().get();
 
     struct fuse_entry_param e;
     memset(&e, 0, sizeof(e));
@@ -313,24 +1061,38 @@ void sealfs_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t m
     e.entry_timeout = 1.0;
     e.attr = unwrapped_ent.st;
 
-    auto filepath = fs->get_data_ent_path(unwrapped_ent.data_id);
-    int fd = open(filepath.c_str(), O_CREAT | O_RDWR, mode);
+    if(unwrapped_ent.is_inline()){
+        SealFS::FileHandle* h = new_handle(fs, e.ino, O_RDWR, nullptr);
+        setup_io_mode(fs, req, fi, h);
+        fi->fh = reinterpret_cast<uint64_t>(h);
+        fs->log_info("Successfully created inline file with ino: {}", e.ino);
+
+        fs->add_lookup(unwrapped_ent);
+        fuse_reply_create(req, &e, fi);
+        return;
+    }
+
+    int fd = fs->open_object(unwrapped_ent.data_id, O_CREAT | O_RDWR, mode);
     if(fd == -1){
-        fs->log_error("Failed to get fd for newly created file {} with ino {}", filepath.c_str(), e.ino);
+        fs->log_error("Failed to get fd for newly created data object {} with ino {}", unwrapped_ent.data_id, e.ino);
         fuse_reply_err(req, errno);
         return;
     }
 
-    SealFS::FileHandle* h = new SealFS::FileHandle{fd};
+    SealFS::FileHandle* h = new_handle(fs, e.ino, O_RDWR, make_object(fs, unwrapped_ent, fd));
+    setup_io_mode(fs, req, fi, h);
     fi->fh = reinterpret_cast<uint64_t>(h);
-    fs->log_info("Successfully opened file {} with ino: {}", filepath.c_str(), e.ino);
+    fs->log_info("Successfully opened data object {} with ino: {}", unwrapped_ent.data_id, e.ino);
 
+    fs->add_lookup(unwrapped_ent);
     fuse_reply_create(req, &e, fi);
 }
 
 // TODO: Modify to support CoW
 void sealfs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name){
+    SEALFS_TRACE_OP("unlink", parent);
     SealFS::SealFSData* fs = static_cast<SealFS::SealFSData*>(fuse_req_userdata(req));
+    auto guard = fs->lock_state();
     fs->log_info("[sealfs_unlink] parent: {} name: {}", parent, name);
 
     fuse_ino_t ino = fs->lookup(parent, name);
@@ -340,6 +1102,11 @@ void sealfs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name){
         return;
     }
 
+    if(SealFS::is_snapshot_ino(ino)){
+        fuse_reply_err(req, EROFS);
+        return;
+    }
+
     bool wks = fs->remove(ino, SealFS::sealfs_ino_t::FILE);
     if(wks){
         fuse_reply_err(req, 0);
@@ -349,16 +1116,86 @@ void sealfs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name){
     }
 }
 
+void sealfs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup){
+    SEALFS_TRACE_OP("forget", ino);
+    SealFS::SealFSData* fs = static_cast<SealFS::SealFSData*>(fuse_req_userdata(req));
+    auto guard = fs->lock_state();
+    fs->log_info("[sealfs_forget] ino: {} nlookup: {}", ino, nlookup);
+
+    fs->forget(ino, nlookup);
+    fs->evict_if_needed();
+
+    fuse_reply_none(req);
+}
+
+// The kernel batches forgets when it drops many inodes at once (memory pressure, unmounting a large tree), take the
+// state lock and run eviction once for the whole batch
+void sealfs_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets){
+    SEALFS_TRACE_OP("forget_multi", count > 0 ? forgets[0].ino : 0);
+    SealFS::SealFSData* fs = static_cast<SealFS::SealFSData*>(fuse_req_userdata(req));
+    auto guard = fs->lock_state();
+    fs->log_info("[sealfs_forget_multi] count: {}", count);
+
+    for(size_t i = 0; i < count; ++i){
+        fs->forget(forgets[i].ino, forgets[i].nlookup);
+    }
+    fs->evict_if_needed();
+
+    fuse_reply_none(req);
+}
+
+// Snapshots cover the whole tree, so taking or deleting one needs write permission on its root. Takes the state lock.
+static bool may_manage_snapshots(SealFS::SealFSData* fs, fuse_req_t req){
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    auto guard = fs->lock_state();
+    const auto root = fs->lookup_entry(SealFS::ROOT_INODE);
+    return root && SealFS::may_access(root.value().get().st, ctx->uid, ctx->gid, W_OK);
+}
+
 void sealfs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode){
+    SEALFS_TRACE_OP("mkdir", parent);
     SealFS::SealFSData* fs = static_cast<SealFS::SealFSData*>(fuse_req_userdata(req));
     fs->log_info("[sealfs_mkdir] parent: {} name: {} mode: {}", parent, name, mode);
 
+    // mkdir .snapshots/<name> snapshots the whole tree, it commits so it can't run under the state lock
+    int err = 0;
+    if(parent == SealFS::SNAPSHOTS_DIR_INO && !may_manage_snapshots(fs, req)){
+        fuse_reply_err(req, EACCES);
+        return;
+    }
+    if(parent == SealFS::SNAPSHOTS_DIR_INO && (err = fs->create_snapshot(name)) != 0){
+        fuse_reply_err(req, err);
+        return;
+    }
+
+    auto guard = fs->lock_state();
+    if(SealFS::is_snapshot_ino(parent)){
+        const fuse_ino_t ino = parent == SealFS::SNAPSHOTS_DIR_INO ? fs->lookup(parent, name) : SealFS::INVALID_INODE;
+        const auto snap_root = ino != SealFS::INVALID_INODE ? fs->lookup_entry(ino) : std::nullopt;
+        if(!snap_root){
+            fuse_reply_err(req, parent == SealFS::SNAPSHOTS_DIR_INO ? ENOENT : EROFS);
+            return;
+        }
+
+        fs->add_lookup(snap_root.value().get());
+
+        struct fuse_entry_param e;
+        memset(&e, 0, sizeof(e));
+        e.ino = ino;
+        e.attr_timeout = 1.0;
+        e.entry_timeout = 1.0;
+        e.attr = snap_root.value().get().st;
+        fuse_reply_entry(req, &e);
+        return;
+    }
+
     if(fs->lookup(parent, name) != SealFS::INVALID_INODE){
         fuse_reply_err(req, EEXIST);
         return;
     }
 
-    const auto& it = fs->create_inode_entry(parent, name, SealFS::sealfs_ino_t::DIR, mode);
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    const auto& it = fs->create_inode_entry(parent, name, SealFS::sealfs_ino_t::DIR, mode, ctx->uid, ctx->gid);
 
     if(!it){
         // TODO: Maybe make more specific at some point
@@ -366,7 +1203,8 @@ void sealfs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mo
         return;
     }
 
-    const auto unwrapped_ent = it.value().get();
+    auto& unwrapped_ent = it.value().get();
+    fs->add_lookup(unwrapped_ent);
 
     struct fuse_entry_param e;
     memset(&e, 0, sizeof(e));
@@ -382,9 +1220,17 @@ void sealfs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mo
 }
 
 void sealfs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name){
+    SEALFS_TRACE_OP("rmdir", parent);
     SealFS::SealFSData* fs = static_cast<SealFS::SealFSData*>(fuse_req_userdata(req));
     fs->log_info("[sealfs_rmdir] parent: {} name: {}", parent, name);
 
+    if(parent == SealFS::SNAPSHOTS_DIR_INO){
+        fuse_reply_err(req, may_manage_snapshots(fs, req) ? fs->delete_snapshot(name) : EACCES);
+        return;
+    }
+
+    auto guard = fs->lock_state();
+
     fuse_ino_t ino = fs->lookup(parent, name);
     if(ino == SealFS::INVALID_INODE){
         fs->log_info("Could not find inode corresponding to parent: {} name: {}", parent, name);
@@ -392,6 +1238,11 @@ void sealfs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name){
         return;
     }
 
+    if(SealFS::is_snapshot_ino(ino)){
+        fuse_reply_err(req, EROFS);
+        return;
+    }
+
     bool wks = fs->remove(ino, SealFS::sealfs_ino_t::DIR);
     if(wks){
         fuse_reply_err(req, 0);
@@ -402,31 +1253,216 @@ void sealfs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name){
     }
 
 }
+// A pure metadata move, so write-to-temp-then-rename saves never copy data
+void sealfs_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname, unsigned int flags){
+    SEALFS_TRACE_OP("rename", parent);
+    SealFS::SealFSData* fs = static_cast<SealFS::SealFSData*>(fuse_req_userdata(req));
+    auto guard = fs->lock_state();
+    fs->log_info("[sealfs_rename] parent: {} name: {} newparent: {} newname: {} flags: {}", parent, name, newparent, newname, flags);
+
+    fuse_reply_err(req, fs->rename(parent, name, newparent, newname, flags));
+}
+
+
+
+// Capacity comes from the backing filesystem, usage from the root's subtree totals, so df is O(1)
+void sealfs_statfs(fuse_req_t req, fuse_ino_t ino){
+    SEALFS_TRACE_OP("statfs", ino);
+    SealFS::SealFSData* fs = static_cast<SealFS::SealFSData*>(fuse_req_userdata(req));
+    auto guard = fs->lock_state();
+    fs->log_info("[sealfs_statfs] ino: {}", ino);
+
+    struct statvfs backing;
+    if(statvfs(fs->get_persistence_root().c_str(), &backing) == -1){
+        fuse_reply_err(req, errno);
+        return;
+    }
+
+    const auto root = fs->lookup_entry(SealFS::ROOT_INODE);
+    if(!root){
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    const SealFS::usage_t& usage = root.value().get().usage;
+
+    // f_bavail is in units of f_frsize, or of f_bsize where f_frsize isn't filled in
+    const unsigned long frsize = backing.f_frsize ? backing.f_frsize : backing.f_bsize;
+    const fsblkcnt_t used = (fs->used_bytes(usage) + frsize - 1) / frsize;
+    const fsblkcnt_t avail = backing.f_bavail;
+
+    struct statvfs st;
+    memset(&st, 0, sizeof(st));
+    st.f_bsize = backing.f_bsize;
+    st.f_frsize = frsize;
+    st.f_blocks = used + avail;
+    st.f_bfree = avail;
+    st.f_bavail = avail;
+    st.f_files = usage.inodes + backing.f_ffree;
+    st.f_ffree = backing.f_ffree;
+    st.f_favail = backing.f_favail;
+    st.f_namemax = 255;
+
+    fuse_reply_statfs(req, &st);
+}
+
+// Setting attributes only triggers operations:
+//  - user.sealfs.clone on an empty directory: make it a clone of the directory whose path (relative to the
+//    mount) is the value, e.g. setfattr -n user.sealfs.clone -v src/tree dst. Needs write permission on dst and
+//    read permission on the source.
+//  - user.sealfs.noverify set to 1 on a file: skip checksum verification on its reads (checksums are still kept up
+//    to date and scrubbed), 0 to turn it back on. Applies to handles opened afterwards. Owner or writers only.
+void sealfs_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name, const char *value, size_t size, int flags){
+    SEALFS_TRACE_OP("setxattr", ino);
+    SealFS::SealFSData* fs = static_cast<SealFS::SealFSData*>(fuse_req_userdata(req));
+    fs->log_info("[sealfs_setxattr] ino: {} name: {} size: {} flags: {}", ino, name, size, flags);
+
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    if(strcmp(name, "user.sealfs.clone") == 0){
+        // Commits, so no state lock here
+        fuse_reply_err(req, fs->clone_dir(ino, std::string(value, size), ctx->uid, ctx->gid));
+        return;
+    }
+
+    if(strcmp(name, "user.sealfs.noverify") == 0){
+        const std::string_view flag(value, size);
+        if(flag != "0" && flag != "1"){
+            fuse_reply_err(req, EINVAL);
+            return;
+        }
+        if(SealFS::is_snapshot_ino(ino)){
+            fuse_reply_err(req, EROFS);
+            return;
+        }
+
+        auto guard = fs->lock_state();
+        const auto cur_ent = fs->lookup_entry(ino);
+        if(!cur_ent){
+            fuse_reply_err(req, ENOENT);
+            return;
+        }
+        auto& unwrapped_ent = cur_ent.value().get();
+        if(unwrapped_ent.type != SealFS::sealfs_ino_t::FILE){
+            fuse_reply_err(req, EINVAL);
+            return;
+        }
+        // Turns off a data integrity check, so only for those who could change the data anyway
+        if(ctx->uid != unwrapped_ent.st.st_uid && !SealFS::may_access(unwrapped_ent.st, ctx->uid, ctx->gid, W_OK)){
+            fuse_reply_err(req, EACCES);
+            return;
+        }
+        unwrapped_ent.noverify = flag == "1";
+        fs->mark_dirty(unwrapped_ent);
+        fuse_reply_err(req, 0);
+        return;
+    }
+
+    fuse_reply_err(req, ENOTSUP);
+}
+
+// Reply to a getxattr with value, following the size == 0 probe / ERANGE protocol
+static void reply_xattr_value(fuse_req_t req, const std::string& value, size_t size){
+    if(size == 0){
+        fuse_reply_xattr(req, value.size());
+    }
+    else if(size < value.size()){
+        fuse_reply_err(req, ERANGE);
+    }
+    else{
+        fuse_reply_buf(req, value.data(), value.size());
+    }
+}
+
+// Only virtual attributes are supported:
+//  - user.sealfs.usage: subtree totals of a directory (or a file's own size) as JSON
+//  - user.sealfs.workers: per-worker request counts and latency histograms as JSON, on any inode
+//  - user.sealfs.checksums: checksum verification and scrub counters, and the latest bad blocks, as JSON, on any
+//    inode
+//  - user.sealfs.noverify: 1 if reads of the file skip checksum verification, 0 otherwise
+//  - user.sealfs.tiers: the capacity tier and migration counters as JSON, on any inode. On a file, also which tier
+//    its data is on.
+void sealfs_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size){
+    SEALFS_TRACE_OP("getxattr", ino);
+    SealFS::SealFSData* fs = static_cast<SealFS::SealFSData*>(fuse_req_userdata(req));
+    auto guard = fs->lock_state();
+    fs->log_info("[sealfs_getxattr] ino: {} name: {} size: {}", ino, name, size);
+
+    const auto cur_ent = fs->lookup_entry(ino);
+    if(!cur_ent){
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    auto& unwrapped_ent = cur_ent.value().get();
+
+    if(strcmp(name, "user.sealfs.usage") == 0){
+        const SealFS::usage_t usage = unwrapped_ent.type == SealFS::sealfs_ino_t::DIR ? unwrapped_ent.usage : fs->file_usage(unwrapped_ent);
+        reply_xattr_value(req, json(usage).dump(), size);
+        return;
+    }
 
+    if(strcmp(name, "user.sealfs.workers") == 0 && fs->get_dispatcher()){
+        reply_xattr_value(req, fs->get_dispatcher()->stats_json().dump(), size);
+        return;
+    }
 
+    if(strcmp(name, "user.sealfs.checksums") == 0){
+        reply_xattr_value(req, fs->get_checksums().stats_json().dump(), size);
+        return;
+    }
+
+    if(strcmp(name, "user.sealfs.noverify") == 0 && unwrapped_ent.type == SealFS::sealfs_ino_t::FILE){
+        reply_xattr_value(req, unwrapped_ent.noverify ? "1" : "0", size);
+        return;
+    }
+
+    if(strcmp(name, "user.sealfs.tiers") == 0){
+        json j = fs->get_tiers().stats_json();
+        if(unwrapped_ent.type == SealFS::sealfs_ino_t::FILE){
+            j["tier"] = unwrapped_ent.is_inline() ? "inline" : fs->get_tiers().is_cold(unwrapped_ent.data_id) ? "cold" : "hot";
+        }
+        reply_xattr_value(req, j.dump(), size);
+        return;
+    }
+
+    fuse_reply_err(req, ENODATA);
+}
 
 const struct fuse_lowlevel_ops sealfs_oper = {
     .init = sealfs_init,
     .lookup = sealfs_lookup,
+    .forget = sealfs_forget,
     .getattr = sealfs_getattr,
+    .setattr = sealfs_setattr,
 
     .mkdir = sealfs_mkdir,
 
     .unlink = sealfs_unlink,
     .rmdir = sealfs_rmdir,
 
+    .rename = sealfs_rename,
+
     .open = sealfs_open,
     .read = sealfs_read,
 
     .write = sealfs_write,
+    .flush = sealfs_flush,
 
     .release = sealfs_release,
+    .fsync = sealfs_fsync,
 
     .opendir = sealfs_opendir,
     .readdir = sealfs_readdir,
+    .fsyncdir = sealfs_fsyncdir,
+    .statfs = sealfs_statfs,
+    .setxattr = sealfs_setxattr,
+    .getxattr = sealfs_getxattr,
 
     .create = sealfs_create,
 
+    .forget_multi = sealfs_forget_multi,
+    .fallocate = sealfs_fallocate,
+
+    .lseek = sealfs_lseek,
+
 
 
     /*
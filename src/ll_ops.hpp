@@ -12,8 +12,14 @@ void sealfs_init(void* userdata, struct fuse_conn_info *conn);
 
 void sealfs_lookup(fuse_req_t req, fuse_ino_t parent, const char* name);
 
+void sealfs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup);
+
+void sealfs_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets);
+
 void sealfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
 
+void sealfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi);
+
 void sealfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi);
 
 void sealfs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi);
@@ -26,16 +32,37 @@ void sealfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
 
 void sealfs_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi);
 
+void sealfs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+
+void sealfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi);
+
+void sealfs_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi);
+
 void sealfs_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi);
 
+void sealfs_statfs(fuse_req_t req, fuse_ino_t ino);
+
+void sealfs_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name, const char *value, size_t size, int flags);
+
+void sealfs_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size);
+
+void sealfs_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi);
+
+void sealfs_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence, struct fuse_file_info *fi);
+
 void sealfs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name);
 
 void sealfs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode);
 
 void sealfs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name);
 
+void sealfs_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname, unsigned int flags);
+
 
 
 
 
 extern const struct fuse_lowlevel_ops sealfs_oper;
+
+// For -o frozen, userdata is a SealFS::FrozenImage (see frozen.hpp)
+extern const struct fuse_lowlevel_ops sealfs_frozen_oper;
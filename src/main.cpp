@@ -1,6 +1,8 @@
 #include "common.hpp"
 #include "state.hpp"
 #include "ll_ops.hpp"
+#include "frozen.hpp"
+#include "dispatch.hpp"
 
 #include <sys/stat.h>
 #include <time.h>
@@ -14,25 +16,124 @@
 
 #include <iostream>
 #include <format>
+#include <cstddef>
+
+#define SEALFS_OPT(t, p, v) { t, offsetof(SealFS::SealFSConfig, p), v }
+
+static const struct fuse_opt sealfs_opts[] = {
+    SEALFS_OPT("inline_threshold=%lu", inline_threshold, 0),
+    SEALFS_OPT("meta_cache_mb=%lu", meta_cache_mb, 0),
+    SEALFS_OPT("fsck=off", fsck_mode, SealFS::FSCK_OFF),
+    SEALFS_OPT("fsck=sync", fsck_mode, SealFS::FSCK_SYNC),
+    SEALFS_OPT("fsck=async", fsck_mode, SealFS::FSCK_ASYNC),
+    SEALFS_OPT("fsck_threads=%u", fsck_threads, 0),
+    SEALFS_OPT("checkpoint_interval=%u", checkpoint_interval, 0),
+    SEALFS_OPT("checkpoint_dirty=%lu", checkpoint_dirty, 0),
+    SEALFS_OPT("mmap_cache_mb=%lu", mmap_cache_mb, 0),
+    SEALFS_OPT("readahead_kb=%lu", readahead_kb, 0),
+    SEALFS_OPT("passthrough", passthrough, 1),
+    SEALFS_OPT("nopassthrough", passthrough, 0),
+    SEALFS_OPT("frozen", frozen, 1),
+    SEALFS_OPT("workers=%u", workers, 0),
+    SEALFS_OPT("pin", pin_workers, 1),
+    SEALFS_OPT("nopin", pin_workers, 0),
+    SEALFS_OPT("checksum", checksum, 1),
+    SEALFS_OPT("nochecksum", checksum, 0),
+    SEALFS_OPT("scrub_mb=%lu", scrub_mb, 0),
+    SEALFS_OPT("scrub_interval=%u", scrub_interval, 0),
+    SEALFS_OPT("root=%s", root, 0),
+    SEALFS_OPT("cold_dir=%s", cold_dir, 0),
+    SEALFS_OPT("tier_interval=%u", tier_interval, 0),
+    SEALFS_OPT("cold_after=%u", cold_after, 0),
+    SEALFS_OPT("promote_opens=%u", promote_opens, 0),
+    SEALFS_OPT("tier_mb=%lu", tier_mb, 0),
+    SEALFS_OPT("noatime", atime_mode, SealFS::ATIME_OFF),
+    SEALFS_OPT("relatime", atime_mode, SealFS::ATIME_RELATIVE),
+    SEALFS_OPT("strictatime", atime_mode, SealFS::ATIME_STRICT),
+    SEALFS_OPT("lazytime", lazytime, 1),
+    SEALFS_OPT("nolazytime", lazytime, 0),
+    FUSE_OPT_END
+};
+
+// fuse_session_loop_mt's options, which the fixed workers of the Dispatcher have no use for. Parsed (and dropped
+// before fuse_parse_cmdline sees them) only to warn that they don't do anything.
+struct loop_mt_opts_t{
+    int clone_fd = 0;
+    int max_idle_threads = -1;
+    int max_threads = -1;
+};
+
+static const struct fuse_opt loop_mt_opts[] = {
+    { "clone_fd", offsetof(loop_mt_opts_t, clone_fd), 1 },
+    { "max_idle_threads=%d", offsetof(loop_mt_opts_t, max_idle_threads), 0 },
+    { "max_threads=%d", offsetof(loop_mt_opts_t, max_threads), 0 },
+    FUSE_OPT_END
+};
+
+static void sealfs_help(){
+    printf("SealFS options:\n"
+           "    -o inline_threshold=N  keep files of at most N bytes inline in metadata (default: 4096, 0 disables)\n"
+           "    -o meta_cache_mb=N     approximate memory budget for resident metadata (default: 1024)\n"
+           "    -o fsck=off|sync|async check metadata against data/ before mounting or in the background (default: async)\n"
+           "    -o fsck_threads=N      worker threads for the check (default: one per core)\n"
+           "    -o checkpoint_interval=N  seconds between background metadata checkpoints, 0 disables (default: 5)\n"
+           "    -o checkpoint_dirty=N  checkpoint early once N directories are dirty (default: 4096)\n"
+           "    -o mmap_cache_mb=N     serve reads of files nobody has open for writing from mmap'd data, 0 disables (default: 0)\n"
+           "    -o readahead_kb=N      max prefetch window for sequential reads, 0 disables (default: 8192)\n"
+           "    -o [no]passthrough     let the kernel read data files of read-only opens directly when it supports it (default: on)\n"
+           "    -o frozen              serve a read-only image compiled from the tree at mount, for data that never changes\n"
+           "    -o workers=N           request worker threads, 0 for one per CPU (default: 0)\n"
+           "    -o [no]pin             pin each worker to its own CPU (default: on)\n"
+           "                           (-o clone_fd, max_idle_threads and max_threads are ignored, see -o workers)\n"
+           "    -o [no]checksum        keep CRC32C checksums of data blocks and verify them on read, turns off passthrough (default: off)\n"
+           "    -o scrub_mb=N          MB/s the background scrubber reads data at, 0 disables it (default: 32)\n"
+           "    -o scrub_interval=N    seconds between scrub passes (default: 86400)\n"
+           "    -o root=PATH           persistence root for metadata, journal and hot data, put it on the fastest device (default: ~/sealfs)\n"
+           "    -o cold_dir=PATH       capacity tier for data nobody uses, remembered by the root once given (default: none)\n"
+           "    -o tier_interval=N     seconds between passes moving data between tiers, 0 disables (default: 600)\n"
+           "    -o cold_after=N        move data not opened for N seconds to the capacity tier, 0 never does (default: 604800)\n"
+           "    -o promote_opens=N     move it back once opened N times in a pass, 0 never does (default: 4)\n"
+           "    -o tier_mb=N           MB/s migrations copy at most, 0 for unlimited (default: 64)\n"
+           "    -o noatime|relatime|strictatime  when reads update atime, strictatime takes the metadata lock on every read (default: relatime)\n"
+           "    -o [no]lazytime        keep timestamp-only changes in memory until fsync, unmount or 12 hours pass (default: off)\n");
+}
 
 int main(int argc, char* argv[]){
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
     struct fuse_session *se;
     struct fuse_cmdline_opts opts;
-    struct fuse_loop_config config;
+    SealFS::SealFSConfig fs_config;
+    std::unique_ptr<SealFS::FrozenImage> frozen;
     int ret = -1;
 
+    if(fuse_opt_parse(&args, &fs_config, sealfs_opts, NULL) != 0){
+        return 1;
+    }
+
+    loop_mt_opts_t loop_mt;
+    if(fuse_opt_parse(&args, &loop_mt, loop_mt_opts, NULL) != 0){
+        return 1;
+    }
+    if(loop_mt.clone_fd){
+        fprintf(stderr, "warning: -o clone_fd is ignored, every worker reads from the session fd (see -o workers)\n");
+    }
+    if(loop_mt.max_idle_threads != -1 || loop_mt.max_threads != -1){
+        fprintf(stderr, "warning: -o max_idle_threads and max_threads are ignored, -o workers fixes the number of worker threads\n");
+    }
+
     if(fuse_parse_cmdline(&args, &opts) != 0){
         return 1;
     }
 
-    SealFS::SealFSData* fs = new SealFS::SealFSData();
+    SealFS::SealFSData* fs = fs_config.root ? new SealFS::SealFSData(SealFS::expand_user_path(fs_config.root), fs_config)
+                                            : new SealFS::SealFSData(fs_config);
     // fs->set_initialized(false);
     fs->set_initialized(true);
 
     if(opts.show_help){
         printf("usage: %s [options] <mountpoint>\n\n", argv[0]);
         fuse_cmdline_help();
+        sealfs_help();
         fuse_lowlevel_help();
         ret = 0;
         goto err_out1;
@@ -51,7 +152,18 @@ int main(int argc, char* argv[]){
         goto err_out1;
     }
 
-    se = fuse_session_new(&args, &sealfs_oper, sizeof(sealfs_oper), fs);
+    if(fs_config.frozen){
+        frozen = SealFS::FrozenImage::build(*fs);
+        if(!frozen){
+            ret = 1;
+            goto err_out1;
+        }
+        fuse_opt_add_arg(&args, "-oro");
+        se = fuse_session_new(&args, &sealfs_frozen_oper, sizeof(sealfs_frozen_oper), frozen.get());
+    }
+    else{
+        se = fuse_session_new(&args, &sealfs_oper, sizeof(sealfs_oper), fs);
+    }
     if(se == NULL){
         goto err_out1;
     }
@@ -69,9 +181,10 @@ int main(int argc, char* argv[]){
         ret = fuse_session_loop(se);
     }
     else{
-        config.clone_fd = opts.clone_fd;
-        config.max_idle_threads = opts.max_idle_threads;
-        ret = fuse_session_loop_mt(se, &config);
+        SealFS::Dispatcher dispatcher(se, *fs, fs_config.workers, fs_config.pin_workers);
+        fs->set_dispatcher(&dispatcher);
+        ret = dispatcher.run();
+        fs->set_dispatcher(nullptr);
     }
 
         fuse_session_unmount(se);
@@ -82,6 +195,7 @@ err_out2:
 err_out1:
         free(opts.mountpoint);
         fuse_opt_free_args(&args);
+        frozen.reset();
         delete fs;
 
         return ret ? 1 : 0;
@@ -0,0 +1,123 @@
+#include "mmap_cache.hpp"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdint.h>
+
+using namespace SealFS;
+
+static constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+Mapping::~Mapping(){
+    if(addr){
+        munmap(const_cast<char*>(addr), len);
+    }
+}
+
+// Map len bytes of fd read-only. Objects of at least a huge page get a 2 MiB aligned address so the kernel can back
+// them with huge pages where the filesystem supports it (read-only THP for page cache).
+static const char* map_object(int fd, size_t len){
+    if(len < HUGE_PAGE_SIZE){
+        void* addr = mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+        return addr == MAP_FAILED ? nullptr : static_cast<const char*>(addr);
+    }
+
+    // Reserve enough address space to find an aligned start, then map the file over it
+    const size_t reserve_len = len + HUGE_PAGE_SIZE;
+    void* reserve = mmap(nullptr, reserve_len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(reserve == MAP_FAILED){
+        return nullptr;
+    }
+    const uintptr_t start = reinterpret_cast<uintptr_t>(reserve);
+    const uintptr_t aligned = (start + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+
+    void* addr = mmap(reinterpret_cast<void*>(aligned), len, PROT_READ, MAP_SHARED | MAP_FIXED, fd, 0);
+    if(addr == MAP_FAILED){
+        munmap(reserve, reserve_len);
+        return nullptr;
+    }
+
+    // Give back the slack on both sides
+    if(aligned > start){
+        munmap(reserve, aligned - start);
+    }
+    const uintptr_t map_end = (aligned + len + 4095) & ~uintptr_t(4095);
+    const uintptr_t reserve_end = start + reserve_len;
+    if(reserve_end > map_end){
+        munmap(reinterpret_cast<void*>(map_end), reserve_end - map_end);
+    }
+
+    madvise(addr, len, MADV_HUGEPAGE);
+    return static_cast<const char*>(addr);
+}
+
+std::shared_ptr<const Mapping> MmapCache::get(uint32_t data_id, int fd){
+    if(!enabled()){
+        return nullptr;
+    }
+
+    uint64_t gen;
+    {
+        std::lock_guard<std::mutex> lk(m);
+        auto it = entries.find(data_id);
+        if(it != entries.end()){
+            lru.splice(lru.begin(), lru, it->second.lru_pos);
+            return it->second.mapping;
+        }
+        gen = generation;
+    }
+
+    // Map outside the lock, hits on other objects shouldn't wait for this
+    struct stat st;
+    if(fstat(fd, &st) == -1 || st.st_size <= 0 || static_cast<size_t>(st.st_size) > capacity){
+        return nullptr;
+    }
+    const size_t len = st.st_size;
+    const char* addr = map_object(fd, len);
+    if(!addr){
+        return nullptr;
+    }
+    auto mapping = std::make_shared<const Mapping>(addr, len);
+
+    std::lock_guard<std::mutex> lk(m);
+    if(generation != gen){
+        // The object may have changed while we mapped it, serve this read via pread instead
+        return nullptr;
+    }
+    auto [it, inserted] = entries.try_emplace(data_id);
+    if(!inserted){
+        lru.splice(lru.begin(), lru, it->second.lru_pos);
+        return it->second.mapping;
+    }
+    lru.push_front(data_id);
+    it->second = {mapping, lru.begin()};
+    used += len;
+    evict_locked();
+    return mapping;
+}
+
+void MmapCache::invalidate(uint32_t data_id){
+    if(!enabled()){
+        return;
+    }
+
+    std::lock_guard<std::mutex> lk(m);
+    ++generation;
+    auto it = entries.find(data_id);
+    if(it == entries.end()){
+        return;
+    }
+    used -= it->second.mapping->len;
+    lru.erase(it->second.lru_pos);
+    entries.erase(it);
+}
+
+// Readers still holding an evicted mapping keep it alive until their reply is sent
+void MmapCache::evict_locked(){
+    while(used > capacity && lru.size() > 1){
+        auto it = entries.find(lru.back());
+        used -= it->second.mapping->len;
+        entries.erase(it);
+        lru.pop_back();
+    }
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+namespace SealFS{
+
+// A read-only MAP_SHARED view of a whole data object, unmapped once the cache and every reader has let go of it
+struct Mapping{
+    const char* addr = nullptr;
+    size_t len = 0;
+
+    Mapping(const char* addr_, size_t len_) : addr(addr_), len(len_){}
+    ~Mapping();
+    Mapping(const Mapping&) = delete;
+    Mapping& operator=(const Mapping&) = delete;
+};
+
+// Bounded LRU of data object mappings, so hot read-mostly files are served straight from the page cache without a
+// pread and a copy per request. Callers must only use a mapping while nothing can write or truncate the object
+// (touching a page past a truncated EOF raises SIGBUS), and invalidate it whenever the object changes.
+class MmapCache{
+public:
+    // capacity_bytes of 0 disables the cache, get() then always returns nullptr
+    explicit MmapCache(size_t capacity_bytes) : capacity(capacity_bytes){}
+
+    inline bool enabled() const { return capacity > 0; }
+
+    // Mapping of data_id (backed by fd), creating it on a miss. nullptr if disabled, empty, too big, or mmap fails.
+    std::shared_ptr<const Mapping> get(uint32_t data_id, int fd);
+    void invalidate(uint32_t data_id);
+
+private:
+    struct cache_entry{
+        std::shared_ptr<const Mapping> mapping;
+        std::list<uint32_t>::iterator lru_pos;
+    };
+
+    void evict_locked();
+
+    const size_t capacity;
+    std::mutex m;
+    size_t used = 0;
+    uint64_t generation = 0; // Bumped by invalidate(), so a racing miss doesn't insert a stale mapping
+    std::list<uint32_t> lru; // Most recently used at the front
+    std::unordered_map<uint32_t, cache_entry> entries;
+};
+
+} // namespace SealFS
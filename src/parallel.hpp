@@ -0,0 +1,38 @@
+#pragma once
+
+#include <atomic>
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include <stop_token>
+
+namespace SealFS{
+
+// Number of workers to use when the caller doesn't ask for a specific count
+inline unsigned default_worker_count(){
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Run fn(worker, i) for every i in [0, n) on up to `workers` threads. Indices are handed out dynamically so uneven
+// items (big partitions, slow disks) balance out; worker is in [0, workers) for per-thread accumulators.
+// Stops handing out new indices once stop is requested.
+template<typename F>
+void parallel_for(size_t n, unsigned workers, std::stop_token stop, F&& fn){
+    workers = static_cast<unsigned>(std::min<size_t>(std::max(1u, workers), std::max<size_t>(n, 1)));
+    std::atomic<size_t> next{0};
+
+    auto run = [&](unsigned worker){
+        for(size_t i = next.fetch_add(1, std::memory_order_relaxed); i < n && !stop.stop_requested(); i = next.fetch_add(1, std::memory_order_relaxed)){
+            fn(worker, i);
+        }
+    };
+
+    std::vector<std::jthread> pool;
+    pool.reserve(workers - 1);
+    for(unsigned w = 1; w < workers; ++w){
+        pool.emplace_back(run, w);
+    }
+    run(0);
+}
+
+} // namespace SealFS
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "trace.hpp"
+
+#include <sys/types.h>
+
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+namespace SealFS{
+
+// Byte-range lock for one file. Disjoint ranges are held concurrently, overlapping ones queue up. Only a handful
+// of ranges are ever held at once (one per in-flight request), so a flat vector beats an interval tree here.
+class RangeLock{
+public:
+    // Blocks until [start, end) overlaps no held range
+    void lock(off_t start, off_t end){
+        std::unique_lock<std::mutex> lk(m);
+        if(overlaps(start, end)){
+            SEALFS_TRACE2(range__wait__start, start, end);
+            cv.wait(lk, [&]{ return !overlaps(start, end); });
+            SEALFS_TRACE2(range__wait__done, start, end);
+        }
+        held.emplace_back(start, end);
+    }
+
+    // Takes [start, end) only if that doesn't have to wait
+    bool try_lock(off_t start, off_t end){
+        std::lock_guard<std::mutex> lk(m);
+        if(overlaps(start, end)){
+            return false;
+        }
+        held.emplace_back(start, end);
+        return true;
+    }
+
+    void unlock(off_t start, off_t end){
+        {
+            std::lock_guard<std::mutex> lk(m);
+            auto it = std::find(held.begin(), held.end(), std::make_pair(start, end));
+            if(it != held.end()){
+                *it = held.back();
+                held.pop_back();
+            }
+        }
+        cv.notify_all();
+    }
+
+private:
+    bool overlaps(off_t start, off_t end) const{
+        return std::any_of(held.begin(), held.end(), [&](const auto& r){ return r.first < end && start < r.second; });
+    }
+
+    std::mutex m;
+    std::condition_variable cv;
+    std::vector<std::pair<off_t, off_t>> held;
+};
+
+class RangeGuard{
+public:
+    RangeGuard(RangeLock& lock_, off_t start_, off_t end_) : lock(lock_), start(start_), end(end_){
+        lock.lock(start, end);
+    }
+
+    ~RangeGuard(){
+        lock.unlock(start, end);
+    }
+
+    RangeGuard(const RangeGuard&) = delete;
+    RangeGuard& operator=(const RangeGuard&) = delete;
+
+private:
+    RangeLock& lock;
+    off_t start;
+    off_t end;
+};
+
+} // namespace SealFS
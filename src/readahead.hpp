@@ -0,0 +1,76 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <algorithm>
+
+namespace SealFS{
+
+// Per handle sequential stream detection. Once a handle has read a few requests back to back, the data after the
+// current position is prefetched into the backing filesystem's page cache with an exponentially growing window, so
+// the next FUSE reads hit memory instead of waiting on the disk. A seek somewhere else drops back to no readahead.
+// Requests on one handle may be handled concurrently and slightly out of order, the state is a heuristic and races
+// between them are harmless.
+class Readahead{
+public:
+    static constexpr off_t MIN_WINDOW = 128 * 1024;
+    // How far a read may land from where the last one ended and still count as sequential
+    static constexpr off_t SLACK = 128 * 1024;
+    // Reads in a row before the stream is treated as sequential
+    static constexpr unsigned CONFIRM = 2;
+
+    // Record a read of [off, off + len) on fd, issuing readahead if the stream is sequential. Call after replying,
+    // the fadvise can block for a while on a busy disk.
+    void on_read(int fd, off_t off, size_t len, off_t max_window){
+        if(max_window <= 0 || len == 0){
+            return;
+        }
+
+        const off_t end = off + static_cast<off_t>(len);
+        const off_t prev_end = last_end.exchange(end, std::memory_order_relaxed);
+
+        if(prev_end < 0 || off < prev_end - SLACK || off > prev_end + SLACK){
+            // Random access, stop prefetching for this handle
+            hits.store(0, std::memory_order_relaxed);
+            window.store(0, std::memory_order_relaxed);
+            ra_end.store(0, std::memory_order_relaxed);
+            return;
+        }
+
+        const unsigned h = hits.fetch_add(1, std::memory_order_relaxed) + 1;
+        if(h < CONFIRM){
+            return;
+        }
+        if(h == CONFIRM){
+            // Also lets the backing filesystem use its larger sequential readahead
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+
+        // Only top up once the reader has consumed half of what was prefetched
+        off_t cur_window = window.load(std::memory_order_relaxed);
+        const off_t cur_ra_end = ra_end.load(std::memory_order_relaxed);
+        if(cur_window > 0 && end + cur_window / 2 < cur_ra_end){
+            return;
+        }
+
+        cur_window = std::min(max_window, std::max(MIN_WINDOW, cur_window * 2));
+        window.store(cur_window, std::memory_order_relaxed);
+
+        const off_t start = std::max(end, cur_ra_end);
+        const off_t stop = end + cur_window;
+        if(stop > start){
+            ra_end.store(stop, std::memory_order_relaxed);
+            posix_fadvise(fd, start, stop - start, POSIX_FADV_WILLNEED);
+        }
+    }
+
+private:
+    std::atomic<off_t> last_end = -1; // End of the previous read
+    std::atomic<unsigned> hits = 0; // Sequential reads in a row
+    std::atomic<off_t> window = 0; // Current readahead window, 0 while not sequential
+    std::atomic<off_t> ra_end = 0; // Prefetched up to here
+};
+
+} // namespace SealFS
@@ -0,0 +1,782 @@
+// Whole-filesystem workload generator in the spirit of mdtest and fio, run against a mounted SealFS. Every workload
+// runs at each of the requested thread counts and reports throughput and per-operation latency percentiles as JSON.
+// compare checks such a report against a stored baseline and fails if anything got worse by more than a threshold.
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <latch>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+#include <spdlog/sinks/stdout_sinks.h>
+
+using json = nlohmann::json;
+namespace fs = std::filesystem;
+
+namespace{
+
+static constexpr int REPORT_VERSION = 1;
+static constexpr size_t SEQ_BLOCK = 1 << 20;
+static constexpr unsigned READDIR_PASSES = 4; // Full listings of the huge directory per thread
+static constexpr unsigned CLONE_SUBDIRS = 16; // Directories the clone source spreads its files over
+
+const std::vector<std::string> ALL_WORKLOADS = {"meta_flat", "meta_deep", "readdir", "small", "seq", "rand", "clone"};
+
+struct params_t{
+    std::vector<unsigned> threads = {1, 4};
+    std::vector<std::string> workloads = ALL_WORKLOADS;
+    unsigned files = 2000; // Per thread, metadata and small file workloads
+    unsigned depth = 8;
+    unsigned readdir_entries = 100000;
+    size_t small_size = 4096;
+    size_t large_mb = 256; // Per thread
+    size_t rand_block = 4096;
+    unsigned rand_ops = 20000; // Per thread
+    unsigned clone_files = 1000;
+    unsigned clones = 20; // Per thread
+};
+
+[[noreturn]] void fail(const std::string& what, const fs::path& path){
+    throw std::system_error(errno, std::generic_category(), what + " " + path.string());
+}
+
+int check(int res, const char* what, const fs::path& path){
+    if(res == -1){
+        fail(what, path);
+    }
+    return res;
+}
+
+void write_all(int fd, const char* buf, size_t len, off_t off, const fs::path& path){
+    while(len > 0){
+        ssize_t bytes = pwrite(fd, buf, len, off);
+        if(bytes == -1 && errno == EINTR){
+            continue;
+        }
+        check(bytes, "write", path);
+        buf += bytes;
+        len -= bytes;
+        off += bytes;
+    }
+}
+
+size_t read_all(int fd, char* buf, size_t len, off_t off, const fs::path& path){
+    size_t done = 0;
+    while(done < len){
+        ssize_t bytes = pread(fd, buf + done, len - done, off + done);
+        if(bytes == -1 && errno == EINTR){
+            continue;
+        }
+        check(bytes, "read", path);
+        if(bytes == 0){
+            break;
+        }
+        done += bytes;
+    }
+    return done;
+}
+
+void write_file(const fs::path& path, const std::vector<char>& data){
+    int fd = check(open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644), "create", path);
+    write_all(fd, data.data(), data.size(), 0, path);
+    close(fd);
+}
+
+// Best effort: drop the kernel's cached pages of the file so reads have to come back to the filesystem
+void drop_cache(int fd){
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+// Sum of the request workers' counters (user.sealfs.workers), nullopt if the mount doesn't have them
+struct daemon_counters_t{
+    uint64_t requests = 0;
+    std::optional<uint64_t> allocations; // Only counted by daemons built with SEALFS_COUNT_ALLOCS
+};
+
+std::optional<daemon_counters_t> daemon_counters(const fs::path& mount){
+    std::string value(1 << 16, '\0');
+    ssize_t len = getxattr(mount.c_str(), "user.sealfs.workers", value.data(), value.size());
+    if(len <= 0){
+        return std::nullopt;
+    }
+    value.resize(len);
+    daemon_counters_t counters;
+    try{
+        const json workers = json::parse(value);
+        if(!workers.empty() && workers.front().contains("allocations")){
+            counters.allocations = 0;
+        }
+        for(const auto& worker : workers){
+            counters.requests += worker.at("requests").get<uint64_t>();
+            if(counters.allocations){
+                *counters.allocations += worker.at("allocations").get<uint64_t>();
+            }
+        }
+    }
+    catch(const std::exception&){
+        return std::nullopt;
+    }
+    return counters;
+}
+
+// Times the operations of one thread
+class OpTimer{
+public:
+    // f does one operation and returns the bytes it moved
+    template<typename F>
+    void op(F&& f){
+        const auto start = std::chrono::steady_clock::now();
+        bytes += f();
+        latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    std::vector<uint64_t> latencies; // ns
+    uint64_t bytes = 0;
+};
+
+class Bench{
+public:
+    Bench(const fs::path& mount, const params_t& params, std::shared_ptr<spdlog::logger> logger)
+        : mount(mount), params(params), logger(std::move(logger)),
+          dir(mount / (".sealfs_bench." + std::to_string(getpid()))){}
+
+    json run(){
+        json results = json::array();
+        check(mkdir(dir.c_str(), 0755), "mkdir", dir);
+        try{
+            for(unsigned threads : params.threads){
+                for(const auto& workload : params.workloads){
+                    logger->info("Running {} with {} threads", workload, threads);
+                    run_workload(workload, threads, results);
+                }
+            }
+        }
+        catch(...){
+            cleanup();
+            throw;
+        }
+        cleanup();
+
+        char finished[32];
+        const time_t now = time(nullptr);
+        strftime(finished, sizeof(finished), "%FT%TZ", gmtime(&now));
+        return {
+            {"version", REPORT_VERSION},
+            {"mount", mount.string()},
+            {"finished", finished},
+            {"params", {
+                {"files", params.files},
+                {"depth", params.depth},
+                {"readdir_entries", params.readdir_entries},
+                {"small_size", params.small_size},
+                {"large_mb", params.large_mb},
+                {"rand_block", params.rand_block},
+                {"rand_ops", params.rand_ops},
+                {"clone_files", params.clone_files},
+                {"clones", params.clones}
+            }},
+            {"results", std::move(results)}
+        };
+    }
+
+private:
+    void run_workload(const std::string& workload, unsigned threads, json& results){
+        if(workload == "meta_flat" || workload == "meta_deep"){
+            metadata(workload == "meta_deep", threads, results);
+        }
+        else if(workload == "readdir"){
+            readdir_huge(threads, results);
+        }
+        else if(workload == "small"){
+            small_files(threads, results);
+        }
+        else if(workload == "seq"){
+            sequential(threads, results);
+        }
+        else if(workload == "rand"){
+            random_io(threads, results);
+        }
+        else if(workload == "clone"){
+            clone(threads, results);
+        }
+    }
+
+    // Run body on threads threads at once, rethrowing the first failure
+    static void run_threads(unsigned threads, const std::function<void(unsigned)>& body, std::latch* ready = nullptr, std::latch* go = nullptr){
+        std::mutex m;
+        std::exception_ptr error;
+        {
+            std::vector<std::jthread> workers;
+            for(unsigned tid = 0; tid < threads; ++tid){
+                workers.emplace_back([&, tid](){
+                    if(ready){
+                        ready->count_down();
+                        go->wait();
+                    }
+                    try{
+                        body(tid);
+                    }
+                    catch(...){
+                        std::lock_guard<std::mutex> lk(m);
+                        if(!error){
+                            error = std::current_exception();
+                        }
+                    }
+                });
+            }
+        }
+        if(error){
+            std::rethrow_exception(error);
+        }
+    }
+
+    // Time body on threads threads started together, and add what they did to results as name
+    void measure(const std::string& name, unsigned threads, json& results, const std::function<void(unsigned, OpTimer&)>& body){
+        std::vector<OpTimer> timers(threads);
+        std::latch ready(threads);
+        std::latch go(1);
+        const auto before = daemon_counters(mount);
+
+        std::chrono::steady_clock::time_point start;
+        std::thread starter([&](){
+            ready.wait();
+            start = std::chrono::steady_clock::now();
+            go.count_down();
+        });
+        try{
+            run_threads(threads, [&](unsigned tid){ body(tid, timers[tid]); }, &ready, &go);
+        }
+        catch(...){
+            starter.join();
+            throw;
+        }
+        const auto end = std::chrono::steady_clock::now();
+        starter.join();
+        const auto after = daemon_counters(mount);
+
+        std::vector<uint64_t> latencies;
+        uint64_t bytes = 0;
+        for(auto& timer : timers){
+            latencies.insert(latencies.end(), timer.latencies.begin(), timer.latencies.end());
+            bytes += timer.bytes;
+        }
+        std::sort(latencies.begin(), latencies.end());
+        auto percentile_us = [&](double q){
+            if(latencies.empty()){
+                return 0.0;
+            }
+            return latencies[std::min(latencies.size() - 1, static_cast<size_t>(q * latencies.size()))] / 1000.0;
+        };
+        const double seconds = std::chrono::duration<double>(end - start).count();
+
+        json result = {
+            {"workload", name},
+            {"threads", threads},
+            {"ops", latencies.size()},
+            {"seconds", seconds},
+            {"ops_s", latencies.size() / seconds},
+            {"mb_s", bytes / seconds / (1 << 20)},
+            {"latency_us", {{"p50", percentile_us(0.5)}, {"p99", percentile_us(0.99)}, {"p999", percentile_us(0.999)}}}
+        };
+        // Heap allocations the daemon made per request, expected to stay at 0 on the steady-state I/O paths
+        if(before && after && after->requests > before->requests){
+            const uint64_t requests = after->requests - before->requests;
+            result["daemon"] = {{"requests", requests}};
+            if(before->allocations && after->allocations){
+                const uint64_t allocations = *after->allocations - *before->allocations;
+                result["daemon"]["allocations"] = allocations;
+                result["daemon"]["allocs_per_request"] = static_cast<double>(allocations) / requests;
+            }
+        }
+        logger->info("{}", result.dump());
+        results.push_back(std::move(result));
+    }
+
+    static std::string file_name(unsigned tid, unsigned i){
+        return "f" + std::to_string(tid) + "." + std::to_string(i);
+    }
+
+    // Parallel create, stat and unlink, all threads in one shared directory or each in its own deep one
+    void metadata(bool deep, unsigned threads, json& results){
+        const fs::path base = dir / (deep ? "deep" : "flat");
+        auto dir_of = [&](unsigned tid){
+            if(!deep){
+                return base;
+            }
+            fs::path d = base / ("t" + std::to_string(tid));
+            for(unsigned level = 0; level < params.depth; ++level){
+                d /= "d" + std::to_string(level);
+            }
+            return d;
+        };
+        fs::create_directories(base);
+        for(unsigned tid = 0; deep && tid < threads; ++tid){
+            fs::create_directories(dir_of(tid));
+        }
+        const std::string suffix = deep ? "_deep" : "_flat";
+
+        measure("create" + suffix, threads, results, [&](unsigned tid, OpTimer& t){
+            const fs::path d = dir_of(tid);
+            for(unsigned i = 0; i < params.files; ++i){
+                const fs::path path = d / file_name(tid, i);
+                t.op([&](){
+                    close(check(open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644), "create", path));
+                    return 0;
+                });
+            }
+        });
+        measure("stat" + suffix, threads, results, [&](unsigned tid, OpTimer& t){
+            const fs::path d = dir_of(tid);
+            struct stat st;
+            for(unsigned i = 0; i < params.files; ++i){
+                const fs::path path = d / file_name(tid, i);
+                t.op([&](){
+                    check(stat(path.c_str(), &st), "stat", path);
+                    return 0;
+                });
+            }
+        });
+        measure("unlink" + suffix, threads, results, [&](unsigned tid, OpTimer& t){
+            const fs::path d = dir_of(tid);
+            for(unsigned i = 0; i < params.files; ++i){
+                const fs::path path = d / file_name(tid, i);
+                t.op([&](){
+                    check(unlink(path.c_str()), "unlink", path);
+                    return 0;
+                });
+            }
+        });
+        fs::remove_all(base);
+    }
+
+    // Every thread lists one directory holding readdir_entries files, an op is a whole listing
+    void readdir_huge(unsigned threads, json& results){
+        const fs::path base = dir / "huge";
+        fs::create_directories(base);
+        run_threads(threads, [&](unsigned tid){
+            for(unsigned i = tid; i < params.readdir_entries; i += threads){
+                const fs::path path = base / file_name(0, i);
+                close(check(open(path.c_str(), O_WRONLY | O_CREAT, 0644), "create", path));
+            }
+        });
+
+        measure("readdir", threads, results, [&](unsigned, OpTimer& t){
+            for(unsigned pass = 0; pass < READDIR_PASSES; ++pass){
+                t.op([&](){
+                    DIR* d = opendir(base.c_str());
+                    if(!d){
+                        fail("opendir", base);
+                    }
+                    size_t entries = 0;
+                    while(readdir(d)){
+                        ++entries;
+                    }
+                    closedir(d);
+                    if(entries < params.readdir_entries){
+                        errno = EIO;
+                        fail("short listing of", base);
+                    }
+                    return 0;
+                });
+            }
+        });
+        fs::remove_all(base);
+    }
+
+    // Whole small files written and read back, an op is open, write or read, close
+    void small_files(unsigned threads, json& results){
+        const fs::path base = dir / "small";
+        fs::create_directories(base);
+        const std::vector<char> data(params.small_size, 's');
+
+        measure("small_write", threads, results, [&](unsigned tid, OpTimer& t){
+            for(unsigned i = 0; i < params.files; ++i){
+                const fs::path path = base / file_name(tid, i);
+                t.op([&](){
+                    write_file(path, data);
+                    return data.size();
+                });
+            }
+        });
+        measure("small_read", threads, results, [&](unsigned tid, OpTimer& t){
+            std::vector<char> buf(params.small_size);
+            for(unsigned i = 0; i < params.files; ++i){
+                const fs::path path = base / file_name(tid, i);
+                t.op([&](){
+                    int fd = check(open(path.c_str(), O_RDONLY), "open", path);
+                    const size_t bytes = read_all(fd, buf.data(), buf.size(), 0, path);
+                    close(fd);
+                    return bytes;
+                });
+            }
+        });
+        fs::remove_all(base);
+    }
+
+    fs::path large_file(unsigned tid) const{
+        return dir / "large" / ("t" + std::to_string(tid));
+    }
+
+    // One large_mb file per thread, written and read in SEQ_BLOCK ops. The final fsync counts as an op of the write.
+    void sequential(unsigned threads, json& results){
+        fs::create_directories(dir / "large");
+        const std::vector<char> block(SEQ_BLOCK, 'q');
+        const size_t blocks = params.large_mb * (1 << 20) / SEQ_BLOCK;
+
+        measure("seq_write", threads, results, [&](unsigned tid, OpTimer& t){
+            const fs::path path = large_file(tid);
+            int fd = check(open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644), "create", path);
+            for(size_t i = 0; i < blocks; ++i){
+                t.op([&](){
+                    write_all(fd, block.data(), block.size(), i * SEQ_BLOCK, path);
+                    return block.size();
+                });
+            }
+            t.op([&](){
+                check(fsync(fd), "fsync", path);
+                return 0;
+            });
+            close(fd);
+        });
+        measure("seq_read", threads, results, [&](unsigned tid, OpTimer& t){
+            const fs::path path = large_file(tid);
+            std::vector<char> buf(SEQ_BLOCK);
+            int fd = check(open(path.c_str(), O_RDONLY), "open", path);
+            drop_cache(fd);
+            for(size_t i = 0; i < blocks; ++i){
+                t.op([&](){
+                    return read_all(fd, buf.data(), buf.size(), i * SEQ_BLOCK, path);
+                });
+            }
+            close(fd);
+        });
+    }
+
+    // rand_ops aligned rand_block sized ops at random offsets of each thread's large file, written by seq if it ran
+    void random_io(unsigned threads, json& results){
+        const size_t size = params.large_mb * (1 << 20);
+        const size_t slots = size / params.rand_block;
+        if(slots == 0){
+            return;
+        }
+        fs::create_directories(dir / "large");
+        run_threads(threads, [&](unsigned tid){
+            const fs::path path = large_file(tid);
+            struct stat st;
+            if(stat(path.c_str(), &st) == 0 && static_cast<size_t>(st.st_size) >= size){
+                return;
+            }
+            const std::vector<char> block(SEQ_BLOCK, 'q');
+            int fd = check(open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644), "create", path);
+            for(size_t off = 0; off < size; off += SEQ_BLOCK){
+                write_all(fd, block.data(), std::min(SEQ_BLOCK, size - off), off, path);
+            }
+            close(fd);
+        });
+
+        measure("rand_write", threads, results, [&](unsigned tid, OpTimer& t){
+            const fs::path path = large_file(tid);
+            const std::vector<char> block(params.rand_block, 'r');
+            std::mt19937_64 rng(tid);
+            int fd = check(open(path.c_str(), O_WRONLY), "open", path);
+            for(unsigned i = 0; i < params.rand_ops; ++i){
+                const off_t off = (rng() % slots) * params.rand_block;
+                t.op([&](){
+                    write_all(fd, block.data(), block.size(), off, path);
+                    return block.size();
+                });
+            }
+            t.op([&](){
+                check(fsync(fd), "fsync", path);
+                return 0;
+            });
+            close(fd);
+        });
+        measure("rand_read", threads, results, [&](unsigned tid, OpTimer& t){
+            const fs::path path = large_file(tid);
+            std::vector<char> buf(params.rand_block);
+            std::mt19937_64 rng(tid + threads);
+            int fd = check(open(path.c_str(), O_RDONLY), "open", path);
+            drop_cache(fd);
+            for(unsigned i = 0; i < params.rand_ops; ++i){
+                const off_t off = (rng() % slots) * params.rand_block;
+                t.op([&](){
+                    return read_all(fd, buf.data(), buf.size(), off, path);
+                });
+            }
+            close(fd);
+        });
+        fs::remove_all(dir / "large");
+    }
+
+    // Cost of cloning a clone_files file tree through user.sealfs.clone, then of the first write into each clone
+    // (which fills in the cloned directories and breaks CoW on the file)
+    void clone(unsigned threads, json& results){
+        const fs::path src = dir / "clone_src";
+        const fs::path dst = dir / "clones";
+        const std::string src_rel = fs::relative(src, mount).string();
+        const std::vector<char> data(params.small_size, 'c');
+        for(unsigned sub = 0; sub < CLONE_SUBDIRS; ++sub){
+            fs::create_directories(src / ("s" + std::to_string(sub)));
+        }
+        run_threads(threads, [&](unsigned tid){
+            for(unsigned i = tid; i < params.clone_files; i += threads){
+                write_file(src / ("s" + std::to_string(i % CLONE_SUBDIRS)) / file_name(0, i), data);
+            }
+        });
+        fs::create_directories(dst);
+        auto clone_dir = [&](unsigned tid, unsigned i){
+            return dst / file_name(tid, i);
+        };
+
+        measure("clone", threads, results, [&](unsigned tid, OpTimer& t){
+            for(unsigned i = 0; i < params.clones; ++i){
+                const fs::path path = clone_dir(tid, i);
+                check(mkdir(path.c_str(), 0755), "mkdir", path);
+                t.op([&](){
+                    check(setxattr(path.c_str(), "user.sealfs.clone", src_rel.data(), src_rel.size(), 0), "clone into", path);
+                    return 0;
+                });
+            }
+        });
+        measure("clone_cow", threads, results, [&](unsigned tid, OpTimer& t){
+            const std::vector<char> block(std::min<size_t>(params.small_size, 4096), 'w');
+            for(unsigned i = 0; i < params.clones; ++i){
+                const fs::path path = clone_dir(tid, i) / "s0" / file_name(0, 0);
+                t.op([&](){
+                    int fd = check(open(path.c_str(), O_WRONLY), "open", path);
+                    write_all(fd, block.data(), block.size(), 0, path);
+                    close(fd);
+                    return block.size();
+                });
+            }
+        });
+        fs::remove_all(dst);
+        fs::remove_all(src);
+    }
+
+    void cleanup(){
+        std::error_code ec;
+        fs::remove_all(dir, ec);
+        if(ec){
+            logger->warn("Failed to remove {}: {}", dir.string(), ec.message());
+        }
+    }
+
+    fs::path mount;
+    params_t params;
+    std::shared_ptr<spdlog::logger> logger;
+    fs::path dir; // Everything the run creates, removed at the end
+};
+
+struct metric_t{
+    const char* name;
+    json::json_pointer pointer;
+    bool higher_is_better;
+    // If set, a regression is growing by more than this much rather than by the relative threshold. For metrics
+    // that are near 0 when healthy, where a relative change means nothing.
+    std::optional<double> slack = std::nullopt;
+};
+
+const std::vector<metric_t> METRICS = {
+    {"ops_s", json::json_pointer("/ops_s"), true},
+    {"mb_s", json::json_pointer("/mb_s"), true},
+    {"p50_us", json::json_pointer("/latency_us/p50"), false},
+    {"p99_us", json::json_pointer("/latency_us/p99"), false},
+    {"p999_us", json::json_pointer("/latency_us/p999"), false},
+    {"allocs/req", json::json_pointer("/daemon/allocs_per_request"), false, 0.01}
+};
+
+json load_report(const char* path){
+    std::ifstream in(path);
+    if(!in){
+        throw std::system_error(errno, std::generic_category(), std::string("open ") + path);
+    }
+    json report = json::parse(in);
+    if(report.value("version", 0) != REPORT_VERSION){
+        throw std::runtime_error(std::string(path) + " is not a sealfs_bench report this version understands");
+    }
+    return report;
+}
+
+// Print every metric of current next to baseline, true if any got worse by more than threshold_pct
+bool compare(const json& baseline, const json& current, double threshold_pct){
+    std::map<std::pair<std::string, unsigned>, const json*> base;
+    for(const auto& result : baseline.at("results")){
+        base[{result.at("workload").get<std::string>(), result.at("threads").get<unsigned>()}] = &result;
+    }
+
+    bool regressed = false;
+    printf("%-14s %7s %-11s %14s %14s %9s\n", "workload", "threads", "metric", "baseline", "current", "change");
+    for(const auto& result : current.at("results")){
+        const std::string workload = result.at("workload").get<std::string>();
+        const unsigned threads = result.at("threads").get<unsigned>();
+        auto it = base.find({workload, threads});
+        if(it == base.end()){
+            printf("%-14s %7u (not in baseline)\n", workload.c_str(), threads);
+            continue;
+        }
+        const json& old = *it->second;
+        for(const auto& metric : METRICS){
+            if(!old.contains(metric.pointer) || !result.contains(metric.pointer)){
+                continue;
+            }
+            const double was = old.at(metric.pointer).get<double>();
+            const double now = result.at(metric.pointer).get<double>();
+            if(was == 0 && now == 0){
+                continue;
+            }
+            const double change = was != 0 ? (now - was) / was * 100 : 100;
+            const bool bad = metric.slack ? now - was > *metric.slack : (metric.higher_is_better ? -change : change) > threshold_pct;
+            regressed = regressed || bad;
+            printf("%-14s %7u %-11s %14.2f %14.2f %+8.1f%%%s\n", workload.c_str(), threads, metric.name, was, now, change, bad ? "  REGRESSION" : "");
+        }
+    }
+    return regressed;
+}
+
+std::vector<std::string> split(const std::string& list){
+    std::vector<std::string> parts;
+    size_t start = 0;
+    while(start <= list.size()){
+        const size_t comma = std::min(list.find(',', start), list.size());
+        if(comma > start){
+            parts.push_back(list.substr(start, comma - start));
+        }
+        start = comma + 1;
+    }
+    return parts;
+}
+
+void usage(const char* prog){
+    fprintf(stderr, "usage: %s run [options] <mountpoint>\n"
+                    "       %s compare [-p PCT] <baseline.json> <report.json>\n\n"
+                    "run drives a mounted SealFS and writes a JSON report to stdout, working in a scratch directory\n"
+                    "it removes again. compare exits with 1 if a report regressed by more than PCT percent (default: 10).\n\n"
+                    "run options:\n"
+                    "    -t LIST   thread counts to run every workload at (default: 1,4)\n"
+                    "    -w LIST   workloads, of meta_flat, meta_deep, readdir, small, seq, rand, clone (default: all)\n"
+                    "    -n N      files per thread for the metadata and small file workloads (default: 2000)\n"
+                    "    -d N      directory depth for meta_deep (default: 8)\n"
+                    "    -e N      entries in the directory readdir lists (default: 100000)\n"
+                    "    -s N      small file size in bytes (default: 4096)\n"
+                    "    -l N      large file size per thread in MB, for seq and rand (default: 256)\n"
+                    "    -b N      random I/O size in bytes (default: 4096)\n"
+                    "    -r N      random I/Os per thread (default: 20000)\n"
+                    "    -c N      files in the tree clone copies (default: 1000)\n"
+                    "    -k N      clones per thread (default: 20)\n", prog, prog);
+}
+
+int run_main(int argc, char* argv[], std::shared_ptr<spdlog::logger> logger){
+    params_t params;
+    int opt;
+    while((opt = getopt(argc, argv, "t:w:n:d:e:s:l:b:r:c:k:")) != -1){
+        switch(opt){
+            case 't':
+                params.threads.clear();
+                for(const auto& count : split(optarg)){
+                    params.threads.push_back(std::stoul(count));
+                }
+                break;
+            case 'w':
+                params.workloads = split(optarg);
+                for(const auto& workload : params.workloads){
+                    if(std::find(ALL_WORKLOADS.begin(), ALL_WORKLOADS.end(), workload) == ALL_WORKLOADS.end()){
+                        logger->error("Unknown workload {}", workload);
+                        return 1;
+                    }
+                }
+                break;
+            case 'n': params.files = std::stoul(optarg); break;
+            case 'd': params.depth = std::stoul(optarg); break;
+            case 'e': params.readdir_entries = std::stoul(optarg); break;
+            case 's': params.small_size = std::stoul(optarg); break;
+            case 'l': params.large_mb = std::stoul(optarg); break;
+            case 'b': params.rand_block = std::stoul(optarg); break;
+            case 'r': params.rand_ops = std::stoul(optarg); break;
+            case 'c': params.clone_files = std::stoul(optarg); break;
+            case 'k': params.clones = std::stoul(optarg); break;
+            default:
+                return -1;
+        }
+    }
+    if(argc - optind != 1 || std::find(params.threads.begin(), params.threads.end(), 0u) != params.threads.end()){
+        return -1;
+    }
+    if(isatty(STDOUT_FILENO)){
+        logger->warn("Writing the report to a terminal, redirect stdout to keep it as a baseline");
+    }
+
+    Bench bench(argv[optind], params, logger);
+    printf("%s\n", bench.run().dump(2).c_str());
+    return 0;
+}
+
+int compare_main(int argc, char* argv[]){
+    double threshold_pct = 10;
+    int opt;
+    while((opt = getopt(argc, argv, "p:")) != -1){
+        if(opt != 'p'){
+            return -1;
+        }
+        threshold_pct = std::stod(optarg);
+    }
+    if(argc - optind != 2){
+        return -1;
+    }
+    return compare(load_report(argv[optind]), load_report(argv[optind + 1]), threshold_pct) ? 1 : 0;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]){
+    if(argc < 2){
+        usage(argv[0]);
+        return 1;
+    }
+
+    auto logger = spdlog::stderr_logger_mt("sealfs_bench");
+    const std::string cmd = argv[1];
+    int ret = -1;
+
+    try{
+        // getopt starts at the subcommand's own arguments
+        if(cmd == "run"){
+            ret = run_main(argc - 1, argv + 1, logger);
+        }
+        else if(cmd == "compare"){
+            ret = compare_main(argc - 1, argv + 1);
+        }
+    }
+    catch(const std::exception& e){
+        logger->error("{}", e.what());
+        return 1;
+    }
+
+    if(ret == -1){
+        usage(argv[0]);
+        return 1;
+    }
+    return ret;
+}
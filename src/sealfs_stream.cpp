@@ -0,0 +1,58 @@
+#include "stream.hpp"
+
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+
+#include <spdlog/sinks/stdout_sinks.h>
+
+static void usage(const char* prog){
+    fprintf(stderr, "usage: %s send [-i <from>] <persistence root> <snapshot>\n"
+                    "       %s receive <persistence root>\n\n"
+                    "send writes the snapshot to stdout, in full or as the changes since snapshot <from>.\n"
+                    "receive applies a stream from stdin to a persistence root that isn't mounted.\n", prog, prog);
+}
+
+int main(int argc, char* argv[]){
+    if(argc < 3){
+        usage(argv[0]);
+        return 1;
+    }
+
+    auto logger = spdlog::stderr_logger_mt("sealfs_stream");
+    const std::string cmd = argv[1];
+
+    try{
+        if(cmd == "send"){
+            std::string from;
+            int arg = 2;
+            if(strcmp(argv[arg], "-i") == 0 && argc == 6){
+                from = argv[arg + 1];
+                arg += 2;
+            }
+            if(argc - arg != 2){
+                usage(argv[0]);
+                return 1;
+            }
+            if(isatty(STDOUT_FILENO)){
+                logger->error("Refusing to write a send stream to a terminal");
+                return 1;
+            }
+            SealFS::SnapshotSender sender(argv[arg], logger);
+            return sender.send(from, argv[arg + 1], STDOUT_FILENO) ? 0 : 1;
+        }
+        if(cmd == "receive" && argc == 3){
+            SealFS::SnapshotReceiver receiver(argv[2], logger);
+            return receiver.receive(STDIN_FILENO) ? 0 : 1;
+        }
+    }
+    catch(const std::exception& e){
+        logger->error("{}", e.what());
+        return 1;
+    }
+
+    usage(argv[0]);
+    return 1;
+}
@@ -0,0 +1,381 @@
+#include "state.hpp"
+
+#include <sys/stat.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+
+using namespace SealFS;
+
+// Snapshots work at the granularity the tree is already persisted in. Every partition file and data object carries
+// the generation it was written in, and taking a snapshot only records the current generation and starts a new
+// one. From then on the live tree diverges lazily:
+//  - a partition file a snapshot still reads is hard linked to meta/versions/<dir>.<gen>.json before a commit
+//    replaces or deletes it
+//  - a data object a snapshot still reads is copied (reflinked where possible) before it is first written, see
+//    break_cow, and kept around rather than deleted once the live tree drops it
+// Both are tracked as gen_ranges in super.json and freed once the last snapshot needing them is deleted.
+
+void SealFS::to_json(json& j, const snapshot_t& snap){
+    j = json{
+        {"name", snap.name},
+        {"id", snap.id},
+        {"gen", snap.gen},
+        {"created", snap.created}
+    };
+    if(snap.clone_refs > 0 || !snap.held_by.empty() || snap.unclaimed){
+        j["clone_refs"] = snap.clone_refs;
+        j["held_by"] = snap.held_by;
+        j["unclaimed"] = snap.unclaimed;
+    }
+}
+
+void SealFS::from_json(const json& j, snapshot_t& snap){
+    snap.name = j.at("name").get<std::string>();
+    snap.id = j.at("id").get<uint32_t>();
+    snap.gen = j.at("gen").get<uint64_t>();
+    snap.created = j.at("created").get<time_t>();
+    snap.clone_refs = j.value("clone_refs", uint64_t(0));
+    snap.held_by = j.value("held_by", std::vector<uint32_t>{});
+    snap.unclaimed = j.value("unclaimed", false);
+}
+
+void SealFS::to_json(json& j, const gen_range& range){
+    j = json::array({range.id, range.birth, range.death});
+}
+
+void SealFS::from_json(const json& j, gen_range& range){
+    range.id = j.at(0).get<uint64_t>();
+    range.birth = j.at(1).get<uint64_t>();
+    range.death = j.at(2).get<uint64_t>();
+}
+
+bool SealFSData::needed_by_snapshot(const gen_range& range) const{
+    return std::any_of(snapshots.begin(), snapshots.end(), [&](const snapshot_t& snap){
+        return range.birth <= snap.gen && snap.gen < range.death;
+    });
+}
+
+void SealFSData::take_pending_snapshots(){
+    if(pending_snapshots.empty()){
+        return;
+    }
+
+    // Lazily cloned directories the new snapshots capture keep reading from the same snapshots they do now
+    std::vector<uint32_t> taken;
+    const time_t now = time(NULL);
+    for(auto& name : pending_snapshots){
+        logger->info("Taking snapshot {} at generation {}", name, cur_gen);
+        taken.push_back(next_snapshot_id);
+        snapshots.push_back({std::move(name), next_snapshot_id++, cur_gen, now});
+    }
+    pending_snapshots.clear();
+
+    for(auto& snap : snapshots){
+        if(snap.clone_refs > 0){
+            snap.held_by.insert(snap.held_by.end(), taken.begin(), taken.end());
+        }
+        else if(snap.hidden() && snap.held_by.empty() && std::find(taken.begin(), taken.end(), snap.id) != taken.end()){
+            // Taken for clone_dir, which holds on to it until the clone is committed
+            snap.clone_refs = 1;
+            snap.unclaimed = true;
+        }
+    }
+
+    ++cur_gen;
+    super_dirty = true;
+    rebuild_snapshots_dir();
+}
+
+bool SealFSData::preserve_partition(fuse_ino_t dir, uint64_t birth){
+    const auto path = get_partition_path(dir);
+    const auto version_path = get_partition_version_path(dir, birth);
+    if(link(path.c_str(), version_path.c_str()) == 0 || errno == EEXIST){
+        return true;
+    }
+    if(errno == ENOENT && std::filesystem::exists(version_path)){
+        return true;
+    }
+    logger->error("Failed to keep {} as {}: {}", path.string(), version_path.string(), strerror(errno));
+    return false;
+}
+
+void SealFSData::add_partition_version(fuse_ino_t dir, uint64_t birth, uint64_t death){
+    auto& versions = partition_versions[dir];
+    if(std::none_of(versions.begin(), versions.end(), [&](const gen_range& r){ return r.birth == birth; })){
+        versions.push_back({dir, birth, death});
+        super_dirty = true;
+    }
+}
+
+void SealFSData::collect_snapshot_garbage(){
+    size_t freed_data = 0;
+    size_t freed_versions = 0;
+
+    std::erase_if(retired_data, [&](const gen_range& range){
+        if(needed_by_snapshot(range)){
+            return false;
+        }
+        pending_data_removals.push_back(static_cast<uint32_t>(range.id));
+        ++freed_data;
+        return true;
+    });
+
+    for(auto it = partition_versions.begin(); it != partition_versions.end();){
+        auto& [dir, versions] = *it;
+        std::erase_if(versions, [&](const gen_range& range){
+            if(needed_by_snapshot(range)){
+                return false;
+            }
+            pending_version_removals.emplace_back(dir, range.birth);
+            ++freed_versions;
+            return true;
+        });
+        it = versions.empty() ? partition_versions.erase(it) : std::next(it);
+    }
+
+    super_dirty = true;
+    logger->info("Snapshot cleanup freed {} data objects and {} partition versions", freed_data, freed_versions);
+}
+
+std::filesystem::path SealFSData::snapshot_partition_path(fuse_ino_t dir, uint64_t gen){
+    auto it = partition_versions.find(dir);
+    if(it != partition_versions.end()){
+        for(const auto& range : it->second){
+            if(range.birth <= gen && gen < range.death){
+                return get_partition_version_path(dir, range.birth);
+            }
+        }
+    }
+    return get_partition_path(dir);
+}
+
+std::optional<json> SealFSData::read_partition_at(fuse_ino_t dir, uint64_t gen){
+    // The version is linked aside before the live file gets replaced, so while a commit is in flight one of the
+    // two always holds what generation gen saw
+    for(const auto& path : {snapshot_partition_path(dir, gen), get_partition_path(dir)}){
+        std::ifstream in(path);
+        if(!in.is_open()){
+            continue;
+        }
+        try{
+            json j;
+            in >> j;
+            if(j.value("gen", uint64_t(0)) <= gen){
+                return j;
+            }
+        }
+        catch(const std::exception& e){
+            logger->error("Failed to read {}: {}", path.string(), e.what());
+        }
+    }
+    return std::nullopt;
+}
+
+std::optional<json> SealFSData::read_clone_source(fuse_ino_t& dir, snapshot_t*& snap){
+    // Cloning a directory that was itself still a lazy clone chains them, bounded so a corrupt loop can't hang us
+    for(int depth = 0; depth < 64; ++depth){
+        auto j = read_partition_at(dir, snap->gen);
+        if(!j){
+            return std::nullopt;
+        }
+        const auto& clone = j->at("dir").value("clone", json(nullptr));
+        if(clone.is_null()){
+            return j;
+        }
+        snapshot_t* next = find_snapshot(clone.at(1).get<uint32_t>());
+        if(!next){
+            logger->error("Clone source of {} in snapshot {} is gone", dir, snap->id);
+            return std::nullopt;
+        }
+        dir = clone.at(0).get<fuse_ino_t>();
+        snap = next;
+    }
+    logger->error("Clone chain at {} is too deep", dir);
+    return std::nullopt;
+}
+
+bool SealFSData::load_snapshot_partition(const snapshot_t& snap, fuse_ino_t dir){
+    auto j = read_partition_at(dir, snap.gen);
+    if(!j){
+        logger->error("Snapshot {} has no partition {}", snap.name, dir);
+        return false;
+    }
+
+    fuse_ino_t lazy_src = INVALID_INODE;
+    uint32_t lazy_snap = 0;
+    auto add_view_entry = [&](inode_entry ent){
+        const fuse_ino_t orig = ent.ino;
+        ent.ino = ent.st.st_ino = snapshot_view_ino(snap.id, orig);
+        if(orig == ROOT_INODE){
+            ent.parent = SNAPSHOTS_DIR_INO;
+            ent.name = snap.name;
+        }
+        else{
+            ent.parent = snapshot_view_ino(snap.id, ent.parent);
+        }
+        ent.st.st_mode &= ~(S_IWUSR | S_IWGRP | S_IWOTH);
+        if(ent.children){
+            for(auto& [name, child] : ent.children.value()){
+                child = snapshot_view_ino(snap.id, child);
+            }
+        }
+        ent.nlookup = 0;
+        ent.clone_src = INVALID_INODE;
+        snapshot_inodes.try_emplace(ent.ino, std::move(ent));
+    };
+
+    try{
+        inode_entry dir_ent = j->at("dir").get<inode_entry>();
+        if(dir_ent.ino != dir || dir_ent.type != sealfs_ino_t::DIR){
+            logger->error("Snapshot {} partition {} does not describe directory {}", snap.name, dir, dir);
+            return false;
+        }
+        lazy_src = dir_ent.clone_src;
+        lazy_snap = dir_ent.clone_snap;
+        add_view_entry(std::move(dir_ent));
+        for(const auto& file : j->at("files")){
+            add_view_entry(file.get<inode_entry>());
+        }
+    }
+    catch(const std::exception& e){
+        logger->error("Failed to read snapshot {} partition {}: {}", snap.name, dir, e.what());
+        return false;
+    }
+
+    // A directory that was still a lazy clone shows the contents of its source, as seen by the snapshot it was
+    // cloned from. Its entries keep that snapshot's view inos.
+    if(lazy_src != INVALID_INODE){
+        snapshot_t* src_snap = find_snapshot(lazy_snap);
+        if(!src_snap || !load_snapshot_partition(*src_snap, lazy_src)){
+            logger->error("Snapshot {} lost the clone source of directory {}", snap.name, dir);
+            return true;
+        }
+        auto src_view = snapshot_inodes.find(snapshot_view_ino(src_snap->id, lazy_src));
+        if(src_view != snapshot_inodes.end()){
+            auto children = src_view->second.children;
+            snapshot_inodes.at(snapshot_view_ino(snap.id, dir)).children = std::move(children);
+        }
+    }
+    return true;
+}
+
+const std::optional<std::reference_wrapper<inode_entry>> SealFSData::lookup_snapshot_entry(fuse_ino_t view){
+    auto it = snapshot_inodes.find(view);
+    if(it != snapshot_inodes.end()){
+        return it->second;
+    }
+
+    const snapshot_t* snap = find_snapshot(snapshot_id_of(view));
+    if(!snap){
+        logger->error("Snapshot view ino {} belongs to no snapshot", view);
+        return std::nullopt;
+    }
+
+    // Same as the live tree, whatever isn't loaded yet is a directory whose partition hasn't been read
+    if(!load_snapshot_partition(*snap, snapshot_orig_ino(view)) || (it = snapshot_inodes.find(view)) == snapshot_inodes.end()){
+        return std::nullopt;
+    }
+    return it->second;
+}
+
+void SealFSData::rebuild_snapshots_dir(){
+    inode_entry& dir = snapshot_inodes[SNAPSHOTS_DIR_INO];
+    dir.ino = dir.st.st_ino = SNAPSHOTS_DIR_INO;
+    dir.parent = ROOT_INODE;
+    dir.name = SNAPSHOTS_DIR_NAME;
+    dir.type = sealfs_ino_t::DIR;
+    dir.data_id = INLINE_DATA_ID;
+    dir.st.st_mode = S_IFDIR | 0555;
+    dir.st.st_size = 4096;
+    dir.st.st_mtime = dir.st.st_ctime = dir.st.st_atime = time(NULL);
+
+    dir.children.emplace();
+    for(const auto& snap : snapshots){
+        if(!snap.hidden()){
+            (*dir.children)[snap.name] = snapshot_view_ino(snap.id, ROOT_INODE);
+            dir.st.st_mtime = dir.st.st_ctime = dir.st.st_atime = snap.created;
+        }
+    }
+    dir.st.st_nlink = 2 + dir.children->size();
+}
+
+snapshot_t* SealFSData::find_snapshot(uint32_t id){
+    auto it = std::find_if(snapshots.begin(), snapshots.end(), [&](const snapshot_t& s){ return s.id == id; });
+    return it == snapshots.end() ? nullptr : &*it;
+}
+
+void SealFSData::release_pins(){
+    std::vector<uint32_t> dropped;
+    for(;;){
+        auto it = std::find_if(snapshots.begin(), snapshots.end(), [](const snapshot_t& s){
+            return s.hidden() && s.clone_refs == 0 && s.held_by.empty() && !s.unclaimed;
+        });
+        if(it == snapshots.end()){
+            break;
+        }
+
+        // Whatever it held on to may have been all that kept an older one around
+        const uint32_t id = it->id;
+        dropped.push_back(id);
+        snapshots.erase(it);
+        for(auto& snap : snapshots){
+            std::erase(snap.held_by, id);
+        }
+    }
+    if(dropped.empty()){
+        return;
+    }
+
+    std::erase_if(snapshot_inodes, [&](const auto& entry){
+        return entry.first != SNAPSHOTS_DIR_INO && std::find(dropped.begin(), dropped.end(), snapshot_id_of(entry.first)) != dropped.end();
+    });
+    collect_snapshot_garbage();
+}
+
+int SealFSData::create_snapshot(const std::string& name){
+    {
+        auto guard = lock_state();
+        if(name.empty() || name == "." || name == ".." || name.find('/') != std::string::npos || name.size() > 255){
+            return EINVAL;
+        }
+        auto same_name = [&](const snapshot_t& s){ return s.name == name; };
+        if(std::any_of(snapshots.begin(), snapshots.end(), same_name) || std::find(pending_snapshots.begin(), pending_snapshots.end(), name) != pending_snapshots.end()){
+            return EEXIST;
+        }
+        pending_snapshots.push_back(name);
+    }
+
+    // Taken by the commit, under the same lock that copies out the dirty state it has to include
+    const int err = commit();
+
+    auto guard = lock_state();
+    if(std::none_of(snapshots.begin(), snapshots.end(), [&](const snapshot_t& s){ return s.name == name; })){
+        return err ? err : EIO;
+    }
+    return 0;
+}
+
+int SealFSData::delete_snapshot(const std::string& name){
+    {
+        auto guard = lock_state();
+        auto snap = std::find_if(snapshots.begin(), snapshots.end(), [&](const snapshot_t& s){ return s.name == name; });
+        if(snap == snapshots.end()){
+            return ENOENT;
+        }
+
+        logger->info("Deleting snapshot {} (generation {})", name, snap->gen);
+        if(snap->clone_refs > 0 || !snap->held_by.empty()){
+            logger->info("Snapshot {} still has lazy clones reading from it, keeping it hidden", name);
+        }
+        snap->name = "//" + name;
+
+        release_pins();
+        rebuild_snapshots_dir();
+        super_dirty = true;
+    }
+
+    return commit();
+}
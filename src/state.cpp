@@ -2,17 +2,20 @@
 
 #include <sys/stat.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <assert.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 
 #include <limits>
 #include <vector>
+#include <algorithm>
 #include <string>
 #include <unordered_map>
 
 #include <filesystem>
-#include <regex>
 #include <iostream>
 #include <fstream>
 
@@ -68,6 +71,48 @@ SealFSLock& SealFSLock::operator=(SealFSLock&& oth){
     return *this;
 }
 
+// inline_data may hold arbitrary bytes, which nlohmann::json refuses to dump as a string, so hex encode it
+static std::string hex_encode(const std::string& in){
+    static constexpr char digits[] = "0123456789abcdef";
+    std::string out;
+    out.reserve(in.size() * 2);
+    for(unsigned char c : in){
+        out.push_back(digits[c >> 4]);
+        out.push_back(digits[c & 0xf]);
+    }
+    return out;
+}
+
+static std::string hex_decode(const std::string& in){
+    auto nibble = [](char c) -> int{
+        if(c >= '0' && c <= '9') return c - '0';
+        if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+        throw std::runtime_error(std::format("Invalid hex digit {} in inline_data", c));
+    };
+    if(in.size() % 2 != 0){
+        throw std::runtime_error("Odd length inline_data");
+    }
+    std::string out(in.size() / 2, '\0');
+    for(size_t i = 0; i < out.size(); ++i){
+        out[i] = static_cast<char>((nibble(in[2 * i]) << 4) | nibble(in[2 * i + 1]));
+    }
+    return out;
+}
+
+void SealFS::to_json(json& j, const usage_t& usage){
+    j = json{
+        {"bytes", usage.bytes},
+        {"shared_bytes", usage.shared_bytes},
+        {"inodes", usage.inodes}
+    };
+}
+
+void SealFS::from_json(const json& j, usage_t& usage){
+    usage.bytes = j.at("bytes").get<int64_t>();
+    usage.shared_bytes = j.at("shared_bytes").get<int64_t>();
+    usage.inodes = j.at("inodes").get<int64_t>();
+}
+
 void SealFS::to_json(json& j, const inode_entry& inode){
     j = json{
         {"ino", inode.ino},
@@ -82,12 +127,26 @@ void SealFS::to_json(json& j, const inode_entry& inode){
             {"uid", inode.st.st_uid},
             {"gid", inode.st.st_gid},
             {"size", inode.st.st_size},
-            {"atime", inode.st.st_atime},
-            {"mtime", inode.st.st_mtime},
-            {"ctime", inode.st.st_ctime}
+            {"atime", inode.st.st_atim.tv_sec},
+            {"atime_ns", inode.st.st_atim.tv_nsec},
+            {"mtime", inode.st.st_mtim.tv_sec},
+            {"mtime_ns", inode.st.st_mtim.tv_nsec},
+            {"ctime", inode.st.st_ctim.tv_sec},
+            {"ctime_ns", inode.st.st_ctim.tv_nsec}
         }},
-        {"children", inode.children}
+        {"children", inode.children},
+        {"inline_data", hex_encode(inode.inline_data)},
+        {"data_gen", inode.data_gen}
     };
+    if(inode.type == sealfs_ino_t::DIR){
+        j["usage"] = inode.usage;
+    }
+    if(inode.is_lazy_clone()){
+        j["clone"] = {inode.clone_src, inode.clone_snap};
+    }
+    if(inode.noverify){
+        j["noverify"] = true;
+    }
 }
 
 void SealFS::from_json(const json& j, inode_entry& inode){
@@ -104,99 +163,969 @@ void SealFS::from_json(const json& j, inode_entry& inode){
     inode.st.st_uid  = j.at("st").at("uid").get<uid_t>();
     inode.st.st_gid  = j.at("st").at("gid").get<gid_t>();
     inode.st.st_size = j.at("st").at("size").get<off_t>();
-    inode.st.st_atime = j.at("st").at("atime").get<time_t>();
-    inode.st.st_mtime = j.at("st").at("mtime").get<time_t>();
-    inode.st.st_ctime = j.at("st").at("ctime").get<time_t>();
+    // Roots written before nanosecond timestamps only have the seconds
+    inode.st.st_atim = {j.at("st").at("atime").get<time_t>(), j.at("st").value("atime_ns", long(0))};
+    inode.st.st_mtim = {j.at("st").at("mtime").get<time_t>(), j.at("st").value("mtime_ns", long(0))};
+    inode.st.st_ctim = {j.at("st").at("ctime").get<time_t>(), j.at("st").value("ctime_ns", long(0))};
 
     if(j.contains("children") && !j.at("children").is_null()){
-        inode.children = j.at("children").get<std::unordered_map<std::string, fuse_ino_t>>();
+        inode.children = j.at("children").get<children_map>();
     }
     else{
         inode.children = std::nullopt;
     }
+
+    if(j.contains("inline_data")){
+        inode.inline_data = hex_decode(j.at("inline_data").get<std::string>());
+    }
+    else{
+        inode.inline_data.clear();
+    }
+
+    inode.data_gen = j.value("data_gen", uint64_t(0));
+
+    if(j.contains("clone")){
+        inode.clone_src = j.at("clone").at(0).get<fuse_ino_t>();
+        inode.clone_snap = j.at("clone").at(1).get<uint32_t>();
+    }
+    else{
+        inode.clone_src = INVALID_INODE;
+        inode.clone_snap = 0;
+    }
+
+    if(j.contains("usage")){
+        inode.usage = j.at("usage").get<usage_t>();
+    }
+    else{
+        inode.usage = {};
+    }
+
+    inode.noverify = j.value("noverify", false);
 }
 
 
+// fsync (or fdatasync) whatever is at path, directories included
+static bool fsync_path(const std::filesystem::path& path, bool data_only){
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd == -1){
+        return false;
+    }
+    int ret = data_only ? fdatasync(fd) : fsync(fd);
+    close(fd);
+    return ret == 0;
+}
+
 void SealFSData::validate_persistence_root(){
     std::filesystem::path structure_file = get_structure_path();
+    std::filesystem::path meta_dir = get_meta_path();
     std::filesystem::path data_dir = get_data_path();
+    std::filesystem::path versions_dir = get_versions_path();
+    std::filesystem::path sums_dir = get_sums_path();
 
+    if(std::filesystem::exists(structure_file) && !std::filesystem::is_regular_file(structure_file)){
+        throw std::runtime_error(std::format("Structure file {} exists but is not a regular file", structure_file.string()));
+    }
 
-    if(!std::filesystem::exists(structure_file)){
-        std::ofstream(structure_file);
+    for(const auto& dir : {meta_dir, data_dir, versions_dir, sums_dir}){
+        if(!std::filesystem::exists(dir)){
+            if(!std::filesystem::create_directory(dir)){
+                throw std::runtime_error(std::format("Could not find or create directory {}", dir.string()));
+            }
+        }
+        else if(!std::filesystem::is_directory(dir)){
+            throw std::runtime_error(std::format("{} exists but is not a directory", dir.string()));
+        }
     }
-    else if(!std::filesystem::is_regular_file(structure_file)){
-        throw std::runtime_error(std::format("Structure file {} exists but is not a regular file", structure_file.string()));
+
+    // The capacity tier hangs off the root as a link, so it comes back on every mount and tools working on an
+    // unmounted root find the objects on it too
+    const auto cold_link = get_cold_path();
+    if(config.cold_dir){
+        const auto target = std::filesystem::absolute(expand_user_path(config.cold_dir));
+        if(!std::filesystem::is_directory(target)){
+            throw std::runtime_error(std::format("Capacity tier {} is not a directory", target.string()));
+        }
+        if(std::filesystem::is_symlink(cold_link)){
+            const auto current = std::filesystem::read_symlink(cold_link);
+            if(current != target){
+                if(std::filesystem::exists(cold_link) && !std::filesystem::is_empty(cold_link)){
+                    throw std::runtime_error(std::format("Capacity tier {} still holds data objects, move them to {} first", current.string(), target.string()));
+                }
+                std::filesystem::remove(cold_link);
+                std::filesystem::create_directory_symlink(target, cold_link);
+            }
+        }
+        else if(std::filesystem::exists(cold_link)){
+            throw std::runtime_error(std::format("{} exists but is not a link to a capacity tier", cold_link.string()));
+        }
+        else{
+            std::filesystem::create_directory_symlink(target, cold_link);
+        }
+        fsync_path(persistence_root, false);
     }
+    else if(std::filesystem::is_symlink(cold_link) && !std::filesystem::is_directory(cold_link)){
+        throw std::runtime_error(std::format("Capacity tier {} is gone, data objects on it are unreachable", std::filesystem::read_symlink(cold_link).string()));
+    }
+}
+
+// Write contents to a temp file next to path, make it durable and rename it into place, so readers (and crashes)
+// only ever see whole files. The caller still has to fsync the containing directory to make the rename durable.
+bool SealFSData::write_file_atomic(const std::filesystem::path& path, const std::string& contents){
+    std::filesystem::path tmp_path = path;
+    tmp_path += ".tmp";
 
-    if(!std::filesystem::exists(data_dir)){
-        if(!std::filesystem::create_directory(data_dir)){
-            throw std::runtime_error(std::format("Could not find or create data directory {}", data_dir.string()));
+    int fd = traced_open(tmp_path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if(fd == -1){
+        logger->error("Failed to open {}", tmp_path.string());
+        return false;
+    }
+
+    size_t written = 0;
+    while(written < contents.size()){
+        ssize_t bytes = traced_pwrite(fd, contents.data() + written, contents.size() - written, written);
+        if(bytes == -1){
+            logger->error("Failed to write {}", tmp_path.string());
+            close(fd);
+            return false;
         }
+        written += bytes;
     }
-    else if(!std::filesystem::is_directory(data_dir)){
-        throw std::runtime_error(std::format("Data directory {} exists but is not a directory", data_dir.string()));
+
+    if(fdatasync(fd) == -1){
+        logger->error("Failed to sync {}", tmp_path.string());
+        close(fd);
+        return false;
+    }
+    close(fd);
+
+    if(::rename(tmp_path.c_str(), path.c_str()) == -1){
+        logger->error("Failed to rename {} into place", tmp_path.string());
+        return false;
     }
+    return true;
+}
 
-    std::regex valid_filename(R"(^\d+\.data$)");
-    for(const auto& entry : std::filesystem::directory_iterator(data_dir)){
-        std::string fname = entry.path().filename().string();
-        if(!std::filesystem::is_regular_file(entry)){
-            logger->warn("Non-file entry in data/: {}", fname);
+json SealFSData::super_json(){
+    json super{
+        {"version", 1},
+        {"next_ino", next_ino},
+        {"next_data_id", next_data_id},
+        {"sharers", data_sharers},
+        {"shared_sizes", shared_sizes},
+        {"gen", cur_gen},
+        {"next_snapshot_id", next_snapshot_id},
+        {"snapshots", snapshots},
+        {"partition_versions", partition_versions},
+        {"retired_data", retired_data},
+        {"usage_deltas", usage_deltas}
+    };
+    if(received){
+        super["received"] = *received;
+    }
+    return super;
+}
+
+std::optional<partition_snapshot> SealFSData::snapshot_partition(fuse_ino_t dir){
+    auto it = inodes.find(dir);
+    if(it == inodes.end() || it->second.type != sealfs_ino_t::DIR){
+        logger->error("Cannot snapshot partition {}, directory is not resident", dir);
+        return std::nullopt;
+    }
+
+    partition_snapshot snap{it->second, {}, cur_gen};
+    // What isn't folded in yet stays in super.json
+    if(auto delta = usage_deltas.find(dir); delta != usage_deltas.end()){
+        snap.dir.usage += -delta->second;
+    }
+    for(const auto& [name, child] : it->second.children.value()){
+        auto cit = inodes.find(child);
+        if(cit != inodes.end() && cit->second.type == sealfs_ino_t::FILE){
+            snap.files.push_back(cit->second);
         }
-        if(!std::regex_match(fname, valid_filename)){
-            logger->warn("Unexpected file in data/: {}", fname);
+    }
+    return snap;
+}
+
+json SealFSData::partition_json(const partition_snapshot& snap){
+    json j;
+    j["dir"] = snap.dir;
+    j["files"] = snap.files;
+    j["gen"] = snap.gen;
+    return j;
+}
+
+bool SealFSData::sync_data_object(uint32_t data_id){
+    auto path = get_data_ent_path(data_id);
+    int fd = traced_open(path.c_str(), O_RDONLY);
+    if(fd == -1){
+        // Removed since it was written, nothing left to make durable
+        return errno == ENOENT;
+    }
+    int ret = fdatasync(fd);
+    close(fd);
+    if(ret == -1){
+        logger->error("Failed to fdatasync data object {}", data_id);
+        return false;
+    }
+
+    // Checksums go out once the data they describe is on disk, the sidecar is only trusted if the object hasn't
+    // been touched since
+    if(auto sidecar = checksums->serialize(data_id)){
+        if(!write_file_atomic(checksums->sidecar_path(data_id), sidecar->first)){
+            return false;
         }
+        checksums->persisted(data_id, sidecar->second);
+        sums_dir_dirty = true;
     }
+    return true;
 }
 
-// TODO: At some point switch over to an atomic write
-bool SealFSData::write_structure_to_disk(){
+// Synchronous write-back of a single partition, used when paging a dirty directory out. Holds the state lock.
+bool SealFSData::write_partition(fuse_ino_t dir){
+    auto snap = snapshot_partition(dir);
+    if(!snap){
+        return false;
+    }
+
+    // Same ordering as a commit: file data first, then the counters, then the metadata pointing at both
+    for(const auto& file : snap->files){
+        if(dirty_data.contains(file.data_id)){
+            if(!sync_data_object(file.data_id)){
+                return false;
+            }
+            dirty_data.erase(file.data_id);
+        }
+    }
+    if(data_dir_dirty){
+        if(!fsync_path(get_data_path(), false)){
+            return false;
+        }
+        data_dir_dirty = false;
+    }
+    if(sums_dir_dirty.exchange(false) && !fsync_path(get_sums_path(), false)){
+        sums_dir_dirty = true;
+        return false;
+    }
+    if(super_dirty){
+        if(!write_file_atomic(get_super_path(), super_json().dump())){
+            return false;
+        }
+        super_dirty = false;
+    }
+
+    // Keep the version on disk if a snapshot still needs it
+    auto& state = partitions.at(dir);
+    if(state.disk_gen != NO_GEN && snapshot_needs(state.disk_gen)){
+        if(!preserve_partition(dir, state.disk_gen) || !fsync_path(get_versions_path(), false)){
+            return false;
+        }
+        add_partition_version(dir, state.disk_gen, snap->gen);
+        if(!write_file_atomic(get_super_path(), super_json().dump())){
+            return false;
+        }
+    }
+
     try{
-        nlohmann::json j = inodes;
-        std::ofstream out(get_structure_path());
-        out << j.dump(4);
+        if(!write_file_atomic(get_partition_path(dir), partition_json(*snap).dump()) || !fsync_path(get_meta_path(), false)){
+            return false;
+        }
+    }
+    catch(const std::exception& e){
+        logger->error("Failed to serialize partition {}: {}", dir, e.what());
+        return false;
+    }
+
+    dirty_partitions.erase(dir);
+    lazy_partitions.erase(dir);
+    state.disk_gen = snap->gen;
+    return true;
+}
+
+int SealFSData::commit(bool with_times){
+    std::unique_lock<std::mutex> lk(commit_mutex);
+    // Anything written before this call may have missed a commit that's already running, so wait for the next one
+    const uint64_t target = commits_started + 1;
+    flush_times = flush_times || with_times;
+    ++commit_waiters[target];
+
+    while(commits_done < target){
+        if(commit_running){
+            commit_cv.wait(lk);
+            continue;
+        }
+
+        // Leader: everyone who queued up behind the previous commit rides along on this one
+        commit_running = true;
+        const uint64_t epoch = ++commits_started;
+        const bool times = std::exchange(flush_times, false);
+        lk.unlock();
+
+        const bool ok = run_commit(times);
+
+        lk.lock();
+        commit_running = false;
+        commits_done = epoch;
+        if(!ok && commit_waiters.contains(epoch)){
+            failed_commits.insert(epoch);
+        }
+        commit_cv.notify_all();
+    }
+
+    // A later epoch failing says nothing about this one, its writes are on disk
+    const bool failed = failed_commits.contains(target);
+    if(--commit_waiters[target] == 0){
+        commit_waiters.erase(target);
+        failed_commits.erase(target);
+    }
+    return failed ? EIO : 0;
+}
+
+bool SealFSData::run_commit(bool with_times){
+    std::vector<uint32_t> data_ids;
+    std::vector<uint32_t> dead_data;
+    std::vector<partition_snapshot> snaps;
+    std::unordered_map<fuse_ino_t, uint64_t> removed;
+    std::vector<std::pair<fuse_ino_t, uint64_t>> preserve;
+    std::vector<std::pair<fuse_ino_t, uint64_t>> dead_versions;
+    std::unordered_set<fuse_ino_t> linked;
+    std::optional<json> super;
+    bool sync_data_dir = false;
+    size_t taken_snapshots = 0;
+
+    // Copy out everything dirty under the state lock, all serialization and I/O happens after it is released.
+    // Taking it all in one go makes the checkpoint a consistent point-in-time image of the tree, at the price of a
+    // stop-the-world copy: every request waits while each dirty partition's entries are copied, so one change in a
+    // large directory holds everything up for a copy of the whole directory (commit__copy__* probes time it).
+    {
+        auto guard = lock_state();
+        // A write still in flight to an object the snapshots below freeze would land in them, so those go first.
+        // New writes wait until the snapshots are taken, nothing else is held up.
+        const bool freeze = !pending_snapshots.empty();
+        if(freeze){
+            freezing_data = true;
+            data_writes_cv.wait(guard, [&]{ return data_writes == 0; });
+        }
+        SEALFS_TRACE(commit__copy__start);
+
+        // Snapshots read partitions as they are on disk, so they need the usage in there. Otherwise the deltas are
+        // only written back along with the resident directories once there are many of them.
+        if(freeze || usage_deltas.size() > config.checkpoint_dirty){
+            fold_usage_deltas(freeze);
+        }
+
+        data_ids.assign(dirty_data.begin(), dirty_data.end());
+        dirty_data.clear();
+        dead_data.swap(pending_data_removals);
+        removed.swap(removed_partitions);
+        dead_versions.swap(pending_version_removals);
+        linked.swap(linked_partitions);
+
+        sync_data_dir = data_dir_dirty;
+        data_dir_dirty = false;
+
+        // Timestamp changes ride along with anything else that dirtied their partition. Under lazytime they only
+        // go out on their own when asked to or once they've waited long enough.
+        const bool tree_changed = !dirty_partitions.empty();
+        if(!lazy_partitions.empty()){
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            std::erase_if(lazy_partitions, [&](const auto& lazy){
+                if(with_times || !config.lazytime || dirty_partitions.contains(lazy.first) || now.tv_sec - lazy.second >= LAZYTIME_EXPIRE){
+                    dirty_partitions.insert(lazy.first);
+                    return true;
+                }
+                return false;
+            });
+        }
+
+        snaps.reserve(dirty_partitions.size());
+        size_t copied = 0;
+        for(fuse_ino_t dir : dirty_partitions){
+            if(auto snap = snapshot_partition(dir)){
+                copied += 1 + snap->files.size();
+                snaps.push_back(std::move(*snap));
+            }
+        }
+        dirty_partitions.clear();
+        SEALFS_TRACE1(commit__copy__done, copied);
+
+        // Partition files about to be replaced or deleted that a snapshot still reads are kept as versions
+        auto keep_version = [&](fuse_ino_t dir, uint64_t disk_gen){
+            if(disk_gen != NO_GEN && snapshot_needs(disk_gen)){
+                preserve.emplace_back(dir, disk_gen);
+                add_partition_version(dir, disk_gen, cur_gen);
+            }
+        };
+        for(const auto& snap : snaps){
+            keep_version(snap.dir.ino, partitions.at(snap.dir.ino).disk_gen);
+        }
+        for(const auto& [dir, disk_gen] : removed){
+            keep_version(dir, disk_gen);
+        }
+
+        // Timestamps alone (reading a received tree moves atimes) don't stop a stream from applying
+        if(received && (tree_changed || !data_ids.empty() || !removed.empty() || !pending_snapshots.empty())){
+            logger->info("Tree changed since receiving {}, incremental streams no longer apply", received->value("snapshot", std::string()));
+            received.reset();
+            super_dirty = true;
+        }
+
+        // Snapshots see exactly what this commit writes
+        taken_snapshots = pending_snapshots.size();
+        take_pending_snapshots();
+        if(freeze){
+            freezing_data = false;
+            data_writes_cv.notify_all();
+        }
+
+        if(super_dirty){
+            super = super_json();
+            super_dirty = false;
+        }
+        commit_writing = true;
+    }
+
+    SEALFS_TRACE2(commit__start, data_ids.size(), snaps.size());
+    bool ok = true;
+
+    // 1. Data, so no metadata written below can point at bytes that aren't on disk yet
+    for(uint32_t data_id : data_ids){
+        ok = sync_data_object(data_id) && ok;
+    }
+    if(ok && sync_data_dir){
+        ok = fsync_path(get_data_path(), false);
+    }
+    if(ok && sums_dir_dirty.exchange(false) && !fsync_path(get_sums_path(), false)){
+        sums_dir_dirty = true;
+        ok = false;
+    }
+    SEALFS_TRACE1(commit__data__synced, data_ids.size());
+
+    // 2. Metadata. Anything spanning more than one file is staged in meta/journal.json first, so a crash part way
+    // through is replayed on the next mount instead of leaving a mix of old and new partitions behind.
+    json checkpoint;
+    try{
+        checkpoint["super"] = super ? *super : json(nullptr);
+        checkpoint["partitions"] = json::array();
+        for(const auto& snap : snaps){
+            checkpoint["partitions"].push_back(partition_json(snap));
+        }
+        checkpoint["preserve"] = preserve;
+        checkpoint["removed"] = json::array();
+        for(const auto& [dir, disk_gen] : removed){
+            checkpoint["removed"].push_back(dir);
+        }
+        checkpoint["dead_data"] = dead_data;
+        checkpoint["dead_versions"] = dead_versions;
+    }
+    catch(const std::exception& e){
+        logger->error("Failed to serialize checkpoint: {}", e.what());
+        ok = false;
+    }
+
+    const size_t files_touched = (super ? 1 : 0) + snaps.size() + removed.size() + dead_data.size() + dead_versions.size();
+    const bool journaled = files_touched > 1;
+    if(ok && journaled){
+        ok = write_file_atomic(get_journal_path(), checkpoint.dump()) && fsync_path(get_meta_path(), false);
+    }
+    if(ok && files_touched > 0){
+        ok = apply_checkpoint(checkpoint);
+    }
+    if(ok && journaled){
+        std::error_code ec;
+        std::filesystem::remove(get_journal_path(), ec);
+    }
+    SEALFS_TRACE1(commit__done, ok);
+
+    auto guard = lock_state();
+    commit_writing = false;
+    if(!ok){
+        logger->error("Commit failed, keeping {} data objects and {} partitions dirty", data_ids.size(), snaps.size());
+        dirty_data.insert(data_ids.begin(), data_ids.end());
+        pending_data_removals.insert(pending_data_removals.end(), dead_data.begin(), dead_data.end());
+        removed_partitions.insert(removed.begin(), removed.end());
+        pending_version_removals.insert(pending_version_removals.end(), dead_versions.begin(), dead_versions.end());
+        linked_partitions.insert(linked.begin(), linked.end());
+        data_dir_dirty = data_dir_dirty || sync_data_dir;
+        super_dirty = true;
+        for(const auto& snap : snaps){
+            auto it = inodes.find(snap.dir.ino);
+            if(it != inodes.end() && it->second.type == sealfs_ino_t::DIR){
+                register_partition(snap.dir.ino, true);
+            }
+        }
+        // The partitions those snapshots were meant to capture never made it to disk
+        if(taken_snapshots > 0){
+            logger->error("Dropping {} snapshots taken by the failed commit", taken_snapshots);
+            snapshots.resize(snapshots.size() - taken_snapshots);
+            for(auto& snap : snapshots){
+                std::erase_if(snap.held_by, [&](uint32_t id){ return id >= next_snapshot_id - taken_snapshots; });
+            }
+            collect_snapshot_garbage();
+            rebuild_snapshots_dir();
+        }
+    }
+    else{
+        for(const auto& snap : snaps){
+            auto it = partitions.find(snap.dir.ino);
+            if(it != partitions.end()){
+                it->second.disk_gen = snap.gen;
+            }
+        }
+        if(files_touched > 0 || !data_ids.empty()){
+            logger->info("Committed {} data objects and {} partitions", data_ids.size(), snaps.size());
+        }
+    }
+    return ok;
+}
+
+// Write out a checkpoint built by run_commit (or left behind in the journal by a crash). Idempotent.
+bool SealFSData::apply_checkpoint(const json& checkpoint){
+    bool ok = true;
+
+    // Versions snapshots still need are linked aside before anything replaces them. A link that already exists
+    // is from an earlier attempt at this same checkpoint, and still points at the old contents.
+    if(checkpoint.contains("preserve") && !checkpoint.at("preserve").empty()){
+        for(const auto& version : checkpoint.at("preserve")){
+            ok = preserve_partition(version.at(0).get<fuse_ino_t>(), version.at(1).get<uint64_t>()) && ok;
+        }
+        if(!ok || !fsync_path(get_versions_path(), false)){
+            return false;
+        }
+    }
+
+    // Counters before partitions, so a partition never references an ino that gets handed out again
+    if(!checkpoint.at("super").is_null()){
+        ok = write_file_atomic(get_super_path(), checkpoint.at("super").dump());
+    }
+    if(!ok){
+        return false;
+    }
+
+    for(const auto& partition : checkpoint.at("partitions")){
+        const fuse_ino_t dir = partition.at("dir").at("ino").get<fuse_ino_t>();
+        ok = write_file_atomic(get_partition_path(dir), partition.dump()) && ok;
+    }
+    if(!ok || !fsync_path(get_meta_path(), false)){
+        return false;
+    }
+
+    // Only now that nothing durable references them, drop removed directories and data
+    for(fuse_ino_t dir : checkpoint.at("removed")){
+        std::error_code ec;
+        std::filesystem::remove(get_partition_path(dir), ec);
+    }
+    for(uint32_t data_id : checkpoint.at("dead_data")){
+        std::error_code ec;
+        tiers->remove(data_id);
+        std::filesystem::remove(checksums->sidecar_path(data_id), ec);
+        checksums->forget(data_id);
+    }
+    if(checkpoint.contains("dead_versions")){
+        for(const auto& version : checkpoint.at("dead_versions")){
+            std::error_code ec;
+            std::filesystem::remove(get_partition_version_path(version.at(0).get<fuse_ino_t>(), version.at(1).get<uint64_t>()), ec);
+        }
+    }
+    return true;
+}
+
+bool SealFSData::replay_journal(){
+    if(!std::filesystem::exists(get_journal_path())){
         return true;
     }
+
+    try{
+        std::ifstream in(get_journal_path());
+        json checkpoint;
+        in >> checkpoint;
+        if(!apply_checkpoint(checkpoint)){
+            logger->error("Failed to replay {}", get_journal_path().string());
+            return false;
+        }
+        logger->warn("Replayed interrupted checkpoint with {} partitions", checkpoint.at("partitions").size());
+    }
     catch(const std::exception& e){
-        logger->error("Failed to write structure.json: {}", e.what());
+        logger->error("Failed to read {}: {}", get_journal_path().string(), e.what());
         return false;
     }
+
+    std::filesystem::remove(get_journal_path());
+    return true;
 }
 
-bool SealFSData::read_structure_from_disk(){
+void SealFSData::checkpoint_loop(std::stop_token stop){
+    logger->info("Checkpointer running every {}s or every {} dirty partitions", config.checkpoint_interval, config.checkpoint_dirty);
+
+    while(!stop.stop_requested()){
+        {
+            std::unique_lock<std::mutex> lk(checkpoint_mutex);
+            checkpoint_cv.wait_for(lk, stop, std::chrono::seconds(config.checkpoint_interval), [&]{ return checkpoint_requested.load(); });
+        }
+        if(stop.stop_requested()){
+            break;
+        }
+        checkpoint_requested = false;
+        commit(false);
+    }
+}
+
+bool SealFSData::load_partition(fuse_ino_t dir){
+    std::string contents;
+    if(!traced_read_file(get_partition_path(dir).c_str(), contents)){
+        return false;
+    }
+
+    size_t nfiles = 0;
+    uint64_t disk_gen = 0;
     try{
-        std::ifstream in(get_structure_path());
-        if(!in.is_open() || in.peek() == std::ifstream::traits_type::eof()){
-            logger->warn("structure.json does not exist or is empty, initializing empty inodes");
+        json j = json::parse(contents);
+        disk_gen = j.value("gen", uint64_t(0));
 
-            const auto root = create_inode_entry(SealFS::INVALID_INODE, "", SealFS::sealfs_ino_t::DIR, 0777);
-            if(!root){
-                logger->error("Failed to create root dir");
-                return false;
+        inode_entry dir_ent = j.at("dir").get<inode_entry>();
+        if(dir_ent.ino != dir || dir_ent.type != sealfs_ino_t::DIR){
+            logger->error("Partition {} does not describe directory {}", get_partition_path(dir).string(), dir);
+            return false;
+        }
+        if(auto [it, inserted] = inodes.try_emplace(dir, std::move(dir_ent)); inserted){
+            if(auto delta = usage_deltas.find(dir); delta != usage_deltas.end()){
+                it->second.usage += delta->second;
             }
-            return true;
         }
+
+        for(const auto& file : j.at("files")){
+            inode_entry ent = file.get<inode_entry>();
+            fuse_ino_t ino = ent.ino;
+            inodes.try_emplace(ino, std::move(ent));
+            ++nfiles;
+        }
+    }
+    catch(const std::exception& e){
+        logger->error("Failed to read partition {}: {}", dir, e.what());
+        return false;
+    }
+
+    register_partition(dir, false);
+    partitions.at(dir).disk_gen = disk_gen;
+    logger->info("Paged in partition {} with {} files", dir, nfiles);
+    return true;
+}
+
+void SealFSData::register_partition(fuse_ino_t dir, bool dirty){
+    auto it = partitions.find(dir);
+    if(it == partitions.end()){
+        it = partitions.emplace(dir, partition_state{}).first;
+        it->second.clock_pos = clock.insert(clock_hand, dir);
+    }
+    it->second.referenced = true;
+
+    if(dirty && dirty_partitions.insert(dir).second && dirty_partitions.size() == config.checkpoint_dirty){
+        checkpoint_requested = true;
+        checkpoint_cv.notify_one();
+    }
+}
+
+void SealFSData::unregister_partition(fuse_ino_t dir){
+    auto it = partitions.find(dir);
+    if(it == partitions.end()){
+        return;
+    }
+    const bool at_hand = clock_hand == it->second.clock_pos;
+    auto next = clock.erase(it->second.clock_pos);
+    if(at_hand){
+        clock_hand = next;
+    }
+    partitions.erase(it);
+    dirty_partitions.erase(dir);
+    lazy_partitions.erase(dir);
+}
+
+void SealFSData::mark_dirty(const inode_entry& ent){
+    if(ent.is_orphan()){
+        return;
+    }
+    register_partition(partition_of(ent), true);
+}
+
+void SealFSData::mark_times_dirty(const inode_entry& ent){
+    if(ent.is_orphan()){
+        return;
+    }
+    const fuse_ino_t dir = partition_of(ent);
+    register_partition(dir, false);
+    if(!dirty_partitions.contains(dir)){
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        lazy_partitions.emplace(dir, now.tv_sec);
+    }
+}
+
+void SealFSData::touch_atime(inode_entry& ent, InodeIO* io){
+    if(config.atime_mode == ATIME_OFF){
+        return;
+    }
+    static constexpr time_t DAY = 24 * 60 * 60;
+    auto not_after = [](const struct timespec& a, const struct timespec& b){
+        return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec <= b.tv_nsec);
+    };
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    const struct stat& st = ent.st;
+    if(config.atime_mode == ATIME_STRICT || not_after(st.st_atim, st.st_mtim) || not_after(st.st_atim, st.st_ctim) || now.tv_sec - st.st_atim.tv_sec >= DAY){
+        ent.st.st_atim = now;
+        mark_times_dirty(ent);
+    }
+    // Under relatime the next update is a day out, unless the file changes first
+    if(io && config.atime_mode == ATIME_RELATIVE){
+        io->atime_due = ent.st.st_atim.tv_sec + DAY;
+    }
+}
+
+// Migrate a pre-partitioning structure.json into meta/, leaving the whole tree resident
+bool SealFSData::migrate_structure_file(){
+    try{
+        std::ifstream in(get_structure_path());
         nlohmann::json j;
         in >> j;
         inodes = j.get<std::unordered_map<fuse_ino_t, inode_entry>>();
-        fuse_ino_t max_ino = 0;
-        uint32_t max_data_id = 0;
-        for(const auto &[ino, ent] : inodes){
-            max_ino = std::max(max_ino, ino);
-            max_data_id = std::max(max_data_id, ent.data_id);
-        }
-        next_ino = max_ino + 1;
-        next_data_id = max_data_id + 1;
-        return true;
     }
     catch(const std::exception& e){
         logger->error("Failed to read structure.json: {}", e.what());
         return false;
     }
+
+    fuse_ino_t max_ino = 0;
+    uint32_t max_data_id = 0;
+    for(const auto &[ino, ent] : inodes){
+        max_ino = std::max(max_ino, ino);
+        max_data_id = std::max(max_data_id, ent.data_id);
+        if(ent.type == sealfs_ino_t::DIR){
+            register_partition(ino, true);
+        }
+    }
+    next_ino = max_ino + 1;
+    next_data_id = max_data_id + 1;
+    super_dirty = true;
+    rebuild_accounting();
+
+    if(commit() != 0){
+        logger->error("Failed to migrate structure.json to {}", get_meta_path().string());
+        return false;
+    }
+
+    std::filesystem::path migrated = get_structure_path();
+    migrated += ".migrated";
+    std::filesystem::rename(get_structure_path(), migrated);
+    logger->info("Migrated structure.json with {} inodes to per-directory partitions", inodes.size());
+    return true;
 }
 
-SealFSData::SealFSData(const std::filesystem::path& path): persistence_root(path), plock(persistence_root){
+bool SealFSData::read_metadata_from_disk(){
+    if(!replay_journal()){
+        return false;
+    }
+
+    try{
+        if(std::filesystem::exists(get_super_path())){
+            std::ifstream in(get_super_path());
+            json j;
+            in >> j;
+            next_ino = j.at("next_ino").get<fuse_ino_t>();
+            next_data_id = j.at("next_data_id").get<uint32_t>();
+            // Needed by every partition loaded from here on
+            if(j.contains("usage_deltas")){
+                usage_deltas = j.at("usage_deltas").get<std::unordered_map<fuse_ino_t, usage_t>>();
+            }
+
+            if(!load_partition(ROOT_INODE)){
+                logger->error("Failed to load root partition");
+                return false;
+            }
+
+            cur_gen = j.value("gen", uint64_t(1));
+            next_snapshot_id = j.value("next_snapshot_id", uint32_t(1));
+            if(j.contains("snapshots")){
+                snapshots = j.at("snapshots").get<std::vector<snapshot_t>>();
+                partition_versions = j.at("partition_versions").get<std::unordered_map<fuse_ino_t, std::vector<gen_range>>>();
+                retired_data = j.at("retired_data").get<std::vector<gen_range>>();
+            }
+            if(j.contains("received")){
+                received = j.at("received");
+            }
+
+            // A clone_dir that went down between taking its snapshot and committing the clone never claimed it
+            bool unclaimed = false;
+            for(auto& snap : snapshots){
+                if(snap.unclaimed){
+                    snap.unclaimed = false;
+                    --snap.clone_refs;
+                    unclaimed = true;
+                }
+            }
+            if(unclaimed){
+                release_pins();
+            }
+
+            if(j.contains("sharers")){
+                data_sharers = j.at("sharers").get<std::unordered_map<uint32_t, std::vector<fuse_ino_t>>>();
+                if(j.contains("shared_sizes")){
+                    shared_sizes = j.at("shared_sizes").get<std::unordered_map<uint32_t, int64_t>>();
+                }
+                recount_shared();
+            }
+            else{
+                rebuild_accounting();
+            }
+            return true;
+        }
+    }
+    catch(const std::exception& e){
+        logger->error("Failed to read super.json: {}", e.what());
+        return false;
+    }
+
+    const auto structure_file = get_structure_path();
+    if(std::filesystem::exists(structure_file) && std::filesystem::file_size(structure_file) > 0){
+        return migrate_structure_file();
+    }
+
+    logger->warn("No metadata found, initializing empty inodes");
+    const auto root = create_inode_entry(SealFS::INVALID_INODE, "", SealFS::sealfs_ino_t::DIR, 0777);
+    if(!root){
+        logger->error("Failed to create root dir");
+        return false;
+    }
+    return true;
+}
+
+std::shared_ptr<InodeIO> SealFSData::get_inode_io(fuse_ino_t ino){
+    auto& slot = inode_io[ino];
+    auto io = slot.lock();
+    if(!io){
+        io = std::make_shared<InodeIO>();
+        slot = io;
+    }
+    return io;
+}
+
+void SealFSData::put_inode_io(fuse_ino_t ino, std::shared_ptr<InodeIO>& io){
+    io.reset();
+    auto it = inode_io.find(ino);
+    if(it != inode_io.end() && it->second.expired()){
+        inode_io.erase(it);
+        reap_if_unused(ino);
+    }
+}
+
+void SealFSData::forget(fuse_ino_t ino, uint64_t nlookup){
+    auto ent = lookup_resident_entry(ino);
+    if(!ent){
+        logger->warn("Kernel forgot non-resident ino {}", ino);
+        return;
+    }
+    auto& unwrapped_ent = ent.value().get();
+    unwrapped_ent.nlookup -= std::min(unwrapped_ent.nlookup, nlookup);
+    if(unwrapped_ent.nlookup == 0){
+        reap_if_unused(ino);
+    }
+}
+
+bool SealFSData::in_use(const inode_entry& ent){
+    if(ent.nlookup > 0){
+        return true;
+    }
+    auto it = inode_io.find(ent.ino);
+    return it != inode_io.end() && !it->second.expired();
+}
+
+void SealFSData::destroy(inode_entry& ent){
+    const fuse_ino_t ino = ent.ino;
+    if(ent.type == sealfs_ino_t::FILE && !ent.is_inline()){
+        release_data(ent);
+    }
+    orphans.erase(ino);
+    inodes.erase(ino);
+}
+
+void SealFSData::reap_if_unused(fuse_ino_t ino){
+    if(!orphans.contains(ino)){
+        return;
+    }
+    auto it = inodes.find(ino);
+    if(it != inodes.end() && !in_use(it->second)){
+        logger->info("Destroying unlinked ino {}, its last reference is gone", ino);
+        destroy(it->second);
+    }
+}
+
+bool SealFSData::is_evictable(fuse_ino_t dir){
+    if(dir == ROOT_INODE || linked_partitions.contains(dir)){
+        return false;
+    }
+
+    auto it = inodes.find(dir);
+    if(it == inodes.end()){
+        return true;
+    }
+    if(it->second.nlookup > 0){
+        return false;
+    }
+    for(const auto& [name, child] : it->second.children.value()){
+        auto cit = inodes.find(child);
+        if(cit != inodes.end() && cit->second.type == sealfs_ino_t::FILE && cit->second.nlookup > 0){
+            return false;
+        }
+    }
+    return true;
+}
+
+void SealFSData::evict_if_needed(){
+    const size_t budget = config.meta_cache_mb << 20;
+    // Partitions copied out by a running commit have to stay put in case it fails and they need to be re-dirtied
+    if(commit_writing || inodes.size() * APPROX_ENTRY_BYTES <= budget){
+        return;
+    }
+
+    size_t evicted = 0;
+    // Two sweeps are enough for every reference bit to be cleared once
+    for(size_t scanned = 0, limit = 2 * clock.size(); scanned < limit && !clock.empty() && inodes.size() * APPROX_ENTRY_BYTES > budget; ++scanned){
+        if(clock_hand == clock.end()){
+            clock_hand = clock.begin();
+        }
+        fuse_ino_t dir = *clock_hand;
+        auto& state = partitions.at(dir);
+
+        if(state.referenced){
+            state.referenced = false;
+            ++clock_hand;
+            continue;
+        }
+        if(!is_evictable(dir) || ((dirty_partitions.contains(dir) || lazy_partitions.contains(dir)) && !write_partition(dir))){
+            ++clock_hand;
+            continue;
+        }
+
+        auto it = inodes.find(dir);
+        if(it != inodes.end()){
+            for(const auto& [name, child] : it->second.children.value()){
+                auto cit = inodes.find(child);
+                if(cit != inodes.end() && cit->second.type == sealfs_ino_t::FILE){
+                    inodes.erase(cit);
+                }
+            }
+            inodes.erase(it);
+        }
+        unregister_partition(dir);
+        ++evicted;
+    }
+
+    if(evicted){
+        logger->info("Paged out {} partitions, {} inodes resident", evicted, inodes.size());
+    }
+}
+
+SealFSData::SealFSData(const std::filesystem::path& path, const SealFSConfig& config): persistence_root(path), plock(persistence_root), config(config){
     // TODO: Check whether this can take a std::filesystem::path directly?
     std::filesystem::path log_file = get_log_path();
     logger = spdlog::basic_logger_mt("SealFS Logger", log_file);
@@ -205,11 +1134,23 @@ SealFSData::SealFSData(const std::filesystem::path& path): persistence_root(path
     logger->info("Acquired lock on persistence root {}", persistence_root.string());
 
     validate_persistence_root();
+    tiers = std::make_unique<DataTiers>(get_data_path(), std::filesystem::exists(get_cold_path()) ? get_cold_path() : std::filesystem::path(), logger);
+    tiers->scan();
+    checksums = std::make_unique<ChecksumStore>(*tiers, get_sums_path(), logger, config.checksum);
+
+    read_metadata_from_disk();
+    rebuild_snapshots_dir();
 
-    read_structure_from_disk();
+    start_fsck();
+    start_checksums();
+    start_migrator();
+
+    if(config.checkpoint_interval > 0){
+        checkpointer = std::jthread([this](std::stop_token stop){ checkpoint_loop(stop); });
+    }
 }
 
-SealFSData::SealFSData(){
+SealFSData::SealFSData(const SealFSConfig& config): config(config){
     persistence_root = get_default_persistence_root();
     plock = SealFSLock(persistence_root);
 
@@ -221,28 +1162,89 @@ SealFSData::SealFSData(){
     logger->info("Acquired lock on persistence root {}", persistence_root.string());
 
     validate_persistence_root();
+    tiers = std::make_unique<DataTiers>(get_data_path(), std::filesystem::exists(get_cold_path()) ? get_cold_path() : std::filesystem::path(), logger);
+    tiers->scan();
+    checksums = std::make_unique<ChecksumStore>(*tiers, get_sums_path(), logger, config.checksum);
+
+    read_metadata_from_disk();
+    rebuild_snapshots_dir();
+
+    start_fsck();
+    start_checksums();
+    start_migrator();
+
+    if(config.checkpoint_interval > 0){
+        checkpointer = std::jthread([this](std::stop_token stop){ checkpoint_loop(stop); });
+    }
+}
+
+void SealFSData::start_fsck(){
+    if(config.fsck_mode == FSCK_OFF){
+        return;
+    }
+
+    fsck = std::make_unique<Fsck>(get_meta_path(), *tiers, logger, config.fsck_threads, next_data_id);
+    if(config.fsck_mode == FSCK_SYNC){
+        fsck->run_sync();
+    }
+    else{
+        // Written by an open handle, or since the last commit (or by the one running), the size on disk is ahead of
+        // the one committed
+        fsck->start_async([this](uint32_t data_id){
+            auto guard = lock_state();
+            return commit_writing || object_handles.contains(data_id) || dirty_data.contains(data_id);
+        });
+    }
+}
 
-    read_structure_from_disk();
+void SealFSData::start_checksums(){
+    // Sums the scrubber rebuilt ride along with the next commit
+    checksums->start_scrubber(config.scrub_mb, config.scrub_interval, [this](uint32_t data_id){
+        auto guard = lock_state();
+        mark_data_dirty(data_id);
+    });
 }
 
 SealFSData::~SealFSData(){
-    write_structure_to_disk();
+    if(migrator.joinable()){
+        migrator.request_stop();
+        migrator.join();
+    }
+    // Periodic checkpoints keep this last commit down to whatever changed in the final interval
+    if(checkpointer.joinable()){
+        checkpointer.request_stop();
+        checkpointer.join();
+    }
+    checksums->stop_scrubber();
+    // The kernel doesn't forget anything on unmount, whatever was unlinked while open goes now
+    while(!orphans.empty()){
+        auto it = inodes.find(*orphans.begin());
+        if(it == inodes.end()){
+            orphans.erase(orphans.begin());
+            continue;
+        }
+        destroy(it->second);
+    }
+    commit();
 
     logger->info("Releasing lock on persistence root {}", persistence_root.string());
     logger->flush();
 }
 
 fuse_ino_t SealFSData::get_parent(fuse_ino_t node){
-    auto it = inodes.find(node);
-    if(it == inodes.end()){
-        logger->error("Failed to find inode {}", node);
+    auto ent = lookup_entry(node);
+    if(!ent){
         return -1;
     }
-    return it->second.parent;
+    return ent.value().get().parent;
 }
 
 // Remove all references to this node, if data has 0 other refs, also delete corresponding data.
 bool SealFSData::remove(fuse_ino_t node, sealfs_ino_t expected_type){
+    if(is_snapshot_ino(node)){
+        return false;
+    }
+
     auto entry = lookup_entry(node);
     if(!entry){
         return false;
@@ -255,13 +1257,15 @@ bool SealFSData::remove(fuse_ino_t node, sealfs_ino_t expected_type){
     }
 
     fuse_ino_t parent_ino = unwrapped_ent.parent;
-    auto it = inodes.find(parent_ino);
 
     if(expected_type == sealfs_ino_t::DIR && unwrapped_ent.children.value().size() != 0){
         logger->warn("Failed to delete dir {} since it is nonempty", node);
         return false;
     }
 
+    account(parent_ino, unwrapped_ent.type == sealfs_ino_t::DIR ? -unwrapped_ent.usage : -file_usage(unwrapped_ent));
+    auto it = inodes.find(parent_ino);
+
     if(it != inodes.end()){
         auto& parent_map = it->second.children;
         if(parent_map){
@@ -271,23 +1275,188 @@ bool SealFSData::remove(fuse_ino_t node, sealfs_ino_t expected_type){
                 unwrapped_pmap.erase(ino_it);
             }
         }
+        mark_dirty(it->second);
     }
 
-    if(unwrapped_ent.type == sealfs_ino_t::FILE){
-        auto data_ent_path = get_data_ent_path(unwrapped_ent.data_id);
-        bool wks = std::filesystem::remove(data_ent_path);
-        logger->info("Status of removing data ent path for ino {} is {}", node, wks);
-        inodes.erase(inodes.find(node));
-        return wks;
+    if(unwrapped_ent.type == sealfs_ino_t::DIR){
+        auto pit = partitions.find(node);
+        removed_partitions[node] = pit != partitions.end() ? pit->second.disk_gen : NO_GEN;
+        usage_deltas.erase(node);
+        unregister_partition(node);
     }
-    else{
-        inodes.erase(inodes.find(node));
+
+    // Out of the tree either way. A file something still references keeps its entry and data until it doesn't,
+    // with no parent its partition won't write it out anymore and size changes don't reach any directory's usage.
+    if(unwrapped_ent.type == sealfs_ino_t::FILE && in_use(unwrapped_ent)){
+        unwrapped_ent.parent = INVALID_INODE;
+        unwrapped_ent.st.st_nlink = 0;
+        clock_gettime(CLOCK_REALTIME, &unwrapped_ent.st.st_ctim);
+        orphans.insert(node);
+        logger->info("Unlinked ino {} while referenced, kept until the kernel forgets it and its handles close", node);
         return true;
     }
+
+    logger->info("Removed ino {}", node);
+    destroy(unwrapped_ent);
+    return true;
 }
 
+// Entries only ever move between the children maps of resident directories, so this is O(1) whatever is being
+// moved. A lazily cloned directory moves as it is, still unfilled.
+int SealFSData::rename(fuse_ino_t parent, const char* name, fuse_ino_t newparent, const char* newname, unsigned int flags){
+    if((flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE)) || ((flags & RENAME_NOREPLACE) && (flags & RENAME_EXCHANGE))){
+        return EINVAL;
+    }
+    if(is_snapshot_ino(parent) || is_snapshot_ino(newparent)){
+        return EROFS;
+    }
+
+    auto from_ent = lookup_entry(parent);
+    auto to_ent = lookup_entry(newparent);
+    if(!from_ent || !to_ent){
+        return ENOENT;
+    }
+    auto& from = from_ent.value().get();
+    auto& to = to_ent.value().get();
+    if(from.type != sealfs_ino_t::DIR || to.type != sealfs_ino_t::DIR){
+        return ENOTDIR;
+    }
+
+    const fuse_ino_t ino = lookup(parent, name);
+    if(ino == INVALID_INODE){
+        return ENOENT;
+    }
+    auto tit = to.children.value().find(newname);
+    const fuse_ino_t target = tit != to.children.value().end() ? tit->second : INVALID_INODE;
+    // /.snapshots can't be moved or replaced
+    if(is_snapshot_ino(ino) || (newparent == ROOT_INODE && strcmp(newname, SNAPSHOTS_DIR_NAME) == 0)){
+        return EROFS;
+    }
+    if(target == INVALID_INODE && (flags & RENAME_EXCHANGE)){
+        return ENOENT;
+    }
+    if(target != INVALID_INODE && (flags & RENAME_NOREPLACE)){
+        return EEXIST;
+    }
+    if(target == ino){
+        return 0;
+    }
+
+    auto it = page_in(ino);
+    if(it == inodes.end()){
+        return EIO;
+    }
+    auto& ent = it->second;
+
+    // A directory can't end up inside itself
+    auto inside = [&](fuse_ino_t dir, fuse_ino_t under) -> std::optional<bool>{
+        for(fuse_ino_t cur = under; cur != INVALID_INODE;){
+            if(cur == dir){
+                return true;
+            }
+            auto up = lookup_entry(cur);
+            if(!up){
+                return std::nullopt;
+            }
+            cur = up.value().get().parent;
+        }
+        return false;
+    };
+
+    inode_entry* other = nullptr;
+    if(target != INVALID_INODE){
+        auto target_ent = lookup_entry(target);
+        if(!target_ent){
+            return EIO;
+        }
+        other = &target_ent.value().get();
+
+        if(flags & RENAME_EXCHANGE){
+            if(other->type == sealfs_ino_t::DIR && parent != newparent){
+                const auto cycle = inside(target, parent);
+                if(!cycle){
+                    return EIO;
+                }
+                if(*cycle){
+                    return EINVAL;
+                }
+            }
+        }
+        else if(ent.type == sealfs_ino_t::DIR && other->type != sealfs_ino_t::DIR){
+            return ENOTDIR;
+        }
+        else if(ent.type != sealfs_ino_t::DIR && other->type == sealfs_ino_t::DIR){
+            return EISDIR;
+        }
+        else if(other->type == sealfs_ino_t::DIR && !other->children.value().empty()){
+            return ENOTEMPTY;
+        }
+    }
+    if(ent.type == sealfs_ino_t::DIR && parent != newparent){
+        const auto cycle = inside(ino, newparent);
+        if(!cycle){
+            return EIO;
+        }
+        if(*cycle){
+            return EINVAL;
+        }
+    }
+
+    if(other && !(flags & RENAME_EXCHANGE)){
+        if(!remove(target, other->type)){
+            return EIO;
+        }
+        other = nullptr;
+    }
+
+    // Usage follows the entries up their new ancestors
+    auto relocate = [&](inode_entry& moved, fuse_ino_t dst, const char* dst_name){
+        if(moved.parent != dst){
+            const usage_t usage = moved.type == sealfs_ino_t::DIR ? moved.usage : file_usage(moved);
+            account(moved.parent, -usage);
+            account(dst, usage);
+        }
+        moved.parent = dst;
+        moved.name = dst_name;
+        clock_gettime(CLOCK_REALTIME, &moved.st.st_ctim);
+    };
+
+    const std::string old_name = name;
+    if(other){
+        from.children.value()[old_name] = target;
+        to.children.value()[newname] = ino;
+        relocate(*other, parent, old_name.c_str());
+    }
+    else{
+        from.children.value().erase(old_name);
+        to.children.value()[newname] = ino;
+    }
+    relocate(ent, newparent, newname);
+
+    mark_dirty(from);
+    mark_dirty(to);
+    mark_dirty(ent);
+    if(other){
+        mark_dirty(*other);
+    }
+    // Moving between directories touches more than one partition, paging one of them out on its own could
+    // leave the entry in both or neither on disk
+    if(parent != newparent){
+        linked_partitions.insert(parent);
+        linked_partitions.insert(newparent);
+        if(ent.type == sealfs_ino_t::DIR){
+            linked_partitions.insert(ino);
+        }
+        if(other && other->type == sealfs_ino_t::DIR){
+            linked_partitions.insert(target);
+        }
+    }
+
+    logger->info("Renamed {} ({}) in {} to {} in {}{}", old_name, ino, parent, newname, newparent, other ? ", exchanged" : "");
+    return 0;
+}
 
-const std::optional<std::reference_wrapper<std::unordered_map<std::string, fuse_ino_t>>> SealFSData::get_children(fuse_ino_t node){
+const std::optional<std::reference_wrapper<children_map>> SealFSData::get_children(fuse_ino_t node){
     auto inode_entry = lookup_entry(node);
     if(!inode_entry){
         return std::nullopt;
@@ -309,12 +1478,16 @@ fuse_ino_t SealFSData::lookup(fuse_ino_t parent, const char* name){
         else return INVALID_INODE;
     }
 
+    if(parent == ROOT_INODE && strcmp(name, SNAPSHOTS_DIR_NAME) == 0){
+        return SNAPSHOTS_DIR_INO;
+    }
+
     auto children = get_children(parent);
     if(!children.has_value()){
         logger->error("Inode {} has no children", parent);
         return INVALID_INODE;
     }
-    auto unwrapped_children = children.value().get();
+    const auto& unwrapped_children = children.value().get();
     auto it = unwrapped_children.find(name);
     if(it == unwrapped_children.end()){
         logger->error("Could not find child with name {} under inode {}", name, parent);
@@ -337,23 +1510,57 @@ const std::optional<std::reference_wrapper<inode_entry>> SealFSData::lookup_entr
 const std::optional<std::reference_wrapper<inode_entry>> SealFSData::lookup_entry(fuse_ino_t cur_ino){
     logger->info("[lookup_entry] cur_ino: {}", cur_ino);
 
+    if(is_snapshot_ino(cur_ino)){
+        return lookup_snapshot_entry(cur_ino);
+    }
+
+    auto it = page_in(cur_ino);
+    if(it == inodes.end()){
+        return std::nullopt;
+    }
+
+    if(it->second.is_lazy_clone()){
+        materialize_clone(cur_ino);
+        it = inodes.find(cur_ino);
+    }
+
+    auto pit = partitions.find(partition_of(it->second));
+    if(pit != partitions.end()){
+        pit->second.referenced = true;
+    }
+    return it->second;
+}
+
+std::unordered_map<fuse_ino_t, inode_entry>::iterator SealFSData::page_in(fuse_ino_t cur_ino){
     auto it = inodes.find(cur_ino);
     if(it == inodes.end()){
-        logger->error("Failed to find inode {}", cur_ino);
+        // Only directories can be paged out on their own, files come back with their parent's partition
+        SEALFS_TRACE1(partition__load__start, cur_ino);
+        const bool loaded = load_partition(cur_ino);
+        SEALFS_TRACE2(partition__load__done, cur_ino, loaded);
+        if(!loaded || (it = inodes.find(cur_ino)) == inodes.end()){
+            logger->error("Failed to find inode {}", cur_ino);
+        }
+    }
+    return it;
+}
+
+const std::optional<std::reference_wrapper<inode_entry>> SealFSData::lookup_resident_entry(fuse_ino_t cur_ino){
+    auto& table = is_snapshot_ino(cur_ino) ? snapshot_inodes : inodes;
+    auto it = table.find(cur_ino);
+    if(it == table.end()){
         return std::nullopt;
     }
     return it->second;
 }
 
-// TODO: Accept uid, gid
 // Return nullopt iff parent has a child with same name already
-std::optional<std::reference_wrapper<inode_entry>> SealFSData::create_inode_entry(fuse_ino_t parent, const char* name, sealfs_ino_t type, mode_t mode){
+std::optional<std::reference_wrapper<inode_entry>> SealFSData::create_inode_entry(fuse_ino_t parent, const char* name, sealfs_ino_t type, mode_t mode, uid_t uid, gid_t gid){
 
-    logger->info("[create_inode_entry] parent: {} name: {} type: {} mode: {}", parent, name, static_cast<int>(type), mode);
+    logger->info("[create_inode_entry] parent: {} name: {} type: {} mode: {} uid: {} gid: {}", parent, name, static_cast<int>(type), mode, uid, gid);
 
     mode_t mask;
-    const auto cur_ino = next_ino++;
-    auto& cur_entry = inodes[cur_ino];
+    children_map* parent_children = nullptr;
 
     if(parent != INVALID_INODE){
         auto children = get_children(parent);
@@ -363,8 +1570,16 @@ std::optional<std::reference_wrapper<inode_entry>> SealFSData::create_inode_entr
             return std::nullopt;
         }
 
-        auto& cref = children.value().get();
-        cref[name] = cur_ino;
+        parent_children = &children.value().get();
+    }
+
+    const auto cur_ino = next_ino++;
+    auto& cur_entry = inodes[cur_ino];
+    super_dirty = true;
+
+    if(parent_children){
+        (*parent_children)[name] = cur_ino;
+        register_partition(parent, true);
     }
 
     cur_entry.ino = cur_entry.st.st_ino = cur_ino;
@@ -375,15 +1590,26 @@ std::optional<std::reference_wrapper<inode_entry>> SealFSData::create_inode_entr
         cur_entry.st.st_size = 0;
         cur_entry.st.st_nlink = 1;
         cur_entry.children = std::nullopt;
-        cur_entry.data_id = next_data_id++;
         mask = S_IFREG;
 
-        auto filepath = get_data_ent_path(cur_entry.data_id);
-        int fd = open(filepath.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
-        if(fd == -1){
-            log_error("Failed to touch {}.data file on inode_entry creation", cur_ino);
+        // Small files start out inline and only get a data file once they outgrow inline_threshold
+        if(config.inline_threshold > 0){
+            cur_entry.data_id = INLINE_DATA_ID;
+        }
+        else{
+            cur_entry.data_id = next_data_id++;
+            cur_entry.data_gen = cur_gen;
+
+            auto filepath = get_data_ent_path(cur_entry.data_id);
+            int fd = traced_open(filepath.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+            if(fd == -1){
+                log_error("Failed to touch {}.data file on inode_entry creation", cur_ino);
+            }
+            else close(fd);
+            data_dir_dirty = true;
+            checksums->create(cur_entry.data_id);
+            mark_data_dirty(cur_entry.data_id);
         }
-        else close(fd);
     }
     else{
         cur_entry.st.st_size = 4096;
@@ -394,17 +1620,25 @@ std::optional<std::reference_wrapper<inode_entry>> SealFSData::create_inode_entr
 
     cur_entry.name = strdup(name);
 
-    time_t now = time(NULL);
-    cur_entry.st.st_atime = now;
-    cur_entry.st.st_mtime = now;
-    cur_entry.st.st_ctime = now;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    cur_entry.st.st_atim = now;
+    cur_entry.st.st_mtim = now;
+    cur_entry.st.st_ctim = now;
 
     // restrict to permission bits only
     cur_entry.st.st_mode = mask | (mode & 0777);
+    cur_entry.st.st_uid = uid;
+    cur_entry.st.st_gid = gid;
+
+    if(type == sealfs_ino_t::DIR){
+        cur_entry.usage = {0, 0, 1};
+    }
+    mark_dirty(cur_entry);
+    account(parent, {0, 0, 1});
 
     logger->info("Successfully created inode {} with name {} and parent {}", cur_ino, name, parent);
 
-    // what to do about uid/gid?
     return cur_entry;
 
 }
@@ -414,8 +1648,6 @@ std::optional<std::reference_wrapper<inode_entry>> SealFSData::cow_inode_entry(f
     logger->info("[cow_inode_entry] parent: {} name: {} mode: {} to_copy: {}", parent, name, mode, to_copy);
 
     mode_t mask;
-    const auto cur_ino = next_ino++;
-    auto& cur_entry = inodes[cur_ino];
 
     auto children = get_children(parent);
 
@@ -424,20 +1656,38 @@ std::optional<std::reference_wrapper<inode_entry>> SealFSData::cow_inode_entry(f
         return std::nullopt;
     }
 
-    auto& cref = children.value().get();
-    cref[name] = cur_ino;
-
-    const auto& copy_entry = inodes[to_copy];
+    const auto copy_ent = lookup_entry(to_copy);
 
-    if(copy_entry.type != sealfs_ino_t::FILE){
+    if(!copy_ent || copy_ent.value().get().type != sealfs_ino_t::FILE){
         logger->error("ino to_copy {} passed in is not file", to_copy);
         return std::nullopt;
     }
+    const auto& copy_entry = copy_ent.value().get();
+
+    const auto cur_ino = next_ino++;
+    auto& cur_entry = inodes[cur_ino];
+    super_dirty = true;
+
+    auto& cref = children.value().get();
+    cref[name] = cur_ino;
 
     cur_entry.ino = cur_entry.st.st_ino = cur_ino;
     cur_entry.parent = parent;
     cur_entry.type = sealfs_ino_t::FILE;
     cur_entry.data_id = copy_entry.data_id;
+    cur_entry.inline_data = copy_entry.inline_data;
+    cur_entry.data_gen = copy_entry.data_gen;
+    if(!copy_entry.is_inline()){
+        // Both files now reference the object, whichever is written first gets its own copy
+        auto [sharers, inserted] = data_sharers.try_emplace(copy_entry.data_id);
+        if(inserted){
+            sharers->second.push_back(to_copy);
+            account(copy_entry.parent, {-copy_entry.st.st_size, copy_entry.st.st_size, 0});
+            shared_sizes[copy_entry.data_id] = copy_entry.st.st_size;
+            shared_object_bytes += copy_entry.st.st_size;
+        }
+        sharers->second.push_back(cur_ino);
+    }
 
     cur_entry.st.st_size = copy_entry.st.st_size;
     cur_entry.st.st_nlink = 1;
@@ -446,14 +1696,18 @@ std::optional<std::reference_wrapper<inode_entry>> SealFSData::cow_inode_entry(f
 
     cur_entry.name = strdup(name);
 
-    time_t now = time(NULL);
-    cur_entry.st.st_atime = now;
-    cur_entry.st.st_mtime = copy_entry.st.st_mtime;
-    cur_entry.st.st_ctime = now;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    cur_entry.st.st_atim = now;
+    cur_entry.st.st_mtim = copy_entry.st.st_mtim;
+    cur_entry.st.st_ctim = now;
 
     // restrict to permission bits only
     cur_entry.st.st_mode = mask | (mode & 0777);
 
+    mark_dirty(cur_entry);
+    account(parent, file_usage(cur_entry));
+
     logger->info("Successfully copy-on-write of inode {} with name {} and parent {} copying to_copy {}", cur_ino, name, parent, to_copy);
 
     // what to do about uid/gid?
@@ -461,14 +1715,518 @@ std::optional<std::reference_wrapper<inode_entry>> SealFSData::cow_inode_entry(f
 }
 
 
+void SealFSData::release_data(const inode_entry& ent){
+    if(is_shared(ent.data_id)){
+        drop_sharer(ent.data_id, ent.ino);
+        logger->info("Dropped ino {} from the sharers of data object {}", ent.ino, ent.data_id);
+        return;
+    }
+    retire_data(ent.data_id, ent.data_gen);
+}
+
+void SealFSData::retire_data(uint32_t data_id, uint64_t birth){
+    if(snapshot_needs(birth)){
+        retired_data.push_back({data_id, birth, cur_gen});
+        super_dirty = true;
+        logger->info("Data object {} is now only referenced by snapshots", data_id);
+        return;
+    }
+
+    // Deleted by the next commit, once the metadata that still references it on disk is gone
+    pending_data_removals.push_back(data_id);
+    dirty_data.erase(data_id);
+    logger->info("Queued data object {} for removal", data_id);
+}
+
+void SealFSData::drop_sharer(uint32_t data_id, fuse_ino_t ino){
+    auto it = data_sharers.find(data_id);
+    if(it == data_sharers.end()){
+        return;
+    }
+    super_dirty = true;
+
+    // A file that isn't listed is the one the INVALID_INODE placeholder stands in for
+    auto& sharers = it->second;
+    auto pos = std::find(sharers.begin(), sharers.end(), ino);
+    if(pos == sharers.end()){
+        pos = std::find(sharers.begin(), sharers.end(), INVALID_INODE);
+    }
+    if(pos != sharers.end()){
+        // The placeholder's owner counted the object in usage_t::bytes, once it's gone the sharers do
+        if(*pos == INVALID_INODE){
+            shared_object_bytes += shared_sizes[data_id];
+        }
+        sharers.erase(pos);
+    }
+    if(sharers.size() >= 2){
+        return;
+    }
+
+    const std::vector<fuse_ino_t> last = std::move(sharers);
+    data_sharers.erase(it);
+    if(std::find(last.begin(), last.end(), INVALID_INODE) == last.end()){
+        shared_object_bytes -= shared_sizes[data_id];
+    }
+    shared_sizes.erase(data_id);
+    for(fuse_ino_t owner : last){
+        if(owner == INVALID_INODE){
+            continue;
+        }
+        auto ent = lookup_entry(owner);
+        if(ent){
+            const off_t size = ent.value().get().st.st_size;
+            account(ent.value().get().parent, {size, -size, 0});
+        }
+    }
+}
+
+bool SealFSData::counts_as_shared(const inode_entry& ent) const{
+    if(ent.is_inline()){
+        return false;
+    }
+    auto it = data_sharers.find(ent.data_id);
+    return it != data_sharers.end() && std::find(it->second.begin(), it->second.end(), ent.ino) != it->second.end();
+}
+
+usage_t SealFSData::file_usage(const inode_entry& ent) const{
+    if(counts_as_shared(ent)){
+        return {0, ent.st.st_size, 1};
+    }
+    return {ent.st.st_size, 0, 1};
+}
+
+void SealFSData::account(fuse_ino_t dir, const usage_t& delta){
+    for(fuse_ino_t cur = dir; cur != INVALID_INODE;){
+        auto ent = lookup_entry(cur);
+        if(!ent){
+            logger->error("Lost track of usage at ino {}, missing from the tree", cur);
+            return;
+        }
+        auto& unwrapped_ent = ent.value().get();
+        unwrapped_ent.usage += delta;
+        usage_deltas[cur] += delta;
+        cur = unwrapped_ent.parent;
+    }
+    super_dirty = true;
+}
+
+void SealFSData::fold_usage_deltas(bool all){
+    for(auto it = usage_deltas.begin(); it != usage_deltas.end();){
+        const auto ent = all ? lookup_entry(it->first) : lookup_resident_entry(it->first);
+        if(!ent && !all){
+            ++it;
+            continue;
+        }
+        // Dropped first, so the partition goes out with its usage as it is in memory
+        it = usage_deltas.erase(it);
+        if(ent){
+            mark_dirty(ent.value().get());
+        }
+        super_dirty = true;
+    }
+}
+
+void SealFSData::set_size(inode_entry& ent, off_t size){
+    if(size == ent.st.st_size){
+        return;
+    }
+    const off_t delta = size - ent.st.st_size;
+    if(counts_as_shared(ent)){
+        account(ent.parent, {0, delta, 0});
+    }
+    else{
+        account(ent.parent, {delta, 0, 0});
+    }
+    ent.st.st_size = size;
+    mark_dirty(ent);
+}
+
+void SealFSData::rebuild_accounting(){
+    logger->warn("Rebuilding directory usage, this pages in the whole tree once");
+
+    // Pre-order walk, so in reverse every directory comes after all of its descendants
+    std::vector<fuse_ino_t> order;
+    std::vector<fuse_ino_t> stack{ROOT_INODE};
+    std::unordered_map<uint32_t, std::vector<fuse_ino_t>> holders;
+    while(!stack.empty()){
+        const fuse_ino_t dir = stack.back();
+        stack.pop_back();
+        order.push_back(dir);
+
+        auto children = get_children(dir);
+        if(!children){
+            continue;
+        }
+        for(const auto& [name, child] : children.value().get()){
+            auto ent = lookup_entry(child);
+            if(!ent){
+                continue;
+            }
+            const auto& child_ent = ent.value().get();
+            if(child_ent.type == sealfs_ino_t::DIR){
+                stack.push_back(child);
+            }
+            else if(!child_ent.is_inline()){
+                holders[child_ent.data_id].push_back(child);
+            }
+        }
+    }
+
+    data_sharers.clear();
+    shared_sizes.clear();
+    usage_deltas.clear();
+    for(auto& [data_id, files] : holders){
+        if(files.size() >= 2){
+            data_sharers.emplace(data_id, std::move(files));
+        }
+    }
+    recount_shared();
+
+    for(auto dir_it = order.rbegin(); dir_it != order.rend(); ++dir_it){
+        auto& dir_ent = lookup_entry(*dir_it).value().get();
+        usage_t usage{0, 0, 1};
+        for(const auto& [name, child] : dir_ent.children.value()){
+            auto ent = lookup_entry(child);
+            if(!ent){
+                continue;
+            }
+            const auto& child_ent = ent.value().get();
+            usage += child_ent.type == sealfs_ino_t::DIR ? child_ent.usage : file_usage(child_ent);
+        }
+        dir_ent.usage = usage;
+        mark_dirty(dir_ent);
+    }
+    super_dirty = true;
+}
+
+void SealFSData::recount_shared(){
+    std::erase_if(shared_sizes, [&](const auto& size){ return !data_sharers.contains(size.first); });
+    shared_object_bytes = 0;
+    for(const auto& [data_id, files] : data_sharers){
+        auto size = shared_sizes.find(data_id);
+        if(size == shared_sizes.end()){
+            int64_t found = 0;
+            for(fuse_ino_t file : files){
+                if(file == INVALID_INODE){
+                    continue;
+                }
+                if(const auto ent = lookup_entry(file)){
+                    found = ent.value().get().st.st_size;
+                    break;
+                }
+            }
+            size = shared_sizes.emplace(data_id, found).first;
+            super_dirty = true;
+        }
+        if(std::find(files.begin(), files.end(), INVALID_INODE) == files.end()){
+            shared_object_bytes += size->second;
+        }
+    }
+}
+
+void SealFSData::detach_data(inode_entry& ent){
+    if(is_shared(ent.data_id)){
+        if(counts_as_shared(ent)){
+            account(ent.parent, {ent.st.st_size, -ent.st.st_size, 0});
+        }
+        drop_sharer(ent.data_id, ent.ino);
+    }
+    else{
+        retire_data(ent.data_id, ent.data_gen);
+    }
+}
+
+bool SealFSData::begin_data_write(std::unique_lock<std::mutex>& guard){
+    if(freezing_data){
+        data_writes_cv.wait(guard, [&]{ return !freezing_data; });
+        return false;
+    }
+    ++data_writes;
+    return true;
+}
+
+void SealFSData::end_data_write(){
+    if(--data_writes == 0 && freezing_data){
+        data_writes_cv.notify_all();
+    }
+}
+
+void SealFSData::object_moved(fuse_ino_t ino){
+    auto it = inode_io.find(ino);
+    if(it == inode_io.end()){
+        return;
+    }
+    if(auto io = it->second.lock()){
+        ++io->object_gen;
+    }
+}
+
+int SealFSData::break_cow(fuse_ino_t ino, std::unique_lock<std::mutex>& guard, std::optional<off_t> size){
+    auto io = get_inode_io(ino);
+    int res = 0;
+    for(;;){
+        const auto cur_ent = lookup_entry(ino);
+        if(!cur_ent){
+            res = ENOENT;
+            break;
+        }
+        auto& ent = cur_ent.value().get();
+        if(!needs_cow(ent)){
+            break;
+        }
+        // Another writer of the file is already copying it
+        if(io->breaking){
+            cow_cv.wait(guard);
+            continue;
+        }
+
+        const uint32_t src_id = ent.data_id;
+        const uint32_t data_id = next_data_id++;
+        super_dirty = true;
+        const auto src_path = get_data_ent_path(src_id);
+        const auto dst_path = get_data_ent_path(data_id);
+
+        // Both stay on their tier until put_object
+        int src = open_object(src_id, O_RDONLY);
+        if(src == -1){
+            logger->error("Failed to open {} to break CoW of ino {}", src_path.string(), ino);
+            res = EIO;
+            break;
+        }
+        int dst = open_object(data_id, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+        if(dst == -1){
+            logger->error("Failed to create {} to break CoW of ino {}", dst_path.string(), ino);
+            put_object(src_id);
+            close(src);
+            res = EIO;
+            break;
+        }
+
+        // Nothing writes a shared object, so it can be copied without the state lock. Only writers of this file
+        // wait on the copy, anything else goes on meanwhile.
+        io->breaking = true;
+        guard.unlock();
+
+        // Reflink where the backing filesystem supports it, otherwise an in-kernel copy. When truncating, only the
+        // extents below the new size are cloned (whole filesystem blocks, as the ioctl wants them).
+        bool ok;
+        struct stat src_st;
+        if(size && fstat(src, &src_st) == 0){
+            const off_t blksize = std::max<off_t>(src_st.st_blksize, 1);
+            const off_t len = (*size + blksize - 1) / blksize * blksize;
+            struct file_clone_range range{src, 0, static_cast<__u64>(len >= src_st.st_size ? 0 : len), 0};
+            ok = ioctl(dst, FICLONERANGE, &range) == 0;
+        }
+        else{
+            ok = ioctl(dst, FICLONE, src) == 0;
+        }
+        if(!ok){
+            ok = true;
+            off_t left = size ? *size : std::numeric_limits<off_t>::max();
+            ssize_t bytes = 0;
+            while(left > 0 && (bytes = copy_file_range(src, nullptr, dst, nullptr, std::min<off_t>(left, 1 << 30), 0)) > 0){
+                left -= bytes;
+            }
+            if(bytes == -1){
+                logger->error("Failed to copy {} to {}: {}", src_path.string(), dst_path.string(), strerror(errno));
+                ok = false;
+            }
+        }
+        if(ok && size && ftruncate(dst, *size) == -1){
+            logger->error("Failed to truncate {}: {}", dst_path.string(), strerror(errno));
+            ok = false;
+        }
+        close(src);
+        close(dst);
+
+        guard.lock();
+        put_object(src_id);
+        put_object(data_id);
+        io->breaking = false;
+        cow_cv.notify_all();
+
+        // The file may have been removed, or let go of the object some other way, while the lock was dropped
+        const auto after = ok ? lookup_entry(ino) : std::nullopt;
+        if(!after || after.value().get().data_id != src_id){
+            std::filesystem::remove(dst_path);
+            if(!ok){
+                res = EIO;
+                break;
+            }
+            continue;
+        }
+        auto& cur = after.value().get();
+
+        // Same bytes, same checksums
+        if(auto sums = checksums->create(data_id, src_id); sums && size){
+            sums->begin_write();
+            sums->end_truncate(*size);
+        }
+        logger->info("Broke CoW of ino {}, data object {} -> {}", ino, src_id, data_id);
+        detach_data(cur);
+        cur.data_id = data_id;
+        cur.data_gen = cur_gen;
+        object_moved(ino);
+        data_dir_dirty = true;
+        mark_data_dirty(data_id);
+        mark_dirty(cur);
+        break;
+    }
+    put_inode_io(ino, io);
+    return res;
+}
+
+int SealFSData::truncate(fuse_ino_t ino, std::unique_lock<std::mutex>& guard, off_t size){
+    constexpr off_t END = std::numeric_limits<off_t>::max();
+    std::shared_ptr<InodeIO> io;
+    off_t held = -1; // Start of the range of io->ranges this holds up to END, -1 if none
+    int res = 0;
+    for(;;){
+        const auto cur_ent = lookup_entry(ino);
+        if(!cur_ent){
+            res = ENOENT;
+            break;
+        }
+        auto& ent = cur_ent.value().get();
+
+        if(ent.is_inline()){
+            if(static_cast<size_t>(size) <= config.inline_threshold){
+                ent.inline_data.resize(size, '\0');
+                set_size(ent, size);
+                break;
+            }
+            if(!spill_inline(ent)){
+                res = EIO;
+                break;
+            }
+        }
+
+        if(needs_cow(ent)){
+            if(size == 0){
+                // Nothing to keep, so nothing to copy: the file just lets go of the object and goes back to being an
+                // empty inline file, which spills to a fresh object on its first write past inline_threshold
+                logger->info("Truncated shared ino {} to 0, dropping data object {}", ent.ino, ent.data_id);
+                detach_data(ent);
+                ent.data_id = INLINE_DATA_ID;
+                ent.data_gen = 0;
+                object_moved(ino);
+                super_dirty = true;
+                set_size(ent, 0);
+                mark_dirty(ent);
+                break;
+            }
+            // The copy only keeps what is below size, what is left is then the in-place case
+            res = break_cow(ino, guard, size);
+            if(res){
+                break;
+            }
+            continue;
+        }
+
+        // The blocks past the new end are off limits to writers (checksums) and readers of mappings (SIGBUS)
+        // meanwhile. Writers in flight there are waited out without the state lock, everything else would stall
+        // behind them too, and the file is looked at afresh once it is retaken.
+        const off_t from = block_floor(std::min(size, ent.st.st_size));
+        if(!io){
+            io = get_inode_io(ino);
+        }
+        if(held > from){
+            io->ranges.unlock(held, END);
+            held = -1;
+        }
+        if(held == -1){
+            if(!io->ranges.try_lock(from, END)){
+                guard.unlock();
+                io->ranges.lock(from, END);
+                guard.lock();
+                held = from;
+                continue;
+            }
+            held = from;
+        }
+
+        const auto path = get_data_ent_path(ent.data_id);
+        auto sums = checksums->get(ent.data_id);
+        if(sums){
+            sums->begin_write();
+        }
+        mmap_cache.invalidate(ent.data_id);
+        if(::truncate(path.c_str(), size) == -1){
+            res = errno;
+            if(sums){
+                sums->end_unchanged();
+            }
+            logger->error("Failed to truncate {} to {}: {}", path.string(), size, strerror(res));
+            break;
+        }
+        if(sums){
+            sums->end_truncate(size);
+        }
+        mark_data_dirty(ent.data_id);
+        set_size(ent, size);
+        break;
+    }
+
+    if(held != -1){
+        io->ranges.unlock(held, END);
+    }
+    if(io){
+        put_inode_io(ino, io);
+    }
+    return res;
+}
+
 // TODO: Maybe add check that it is not directory?
 std::filesystem::path SealFSData::get_data_ent_path(uint32_t data_id){
-    std::string filename = std::to_string(data_id) + ".data";
-    return get_data_path() / filename;
+    return tiers->path(data_id);
+}
+
+
+bool SealFSData::spill_inline(inode_entry& ent){
+    if(!ent.is_inline()){
+        return true;
+    }
+
+    const uint32_t data_id = next_data_id++;
+    auto filepath = get_data_ent_path(data_id);
+    int fd = traced_open(filepath.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if(fd == -1){
+        logger->error("Failed to create {} while spilling inline ino {}", filepath.string(), ent.ino);
+        return false;
+    }
+
+    size_t written = 0;
+    while(written < ent.inline_data.size()){
+        ssize_t bytes = traced_pwrite(fd, ent.inline_data.data() + written, ent.inline_data.size() - written, written);
+        if(bytes == -1){
+            logger->error("Failed to write {} while spilling inline ino {}", filepath.string(), ent.ino);
+            close(fd);
+            std::filesystem::remove(filepath);
+            return false;
+        }
+        written += bytes;
+    }
+    close(fd);
+
+    if(auto sums = checksums->create(data_id)){
+        sums->begin_write();
+        sums->end_write(0, ent.inline_data.data(), ent.inline_data.size());
+    }
+
+    ent.data_id = data_id;
+    ent.data_gen = cur_gen;
+    std::string().swap(ent.inline_data);
+    super_dirty = true;
+    data_dir_dirty = true;
+    mark_data_dirty(data_id);
+    mark_dirty(ent);
+
+    logger->info("Spilled inline ino {} to data_id {}", ent.ino, data_id);
+    return true;
 }
 
 
-DirBuf::DirBuf(fuse_req_t req): req(req), p(nullptr), size(0) {};
+DirBuf::DirBuf(fuse_req_t req): req(req), buf(BufferPool::get(4096)), size(0) {};
 
 // Given a possibly existing buffer b of fuse_direntrys, pack in this new one with ino = ino, name = name
 void DirBuf::add_entry(SealFS::SealFSData* fs, const char* name, fuse_ino_t ino){
@@ -476,33 +2234,34 @@ void DirBuf::add_entry(SealFS::SealFSData* fs, const char* name, fuse_ino_t ino)
     size_t oldsize = size;
     // Figure out size of fuse_direntry required to pack. Note that only a fixed number of bits from stat are used, so we don't actually need to pass in the stat struct to get the correct size (name is the only entry of variable length)
     size += fuse_add_direntry(req, NULL, 0, name, NULL, 0);
-    p = (char*) realloc(p, size);
+    BufferPool::grow(buf, size, oldsize);
     struct stat st;
     memset(&st, 0, sizeof(st));
 
     if(ino != INVALID_INODE){
-        const auto& ent = fs->lookup_entry(ino);
-        // TODO: add logging functionality directly into fs
-        if(!ent){
-            throw std::runtime_error("Could not find entry corresponding to ino");
+        // Don't page in whole subdirectories just to list them. Files are always resident alongside their
+        // parent, so anything missing is a directory and ino + type is all a direntry needs.
+        const auto& ent = fs->lookup_resident_entry(ino);
+        if(ent){
+            memcpy(&st, &ent.value().get().st, sizeof(struct stat));
+        }
+        else{
+            st.st_ino = ino;
+            st.st_mode = S_IFDIR;
         }
-        memcpy(&st, &ent.value().get().st, sizeof(struct stat));
     }
 
     // Actually add the fuse_direntry corresponding to this (name, ino) to buffer b
-    fuse_add_direntry(req, p + oldsize, size - oldsize, name, &st, size);
+    fuse_add_direntry(req, buf.data() + oldsize, size - oldsize, name, &st, size);
 }
 
 // Add buffer b to reply, respect offset (off) and maxsize for kernel pagination
 int DirBuf::reply(off_t off, size_t maxsize){
-    if(off < size){
-        return fuse_reply_buf(req, p + off, std::min(size - off, maxsize));
+    if(off >= 0 && static_cast<size_t>(off) < size){
+        return fuse_reply_buf(req, buf.data() + off, std::min(size - static_cast<size_t>(off), maxsize));
     }
     else{
         return fuse_reply_buf(req, NULL, 0);
     }
 }
 
-DirBuf::~DirBuf(){
-    free(p);
-}
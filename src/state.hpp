@@ -1,6 +1,13 @@
 #pragma once
 
 #include "common.hpp"
+#include "fsck.hpp"
+#include "range_lock.hpp"
+#include "mmap_cache.hpp"
+#include "readahead.hpp"
+#include "buffer_pool.hpp"
+#include "checksum.hpp"
+#include "trace.hpp"
 
 #include <sys/stat.h>
 #include <stdlib.h>
@@ -11,10 +18,19 @@
 #include <limits>
 #include <vector>
 #include <string>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <thread>
+#include <stop_token>
 #include <unordered_map>
+#include <unordered_set>
 
 #include <filesystem>
-#include <regex>
+#include <charconv>
+#include <string_view>
 #include <iostream>
 #include <fstream>
 
@@ -27,6 +43,8 @@ using json = nlohmann::json;
 
 namespace SealFS{
 
+class Dispatcher;
+
 static inline const std::filesystem::path expand_user_path(const std::string& path){
     if(!path.empty() && path[0] == '~'){
         const char* home = std::getenv("HOME");
@@ -37,13 +55,116 @@ static inline const std::filesystem::path expand_user_path(const std::string& pa
     return std::filesystem::path(path);
 }
 
+// Unless -o root says otherwise
 inline const std::filesystem::path& get_default_persistence_root() {
-    // TODO: For now, make configurable, etc. later
     static const std::filesystem::path root = expand_user_path("~/sealfs");
     return root;
 }
 
+// Parse "<decimal id><suffix>" filenames (e.g. "12.data", "7.json"), nullopt for anything else
+template<typename T>
+inline std::optional<T> parse_id_filename(std::string_view name, std::string_view suffix){
+    if(name.size() <= suffix.size() || !name.ends_with(suffix)){
+        return std::nullopt;
+    }
+    std::string_view digits = name.substr(0, name.size() - suffix.size());
+    T id{};
+    auto [end, ec] = std::from_chars(digits.data(), digits.data() + digits.size(), id);
+    if(ec != std::errc() || end != digits.data() + digits.size() || digits.front() < '0' || digits.front() > '9'){
+        return std::nullopt;
+    }
+    return id;
+}
+
 static constexpr fuse_ino_t INVALID_INODE = static_cast<fuse_ino_t>(-1);
+static constexpr fuse_ino_t ROOT_INODE = FUSE_ROOT_ID;
+
+// data_id of files whose contents live in inode_entry::inline_data instead of a data/N.data file
+static constexpr uint32_t INLINE_DATA_ID = 0;
+
+// Snapshot views live in their own inode number space: top bit set, snapshot id above bit 40, original ino below.
+// SNAPSHOTS_DIR_INO is /.snapshots itself. Live inos have to stay below 2^40 for this to be unambiguous.
+static constexpr fuse_ino_t SNAPSHOT_INO_BIT = fuse_ino_t(1) << 63;
+static constexpr int SNAPSHOT_ID_SHIFT = 40;
+static constexpr fuse_ino_t SNAPSHOTS_DIR_INO = SNAPSHOT_INO_BIT;
+static constexpr const char* SNAPSHOTS_DIR_NAME = ".snapshots";
+
+inline bool is_snapshot_ino(fuse_ino_t ino){ return ino != INVALID_INODE && (ino & SNAPSHOT_INO_BIT); }
+inline fuse_ino_t snapshot_view_ino(uint32_t snap_id, fuse_ino_t ino){ return SNAPSHOT_INO_BIT | (fuse_ino_t(snap_id) << SNAPSHOT_ID_SHIFT) | ino; }
+inline uint32_t snapshot_id_of(fuse_ino_t view){ return static_cast<uint32_t>((view & ~SNAPSHOT_INO_BIT) >> SNAPSHOT_ID_SHIFT); }
+inline fuse_ino_t snapshot_orig_ino(fuse_ino_t view){ return view & ((fuse_ino_t(1) << SNAPSHOT_ID_SHIFT) - 1); }
+
+// Whether uid:gid gets the R_OK/W_OK/X_OK bits in mask on a file with st, going by its mode bits. Like the checks
+// in sealfs_open, only the primary group counts and root gets everything.
+inline bool may_access(const struct stat& st, uid_t uid, gid_t gid, int mask){
+    if(uid == 0){
+        return true;
+    }
+    const mode_t want = static_cast<mode_t>(mask);
+    const mode_t bits = uid == st.st_uid ? st.st_mode >> 6 : gid == st.st_gid ? st.st_mode >> 3 : st.st_mode;
+    return (bits & want) == want;
+}
+
+// Generation of a partition that was never written out
+static constexpr uint64_t NO_GEN = std::numeric_limits<uint64_t>::max();
+
+enum fsck_mode_t { FSCK_OFF = 0, FSCK_SYNC = 1, FSCK_ASYNC = 2 };
+// noatime, relatime (atime only moves if it was behind mtime/ctime or a day old) and strictatime
+enum atime_mode_t { ATIME_OFF = 0, ATIME_RELATIVE = 1, ATIME_STRICT = 2 };
+
+// Like the kernel's dirtytime_expire_seconds: lazytime timestamps get written out after this long at the latest
+static constexpr time_t LAZYTIME_EXPIRE = 12 * 60 * 60;
+
+// Mount-time tunables, filled in from -o options in main.cpp
+struct SealFSConfig{
+    // Files up to this many bytes are kept inline in their inode_entry (0 disables inlining)
+    size_t inline_threshold = 4096;
+    // Rough budget for resident metadata, cold directories are paged out past this
+    size_t meta_cache_mb = 1024;
+    // Persistence root check at mount: FSCK_OFF, FSCK_SYNC (before serving) or FSCK_ASYNC (in the background)
+    int fsck_mode = FSCK_ASYNC;
+    unsigned fsck_threads = 0; // 0 = one per core
+    // Background checkpoint every this many seconds (0 disables, leaving persistence to fsync and unmount)
+    unsigned checkpoint_interval = 5;
+    // ... or as soon as this many directories are dirty
+    size_t checkpoint_dirty = 4096;
+    // Budget for mmap'd data objects served to readers without a pread (0 disables)
+    size_t mmap_cache_mb = 0;
+    // Largest window for prefetching sequentially read files (0 disables), also caps the kernel's max_readahead
+    size_t readahead_kb = 8192;
+    // Let the kernel serve reads of files opened read-only from data files directly (needs kernel FUSE passthrough
+    // and CAP_SYS_ADMIN)
+    int passthrough = 1;
+    // Request workers, 0 = one per CPU the daemon may run on, each pinned to its CPU unless pin_workers is 0
+    unsigned workers = 0;
+    int pin_workers = 1;
+    // Serve a read-only compiled image of the tree (see frozen.hpp) instead of the live metadata
+    int frozen = 0;
+    // CRC32C data blocks as they are written and verify them on every read (see checksum.hpp). Reads and writes
+    // then have to go through the daemon, so this turns passthrough off.
+    int checksum = 0;
+    // Background scrub of every data object at most this many MiB/s (0 disables), a pass every scrub_interval seconds
+    size_t scrub_mb = 32;
+    unsigned scrub_interval = 86400;
+    // Persistence root for metadata, journal and hot data objects, best on the fastest device (default ~/sealfs)
+    char* root = nullptr;
+    // Capacity tier for data objects nobody uses (see tier.hpp), linked in as <root>/cold. Later mounts keep using
+    // it without being told again.
+    char* cold_dir = nullptr;
+    // Seconds between migration passes (0 leaves objects wherever they are)
+    unsigned tier_interval = 600;
+    // Objects not opened for this many seconds move to the capacity tier (0 never demotes)
+    unsigned cold_after = 7 * 86400;
+    // ... and come back once opened this many times in a pass, counts from earlier passes halved (0 never promotes)
+    unsigned promote_opens = 4;
+    // MB/s migrations copy at most (0 = unlimited)
+    size_t tier_mb = 64;
+    // When reads update atime, see atime_mode_t
+    int atime_mode = ATIME_RELATIVE;
+    // Keep changes that only touch timestamps in memory until something else dirties the directory, an fsync or
+    // unmount, or LAZYTIME_EXPIRE, instead of writing them out with the next checkpoint
+    int lazytime = 0;
+};
 
 // RAII-style persistence root lock to ensure that a fs is not mounted in multiple places at once
 class SealFSLock{
@@ -64,11 +185,37 @@ public:
 
 enum class sealfs_ino_t { FILE, DIR };
 
+// Hashes names as string_views, so children can be looked up straight from the const char* names FUSE hands over
+// without building a std::string for each
+struct child_name_hash{
+    using is_transparent = void;
+    inline size_t operator()(std::string_view name) const { return std::hash<std::string_view>{}(name); }
+};
+using children_map = std::unordered_map<std::string, fuse_ino_t, child_name_hash, std::equal_to<>>;
+
+// Totals over a directory's subtree, the directory itself included
+struct usage_t{
+    int64_t bytes = 0; // Logical size of files whose data (object or inline) is their own
+    int64_t shared_bytes = 0; // Logical size of files sharing their data object with CoW copies
+    int64_t inodes = 0;
+
+    inline usage_t& operator+=(const usage_t& o){
+        bytes += o.bytes;
+        shared_bytes += o.shared_bytes;
+        inodes += o.inodes;
+        return *this;
+    }
+    inline usage_t operator-() const { return {-bytes, -shared_bytes, -inodes}; }
+};
+
+void to_json(json& j, const usage_t& usage);
+void from_json(const json& j, usage_t& usage);
+
 struct inode_entry{
     // TODO: Probably not even needed separately if its stored in stat already...
     fuse_ino_t ino;
     fuse_ino_t parent;
-    uint32_t data_id; // Id corresponding to data being added
+    uint32_t data_id; // Id corresponding to data being added, INLINE_DATA_ID if data is stored inline
     // TODO: Maybe remove
     std::string name;
 
@@ -76,14 +223,146 @@ struct inode_entry{
     sealfs_ino_t type;
     struct stat st;
 
-    std::optional<std::unordered_map<std::string, fuse_ino_t>> children;
+    std::optional<children_map> children;
+
+    // Contents of small files, only meaningful while is_inline()
+    std::string inline_data;
+
+    // Number of kernel references handed out via entry replies and not yet forgotten, not persisted
+    uint64_t nlookup = 0;
+
+    // Directories only, kept up to date incrementally by SealFSData::account
+    usage_t usage;
+
+    // Generation the data object was created in, snapshots taken since then share it
+    uint64_t data_gen = 0;
+
+    // Directories cloned with clone_dir whose contents haven't been copied yet: they are clone_src as seen by
+    // snapshot clone_snap, filled in the first time the directory is looked up
+    fuse_ino_t clone_src = INVALID_INODE;
+    uint32_t clone_snap = 0;
+
+    // Reads of this file skip checksum verification (user.sealfs.noverify), its checksums are still kept up to date
+    bool noverify = false;
+
+    inline bool is_inline() const { return type == sealfs_ino_t::FILE && data_id == INLINE_DATA_ID; }
+    inline bool is_lazy_clone() const { return clone_src != INVALID_INODE; }
+    // Unlinked while the kernel or an open handle still references it, see SealFSData::remove
+    inline bool is_orphan() const { return type == sealfs_ino_t::FILE && parent == INVALID_INODE; }
 };
 
 void to_json(json& j, const inode_entry& inode);
 void from_json(const json& j, inode_entry& inode);
 
-struct FileHandle{
+// I/O state shared by every open handle of one inode. Data I/O runs outside the state lock, serialized
+// against overlapping ranges only.
+struct InodeIO{
+    RangeLock ranges;
+    std::atomic<unsigned> writers = 0; // Open handles that can write, mappings are only used while this is 0
+
+    // The kernel wants every passthrough handle of an inode on the same backing file and none of them mixed with
+    // page cached handles. Only touched under the state lock.
+    int backing_id = 0; // Registered passthrough backing file, 0 if none
+    uint32_t backing_data_id = INLINE_DATA_ID; // Data object backing_id refers to
+    unsigned backing_refs = 0; // Handles using backing_id
+    unsigned cached_handles = 0; // Handles going through the daemon and the kernel page cache
+    bool breaking = false; // Under the state lock, SealFSData::break_cow is copying the file's data object
+    // Bumped under the state lock whenever the file moves to another data object or back inline, handles opened
+    // before then have to reopen theirs
+    std::atomic<uint64_t> object_gen = 0;
+    // Reads from this (CLOCK_REALTIME) second on may have to move atime, so they take the state lock to check.
+    // Reset to 0 whenever the file changes, see SealFSData::touch_atime.
+    std::atomic<time_t> atime_due = 0;
+};
+
+// A data object opened by a handle. Requests hold a reference across their I/O, so a handle moving on to another
+// object only closes the old fd once the last of them is done with it.
+struct OpenObject{
     int fd;
+    uint32_t data_id;
+    std::shared_ptr<ObjectSums> sums; // Checksums of the object, nullptr if not checksummed
+    bool verify = false; // Reads are checked against sums
+
+    OpenObject(int fd, uint32_t data_id) : fd(fd), data_id(data_id){}
+    ~OpenObject(){ close(fd); }
+
+    OpenObject(const OpenObject&) = delete;
+    OpenObject& operator=(const OpenObject&) = delete;
+};
+
+struct FileHandle{
+    int flags; // Flags used to (lazily) open the backing data file
+    std::shared_ptr<InodeIO> io;
+    Readahead ra;
+    bool passthrough = false; // Holds a reference on io->backing_id
+    bool cached = false; // Counted in io->cached_handles
+
+    // nullptr while the file is inline, opened lazily once its data moves to a data file. Only replaced under both
+    // the state lock and obj_mutex, so holding either is enough to read it.
+    std::shared_ptr<OpenObject> obj;
+    uint64_t object_gen = 0; // io->object_gen as of opening obj
+    mutable std::mutex obj_mutex;
+
+    // A reference on obj if it is still on the file's current data object, nullptr if it has to be (re)opened
+    inline std::shared_ptr<OpenObject> current_object() const{
+        std::lock_guard<std::mutex> lk(obj_mutex);
+        return obj && object_gen == io->object_gen.load() ? obj : nullptr;
+    }
+    // Call with the state lock held
+    inline void set_object(std::shared_ptr<OpenObject> o){
+        std::lock_guard<std::mutex> lk(obj_mutex);
+        obj.swap(o);
+        object_gen = io->object_gen;
+    }
+};
+
+
+// Metadata is stored and paged in per directory: meta/<dir ino>.json holds the directory's own inode_entry
+// along with the entries of all of its non-directory children. Subdirectories are partitions of their own.
+struct partition_state{
+    bool referenced = true; // CLOCK reference bit
+    std::list<fuse_ino_t>::iterator clock_pos;
+    uint64_t disk_gen = NO_GEN; // Generation of meta/<dir>.json
+};
+
+// A snapshot is just a generation number: everything born at or before gen and not yet dead at it. Nothing is
+// copied when one is taken, metadata and data written afterwards diverge from it lazily (see snapshot.cpp).
+struct snapshot_t{
+    std::string name;
+    uint32_t id; // Used in view inode numbers, never reused
+    uint64_t gen;
+    time_t created;
+
+    // Lazily cloned directories still reading from this snapshot, and snapshots taken while there were any (their
+    // copies of those directories read from it too). A snapshot with either is kept, hidden, past its deletion.
+    uint64_t clone_refs = 0;
+    std::vector<uint32_t> held_by;
+    bool unclaimed = false; // Taken by clone_dir, which hasn't committed the clone using it yet
+
+    // Deleted snapshots and the ones clone_dir takes for itself aren't listed, their names start with '/'
+    inline bool hidden() const { return !name.empty() && name.front() == '/'; }
+};
+
+// Something the live tree dropped while a snapshot may still need it: a data object or a partition version.
+// Snapshot s needs it iff birth <= s.gen < death.
+struct gen_range{
+    uint64_t id; // data_id or directory ino
+    uint64_t birth;
+    uint64_t death;
+};
+
+void to_json(json& j, const snapshot_t& snap);
+void from_json(const json& j, snapshot_t& snap);
+void to_json(json& j, const gen_range& range);
+void from_json(const json& j, gen_range& range);
+
+
+// Copy of a partition's entries, taken under the state lock and serialized after it is released. The copy is
+// the whole partition, however little of it changed.
+struct partition_snapshot{
+    inode_entry dir;
+    std::vector<inode_entry> files;
+    uint64_t gen; // Generation the copy was taken in
 };
 
 
@@ -92,48 +371,360 @@ private:
     bool initialized = false;
     fuse_ino_t next_ino = 1;
     uint32_t next_data_id = 1;
-    SealFSLock plock;
     std::filesystem::path persistence_root;
+    SealFSLock plock;
+    SealFSConfig config;
+    MmapCache mmap_cache{config.mmap_cache_mb * 1024 * 1024};
     std::shared_ptr<spdlog::logger> logger;
+    std::unique_ptr<DataTiers> tiers;
+    std::unique_ptr<Fsck> fsck;
+    std::unique_ptr<ChecksumStore> checksums;
+    std::atomic<bool> sums_dir_dirty = false; // Sidecars written since meta/sums was last synced
+    std::mutex state_mutex;
+    // Resident subset of the tree, directories are loaded on first access
     std::unordered_map<fuse_ino_t, inode_entry> inodes;
 
+    std::unordered_map<fuse_ino_t, partition_state> partitions;
+    std::list<fuse_ino_t> clock; // Resident partitions in CLOCK order
+    std::list<fuse_ino_t>::iterator clock_hand = clock.end();
+    std::unordered_map<fuse_ino_t, std::weak_ptr<InodeIO>> inode_io; // Per inode I/O state of open files
+    // Unlinked files still referenced by the kernel or open handles. Resident but in no partition, so never
+    // written out or paged out, and destroyed once the last reference is gone.
+    std::unordered_set<fuse_ino_t> orphans;
+    // Data objects shared by CoW copies -> the files referencing them (always >= 2)
+    std::unordered_map<uint32_t, std::vector<fuse_ino_t>> data_sharers;
+    // Size of each object in data_sharers (writes and truncates break CoW first, so it doesn't change while shared),
+    // and the total of those no placeholder owner already counts in usage_t::bytes. Directory usage counts a shared
+    // object once per file, statfs counts it once.
+    std::unordered_map<uint32_t, int64_t> shared_sizes;
+    int64_t shared_object_bytes = 0;
+    std::condition_variable cow_cv; // With state_mutex, an InodeIO stopped breaking
+    // Writes to data objects run outside the state lock, a commit taking snapshots waits for them, see begin_data_write()
+    unsigned data_writes = 0; // Under state_mutex, in flight
+    bool freezing_data = false; // Under state_mutex, a commit is waiting for data_writes to drain to take snapshots
+    std::condition_variable data_writes_cv; // With state_mutex, data_writes drained or freezing_data is over
+    bool passthrough_active = false; // Negotiated with the kernel in init
+    const Dispatcher* dispatcher = nullptr; // Serving requests, if not libfuse's single threaded loop
+    std::unordered_set<fuse_ino_t> dirty_partitions; // Resident partitions changed since the last commit
+    std::unordered_map<fuse_ino_t, uint64_t> removed_partitions; // Partition files to delete on the next commit -> their disk_gen
+    std::unordered_set<fuse_ino_t> linked_partitions; // Dirty partitions a rename moved entries between, only written out together by a commit
+    std::unordered_map<fuse_ino_t, time_t> lazy_partitions; // Partitions with lazytime timestamp changes only -> since when (CLOCK_MONOTONIC seconds)
+    bool super_dirty = false; // next_ino/next_data_id changed since meta/super.json was written
+    // Directory -> usage changes its partition file doesn't have yet. Kept in super.json rather than rewriting every
+    // directory up to the root on each size change, and folded into the partitions before snapshots read them.
+    std::unordered_map<fuse_ino_t, usage_t> usage_deltas;
+
+    std::unordered_set<uint32_t> dirty_data; // Data objects written since the last commit
+    std::vector<uint32_t> pending_data_removals; // Data objects of removed files, deleted once a commit lands
+    bool data_dir_dirty = false; // Data objects created since the last commit
+    std::unordered_map<uint32_t, unsigned> object_handles; // Data objects handles have open -> how many, never migrated
+
+    // Snapshots, see snapshot.cpp
+    uint64_t cur_gen = 1; // Generation new metadata and data objects are born in, bumped by every snapshot
+    uint32_t next_snapshot_id = 1;
+    std::vector<snapshot_t> snapshots; // Oldest first
+    std::vector<std::string> pending_snapshots; // Taken by the next commit
+    // Superseded partitions kept as meta/versions/<dir>.<birth>.json for snapshots
+    std::unordered_map<fuse_ino_t, std::vector<gen_range>> partition_versions;
+    std::vector<gen_range> retired_data; // Data objects only snapshots still reference
+    std::vector<std::pair<fuse_ino_t, uint64_t>> pending_version_removals; // (dir, birth) no snapshot needs anymore
+    std::unordered_map<fuse_ino_t, inode_entry> snapshot_inodes; // Loaded snapshot view entries, read-only
+    uint64_t pin_requests = 0; // Makes the names of snapshots clone_dir takes unique
+    // Snapshot a send stream last brought this tree to, {gen, snapshot}. Gone once the tree is changed locally,
+    // an incremental stream only applies on top of exactly what was sent. See stream.hpp.
+    std::optional<json> received;
+
+    // Group commit state, see commit()
+    std::mutex commit_mutex;
+    std::condition_variable commit_cv;
+    uint64_t commits_started = 0;
+    uint64_t commits_done = 0;
+    // Callers waiting on each commit epoch, and which of those epochs failed, so each caller hears about its own
+    std::unordered_map<uint64_t, unsigned> commit_waiters;
+    std::unordered_set<uint64_t> failed_commits;
+    bool commit_running = false;
+    bool commit_writing = false; // Under state_mutex, a commit is between snapshotting and finishing its writes
+    bool flush_times = false; // Under commit_mutex, a caller of the next commit wants lazytime timestamps written out too
+
+    // Background checkpointer, commits on a timer or once checkpoint_dirty partitions are dirty
+    std::mutex checkpoint_mutex;
+    std::condition_variable_any checkpoint_cv;
+    std::atomic<bool> checkpoint_requested = false;
+    std::jthread checkpointer;
+
+    // Background migration between data tiers, see tier.hpp
+    std::mutex migrate_mutex;
+    std::condition_variable_any migrate_cv;
+    std::jthread migrator;
+
+    // Rough per-entry footprint (entry, map node, parent's children slot) used against meta_cache_mb
+    static constexpr size_t APPROX_ENTRY_BYTES = 512;
+
     inline std::filesystem::path get_log_path(){
         return persistence_root / "sealfs.log";
     }
 
+    // Pre-partitioning single file layout, only read to migrate old persistence roots
     inline std::filesystem::path get_structure_path(){
         return persistence_root / "structure.json";
     }
 
+    inline std::filesystem::path get_meta_path(){
+        return persistence_root / "meta";
+    }
+
+    inline std::filesystem::path get_super_path(){
+        return get_meta_path() / "super.json";
+    }
+
+    inline std::filesystem::path get_journal_path(){
+        return get_meta_path() / "journal.json";
+    }
+
+    inline std::filesystem::path get_partition_path(fuse_ino_t dir){
+        return get_meta_path() / (std::to_string(dir) + ".json");
+    }
+
+    inline std::filesystem::path get_versions_path(){
+        return get_meta_path() / "versions";
+    }
+
+    inline std::filesystem::path get_partition_version_path(fuse_ino_t dir, uint64_t birth){
+        return get_versions_path() / (std::to_string(dir) + "." + std::to_string(birth) + ".json");
+    }
+
     inline std::filesystem::path get_data_path(){
         return persistence_root / "data";
     }
 
+    inline std::filesystem::path get_cold_path(){
+        return persistence_root / COLD_DIR_NAME;
+    }
+
+    inline std::filesystem::path get_sums_path(){
+        return get_meta_path() / "sums";
+    }
+
+    inline fuse_ino_t partition_of(const inode_entry& ent){
+        return ent.type == sealfs_ino_t::DIR ? ent.ino : ent.parent;
+    }
+
     void validate_persistence_root();
-    // TODO: At some point switch over to an atomic write
-    bool write_structure_to_disk();
-    bool read_structure_from_disk();
+    void start_fsck();
+    void start_checksums();
+    void start_migrator();
+    void migrate_loop(std::stop_token stop);
+    bool migrate_structure_file();
+    bool read_metadata_from_disk();
+
+    bool write_file_atomic(const std::filesystem::path& path, const std::string& contents);
+    json super_json();
+    std::optional<partition_snapshot> snapshot_partition(fuse_ino_t dir);
+    static json partition_json(const partition_snapshot& snap);
+    bool sync_data_object(uint32_t data_id);
+    bool write_partition(fuse_ino_t dir);
+    bool run_commit(bool with_times);
+    bool apply_checkpoint(const json& checkpoint);
+    bool replay_journal();
+    void checkpoint_loop(std::stop_token stop);
+    bool load_partition(fuse_ino_t dir);
+    // Resident entry of cur_ino, paging its partition in if needed but leaving a lazy clone unfilled. inodes.end()
+    // if it can't be found.
+    std::unordered_map<fuse_ino_t, inode_entry>::iterator page_in(fuse_ino_t cur_ino);
+
+    void register_partition(fuse_ino_t dir, bool dirty);
+    void unregister_partition(fuse_ino_t dir);
+    bool is_evictable(fuse_ino_t dir);
+    // Drop a file's reference to its data object, queueing the object for removal once nothing shares it
+    void release_data(const inode_entry& ent);
+    // Whether the kernel still knows ino or a handle has it open
+    bool in_use(const inode_entry& ent);
+    // Drop an entry that is already out of the tree, along with its data. Invalidates references to it.
+    void destroy(inode_entry& ent);
+    // Destroy an orphan nothing references anymore
+    void reap_if_unused(fuse_ino_t ino);
+    // Same for a file that stays around and is about to point at another object, which it will own outright
+    void detach_data(inode_entry& ent);
+    // ino now lives in another data object (or inline), have its open handles reopen theirs
+    void object_moved(fuse_ino_t ino);
+    // Take ino off data_id's sharers, the last one left goes back to owning the object outright
+    void drop_sharer(uint32_t data_id, fuse_ino_t ino);
+    // Whether ent is one of its data object's listed sharers, which is what its usage is counted as. A sharers
+    // list may hold one INVALID_INODE standing in for a file clone_dir couldn't name, that file counts as owner.
+    bool counts_as_shared(const inode_entry& ent) const;
+    // Add delta to dir and every directory above it, in memory and usage_deltas
+    void account(fuse_ino_t dir, const usage_t& delta);
+    // Have the next commit write usage_deltas into the partitions of the directories they belong to. Only resident
+    // ones, unless all, which pages the others in.
+    void fold_usage_deltas(bool all);
+    // Recompute data_sharers and all directory usage by walking the whole tree, for roots that predate them
+    void rebuild_accounting();
+    // Fill in shared_sizes missing from data_sharers (from one of the files sharing each object) and recompute
+    // shared_object_bytes
+    void recount_shared();
+
+    inline bool snapshot_needs(uint64_t birth) const { return !snapshots.empty() && birth <= snapshots.back().gen; }
+    bool needed_by_snapshot(const gen_range& range) const;
+    // Drop the live tree's last reference to a data object, keeping it around while snapshots need it
+    void retire_data(uint32_t data_id, uint64_t birth);
+    // Take pending snapshots, called by run_commit under the state lock once the dirty state has been copied out
+    void take_pending_snapshots();
+    // Where snapshot generation gen's copy of partition dir lives, if it existed then
+    std::filesystem::path snapshot_partition_path(fuse_ino_t dir, uint64_t gen);
+    bool load_snapshot_partition(const snapshot_t& snap, fuse_ino_t dir);
+    const std::optional<std::reference_wrapper<inode_entry>> lookup_snapshot_entry(fuse_ino_t view);
+    // Recreate the /.snapshots entry from the snapshot list
+    void rebuild_snapshots_dir();
+    // Hard link meta/<dir>.json aside as the version born at birth, before it gets replaced or removed
+    bool preserve_partition(fuse_ino_t dir, uint64_t birth);
+    void add_partition_version(fuse_ino_t dir, uint64_t birth, uint64_t death);
+    // Queue everything in retired_data and partition_versions that no remaining snapshot needs for removal
+    void collect_snapshot_garbage();
+    snapshot_t* find_snapshot(uint32_t id);
+    // Drop hidden snapshots nothing holds anymore, then free what only they referenced
+    void release_pins();
+    // Partition dir as snapshot generation gen saw it, nullopt if it didn't exist then
+    std::optional<json> read_partition_at(fuse_ino_t dir, uint64_t gen);
+    // Same for dir as seen by snap, following lazily cloned directories back to where their contents really
+    // are. dir and snap are updated to match.
+    std::optional<json> read_clone_source(fuse_ino_t& dir, snapshot_t*& snap);
+    // Copy a lazily cloned directory's entries over from its source, subdirectories become lazy clones in turn
+    void materialize_clone(fuse_ino_t dir);
+    // Make a file materialize_clone copied a sharer of its data object
+    void adopt_data(const inode_entry& ent);
 
 public:
-    SealFSData();
-    SealFSData(const std::filesystem::path& path);
+    SealFSData(const SealFSConfig& config = {});
+    SealFSData(const std::filesystem::path& path, const SealFSConfig& config = {});
     ~SealFSData();
 
 
     fuse_ino_t get_parent(fuse_ino_t node);
+    // Unlink node from its parent. A file the kernel still knows or that is open stays behind as an orphan, readable
+    // and writable through its handles, until forget() and the last release let go of it.
     bool remove(fuse_ino_t node, sealfs_ino_t expected_type);
+    // Move parent/name to newparent/newname, replacing whatever is there unless flags say otherwise (rename(2)'s
+    // RENAME_NOREPLACE and RENAME_EXCHANGE). Returns 0 or an errno.
+    int rename(fuse_ino_t parent, const char* name, fuse_ino_t newparent, const char* newname, unsigned int flags);
 
     // std::optional<std::reference_wrapper<T>> since non-owning nullable reference + don't want to pass around raw ptrs
-    const std::optional<std::reference_wrapper<std::unordered_map<std::string, fuse_ino_t>>> get_children(fuse_ino_t node);
+    const std::optional<std::reference_wrapper<children_map>> get_children(fuse_ino_t node);
 
     // TODO: Maybe string_view this?
     fuse_ino_t lookup(fuse_ino_t parent, const char* name);
     const std::optional<std::reference_wrapper<inode_entry>> lookup_entry(fuse_ino_t parent, const char* name);
     const std::optional<std::reference_wrapper<inode_entry>> lookup_entry(fuse_ino_t cur_ino);
-    // Return nullopt iff parent has a child with same name already
-    std::optional<std::reference_wrapper<inode_entry>> create_inode_entry(fuse_ino_t parent, const char* name, sealfs_ino_t type, mode_t mode);
+    // Like lookup_entry(cur_ino) but never pages anything in
+    const std::optional<std::reference_wrapper<inode_entry>> lookup_resident_entry(fuse_ino_t cur_ino);
+    // Return nullopt iff parent has a child with same name already. The new entry is owned by uid:gid, the caller
+    // creating it.
+    std::optional<std::reference_wrapper<inode_entry>> create_inode_entry(fuse_ino_t parent, const char* name, sealfs_ino_t type, mode_t mode, uid_t uid = 0, gid_t gid = 0);
     std::optional<std::reference_wrapper<inode_entry>> cow_inode_entry(fuse_ino_t parent, const char* name, mode_t mode, fuse_ino_t to_copy);
     std::filesystem::path get_data_ent_path(uint32_t data_id);
+    // Open data_id's object for a file handle, on whichever tier it is, and keep the migrator off it until the
+    // handle's put_object(). Call with the state lock held. Returns the fd, -1 with errno set on failure.
+    int open_object(uint32_t data_id, int flags, mode_t mode = 0);
+    // A handle is done with data_id's object. Call with the state lock held, the fd may be closed after.
+    void put_object(uint32_t data_id);
+    inline DataTiers& get_tiers(){ return *tiers; }
+
+    inline size_t get_inline_threshold() const { return config.inline_threshold; }
+    // Move an inline file's contents out to a fresh data file, false on failure (entry is left inline)
+    bool spill_inline(inode_entry& ent);
+    inline bool is_shared(uint32_t data_id) const { return data_sharers.contains(data_id); }
+    // Bytes the live tree takes up, given the root's usage: shared objects counted once, files at their logical size
+    inline int64_t used_bytes(const usage_t& root) const { return root.bytes + shared_object_bytes; }
+    // Whether writing ent's data object in place would change what a CoW copy or a snapshot sees
+    inline bool needs_cow(const inode_entry& ent) const{
+        return !ent.is_inline() && (is_shared(ent.data_id) || snapshot_needs(ent.data_gen));
+    }
+
+    // Snapshot the whole tree as /.snapshots/<name>, O(1) apart from the commit it rides on. Must be called
+    // without the state lock held. Returns 0 or an errno.
+    int create_snapshot(const std::string& name);
+    // Delete a snapshot, freeing whatever only it still referenced. Same locking rules as create_snapshot.
+    int delete_snapshot(const std::string& name);
+    // Turn the empty directory dst into a clone of the directory at src_path (relative to the mount, may be inside
+    // .snapshots). Data objects are shared and directories are only copied when first looked up, so this costs
+    // one commit whatever the size of the tree. Same locking rules as create_snapshot. The caller, uid:gid, needs
+    // write permission on dst, search permission on every directory along src_path and read permission on the
+    // source itself. Entries below it keep their owners and modes in the clone.
+    int clone_dir(fuse_ino_t dst, const std::string& src_path, uid_t uid, gid_t gid);
+    // Change a file's size, keeping the usage of the directories above it in step
+    void set_size(inode_entry& ent, off_t size);
+    // What a file contributes to the usage of the directories above it
+    usage_t file_usage(const inode_entry& ent) const;
+    inline const std::filesystem::path& get_persistence_root() const { return persistence_root; }
+    // Give file ino a private copy of a data object it shares with CoW copies or snapshots (reflinked where the
+    // backing filesystem can), before it is first written. With size, the copy only keeps that many bytes, the file
+    // is being truncated. Call with the state lock held in guard, it is dropped while copying, so entry references
+    // don't survive the call. Returns 0 or an errno.
+    int break_cow(fuse_ino_t ino, std::unique_lock<std::mutex>& guard, std::optional<off_t> size = std::nullopt);
+    // Truncate or zero extend file ino to size, data and metadata. Objects shared with CoW copies or snapshots are
+    // left alone, the file gets its own holding only what is kept. Call with the state lock held in guard, which may
+    // be dropped meanwhile, so entry references don't survive the call. Returns 0 or an errno.
+    int truncate(fuse_ino_t ino, std::unique_lock<std::mutex>& guard, off_t size);
+    inline bool is_passthrough_active() const { return passthrough_active; }
+    inline void set_passthrough_active(bool active){ passthrough_active = active; }
+    inline const Dispatcher* get_dispatcher() const { return dispatcher; }
+    inline void set_dispatcher(const Dispatcher* d){ dispatcher = d; }
+
+    // Count a write to a data object in flight, for once the caller has checked under the state lock that the file
+    // doesn't need CoW. Snapshots freeze objects, so a commit taking them waits until writes in flight have landed
+    // first. While it does, this waits too (dropping the lock in guard) and returns false, the caller then has to
+    // check again. End every write counted with end_data_write(), under the state lock.
+    bool begin_data_write(std::unique_lock<std::mutex>& guard);
+    void end_data_write();
+
+    // Coarse lock over all metadata, every ll_op holds it while touching SealFSData
+    inline std::unique_lock<std::mutex> lock_state(){
+        std::unique_lock<std::mutex> lk(state_mutex, std::try_to_lock);
+        if(!lk.owns_lock()){
+            SEALFS_TRACE(lock__wait__start);
+            lk.lock();
+            SEALFS_TRACE(lock__wait__done);
+        }
+        return lk;
+    }
+
+    // Must be called after modifying an entry in place so its partition gets written back
+    void mark_dirty(const inode_entry& ent);
+    // Same, for changes to nothing but ent's timestamps. Under lazytime they don't make a checkpoint on their own.
+    void mark_times_dirty(const inode_entry& ent);
+    // A read of ent: move its atime as atime_mode says. io is ent's I/O state if it has open handles, whose reads
+    // then skip the state lock until the next time an update could be due. Call with the state lock held.
+    void touch_atime(inode_entry& ent, InodeIO* io = nullptr);
+    // Whether a read through a handle on io has to take the state lock for touch_atime
+    inline bool atime_due(const InodeIO& io) const{
+        return config.atime_mode != ATIME_OFF && time(nullptr) >= io.atime_due.load(std::memory_order_relaxed);
+    }
+    // Must be called after writing to a data object so the next commit syncs it (and its checksums)
+    inline void mark_data_dirty(uint32_t data_id){
+        dirty_data.insert(data_id);
+        checksums->pin(data_id);
+    }
+
+    // Make every write and metadata change made before the call durable. Concurrent callers are batched into one
+    // commit: fdatasync of every dirty data object, then one write of the dirty metadata. with_times = false
+    // (background checkpoints) leaves lazytime timestamps that haven't expired yet in memory. Must be called
+    // without the state lock held. Returns 0 or an errno.
+    int commit(bool with_times = true);
+
+    // Kernel lookup count bookkeeping, entries with references are never paged out
+    inline void add_lookup(inode_entry& ent){ ++ent.nlookup; }
+    // I/O state for ino, shared with any handle already open on it. Call with the state lock held.
+    std::shared_ptr<InodeIO> get_inode_io(fuse_ino_t ino);
+    // Drop a handle's reference, forgetting ino's I/O state once no handle uses it. An orphan the kernel already
+    // forgot is destroyed with its last handle. Call with the state lock held.
+    void put_inode_io(fuse_ino_t ino, std::shared_ptr<InodeIO>& io);
+    inline MmapCache& get_mmap_cache(){ return mmap_cache; }
+    inline ChecksumStore& get_checksums(){ return *checksums; }
+    inline const SealFSConfig& get_config() const { return config; }
+    // Drop nlookup kernel references to ino, destroying it if it was an orphan and that was the last reference
+    void forget(fuse_ino_t ino, uint64_t nlookup);
+    // Page out unreferenced directories (CLOCK order) while over meta_cache_mb. Invalidates entry references,
+    // so only call once a request is done with them.
+    void evict_if_needed();
 
     // TODO: Replace all internal logger-> calls with calls to these
     template<typename... Args>
@@ -156,6 +747,9 @@ public:
         logger->error(fmt, std::forward<Args>(args)...);
     }
 
+    // nullptr if no check was run at mount
+    inline const fsck_report* get_fsck_report() const { return fsck ? &fsck->get_report() : nullptr; }
+
     inline bool is_initialized(){ return initialized; }
     inline void set_initialized(bool in){ initialized = in; }
 
@@ -165,12 +759,11 @@ public:
 class DirBuf{
 private:
     fuse_req_t req;
-    char *p; // Each fuse_direntry is packed into p
-    size_t size; // Size of p (all packed fuse_direntrys so far)
+    BufferPool::Buffer buf; // Each fuse_direntry is packed into buf, which comes from (and goes back to) the thread's pool
+    size_t size; // Size of all packed fuse_direntrys so far
 
 public:
     DirBuf(fuse_req_t req);
-    ~DirBuf();
 
     void add_entry(SealFS::SealFSData* fs, const char* name, fuse_ino_t ino);
     int reply(off_t off, size_t maxsize);
@@ -0,0 +1,640 @@
+#include "stream.hpp"
+#include "state.hpp"
+
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <deque>
+#include <fstream>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+using namespace SealFS;
+
+namespace{
+
+static constexpr char STREAM_MAGIC[8] = {'S', 'E', 'A', 'L', 'S', 'E', 'N', 'D'};
+static constexpr uint64_t STREAM_VERSION = 1;
+static constexpr size_t STREAM_BUFFER = 1 << 20;
+
+enum record_t : uint8_t{
+    REC_HEADER = 'H',
+    REC_DATA = 'D',
+    REC_PARTITION = 'P',
+    REC_REMOVE_PARTITION = 'p',
+    REC_REMOVE_DATA = 'd',
+    REC_END = 'E'
+};
+
+bool write_all(int fd, const char* buf, size_t len){
+    while(len > 0){
+        ssize_t bytes = write(fd, buf, len);
+        if(bytes == -1){
+            if(errno == EINTR) continue;
+            return false;
+        }
+        buf += bytes;
+        len -= bytes;
+    }
+    return true;
+}
+
+bool read_all(int fd, char* buf, size_t len){
+    while(len > 0){
+        ssize_t bytes = read(fd, buf, len);
+        if(bytes == -1 && errno == EINTR){
+            continue;
+        }
+        if(bytes <= 0){
+            return false;
+        }
+        buf += bytes;
+        len -= bytes;
+    }
+    return true;
+}
+
+class StreamWriter{
+private:
+    int fd;
+    std::string buf;
+
+public:
+    explicit StreamWriter(int fd) : fd(fd){
+        buf.reserve(STREAM_BUFFER);
+    }
+
+    bool put(const char* data, size_t len){
+        if(buf.size() + len > STREAM_BUFFER && !flush()){
+            return false;
+        }
+        if(len >= STREAM_BUFFER){
+            return write_all(fd, data, len);
+        }
+        buf.append(data, len);
+        return true;
+    }
+
+    bool put_u64(uint64_t v){
+        char bytes[8];
+        for(int i = 0; i < 8; ++i){
+            bytes[i] = static_cast<char>(v >> (8 * i));
+        }
+        return put(bytes, sizeof(bytes));
+    }
+
+    bool record_header(record_t type, uint64_t id, uint64_t len){
+        const char t = static_cast<char>(type);
+        return put(&t, 1) && put_u64(id) && put_u64(len);
+    }
+
+    bool record(record_t type, uint64_t id, const std::vector<uint8_t>& payload = {}){
+        return record_header(type, id, payload.size()) && put(reinterpret_cast<const char*>(payload.data()), payload.size());
+    }
+
+    // Contents of a data object go straight from the page cache to fd where the kernel can, len bytes exactly
+    bool file(int in, uint64_t len){
+        if(!flush()){
+            return false;
+        }
+        while(len > 0){
+            ssize_t bytes = sendfile(fd, in, nullptr, std::min<uint64_t>(len, 1 << 30));
+            if(bytes == -1 && (errno == EINVAL || errno == ENOSYS)){
+                break;
+            }
+            if(bytes <= 0){
+                return false;
+            }
+            len -= bytes;
+        }
+        std::vector<char> chunk(STREAM_BUFFER);
+        while(len > 0){
+            ssize_t bytes = read(in, chunk.data(), std::min<uint64_t>(len, chunk.size()));
+            if(bytes <= 0 || !write_all(fd, chunk.data(), bytes)){
+                return false;
+            }
+            len -= bytes;
+        }
+        return true;
+    }
+
+    bool flush(){
+        const bool ok = write_all(fd, buf.data(), buf.size());
+        buf.clear();
+        return ok;
+    }
+};
+
+class StreamReader{
+private:
+    int fd;
+
+public:
+    explicit StreamReader(int fd) : fd(fd){}
+
+    bool get(char* data, size_t len){
+        return read_all(fd, data, len);
+    }
+
+    bool get_u64(uint64_t& v){
+        unsigned char bytes[8];
+        if(!get(reinterpret_cast<char*>(bytes), sizeof(bytes))){
+            return false;
+        }
+        v = 0;
+        for(int i = 0; i < 8; ++i){
+            v |= static_cast<uint64_t>(bytes[i]) << (8 * i);
+        }
+        return true;
+    }
+
+    bool record_header(uint8_t& type, uint64_t& id, uint64_t& len){
+        return get(reinterpret_cast<char*>(&type), 1) && get_u64(id) && get_u64(len);
+    }
+
+    bool payload(uint64_t len, std::vector<uint8_t>& out){
+        out.resize(len);
+        return get(reinterpret_cast<char*>(out.data()), len);
+    }
+
+    // Copy len bytes of the stream into out
+    bool file(int out, uint64_t len){
+        std::vector<char> chunk(STREAM_BUFFER);
+        while(len > 0){
+            const size_t n = std::min<uint64_t>(len, chunk.size());
+            if(!get(chunk.data(), n) || !write_all(out, chunk.data(), n)){
+                return false;
+            }
+            len -= n;
+        }
+        return true;
+    }
+};
+
+// Read-only view of a persistence root's snapshots, the same lookup SealFSData does for .snapshots
+struct volume{
+    std::filesystem::path root;
+    json super;
+    std::vector<snapshot_t> snapshots;
+    std::unordered_map<fuse_ino_t, std::vector<gen_range>> partition_versions;
+
+    std::filesystem::path meta_dir() const { return root / "meta"; }
+    std::filesystem::path data_path(uint32_t data_id) const { return find_data_object(root, data_id); }
+
+    bool load(spdlog::logger& logger){
+        try{
+            std::ifstream in(meta_dir() / "super.json");
+            if(!in.is_open()){
+                logger.error("{} has no super.json", root.string());
+                return false;
+            }
+            in >> super;
+            snapshots = super.value("snapshots", std::vector<snapshot_t>{});
+            partition_versions = super.value("partition_versions", std::unordered_map<fuse_ino_t, std::vector<gen_range>>{});
+        }
+        catch(const std::exception& e){
+            logger.error("Failed to read super.json of {}: {}", root.string(), e.what());
+            return false;
+        }
+        return true;
+    }
+
+    // A snapshot by name, or by generation number
+    std::optional<uint64_t> resolve(const std::string& name) const{
+        for(const auto& snap : snapshots){
+            if(!snap.hidden() && (snap.name == name || std::to_string(snap.gen) == name)){
+                return snap.gen;
+            }
+        }
+        return std::nullopt;
+    }
+
+    std::optional<json> read_partition_at(fuse_ino_t dir, uint64_t gen) const{
+        std::vector<std::filesystem::path> paths;
+        auto it = partition_versions.find(dir);
+        if(it != partition_versions.end()){
+            for(const auto& range : it->second){
+                if(range.birth <= gen && gen < range.death){
+                    paths.push_back(meta_dir() / "versions" / (std::to_string(dir) + "." + std::to_string(range.birth) + ".json"));
+                }
+            }
+        }
+        paths.push_back(meta_dir() / (std::to_string(dir) + ".json"));
+
+        for(const auto& path : paths){
+            std::ifstream in(path);
+            if(!in.is_open()){
+                continue;
+            }
+            json j;
+            in >> j;
+            if(j.value("gen", uint64_t(0)) <= gen){
+                return j;
+            }
+        }
+        return std::nullopt;
+    }
+
+    // Every partition of the tree as of gen, parents before children. visit returns false to stop.
+    template<typename Visit>
+    bool walk(uint64_t gen, spdlog::logger& logger, Visit&& visit) const{
+        std::deque<fuse_ino_t> queue{ROOT_INODE};
+        while(!queue.empty()){
+            const fuse_ino_t dir = queue.front();
+            queue.pop_front();
+
+            try{
+                auto j = read_partition_at(dir, gen);
+                if(!j){
+                    logger.error("Partition {} is missing from generation {}", dir, gen);
+                    return false;
+                }
+                std::unordered_set<fuse_ino_t> files;
+                for(const auto& file : j->at("files")){
+                    files.insert(file.at("ino").get<fuse_ino_t>());
+                }
+                for(const auto& [name, child] : j->at("dir").at("children").get<std::unordered_map<std::string, fuse_ino_t>>()){
+                    if(!files.contains(child)){
+                        queue.push_back(child);
+                    }
+                }
+                if(!visit(dir, *j)){
+                    return false;
+                }
+            }
+            catch(const std::exception& e){
+                logger.error("Failed to read partition {} as of generation {}: {}", dir, gen, e.what());
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+bool fsync_path(const std::filesystem::path& path){
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd == -1){
+        return false;
+    }
+    int ret = fsync(fd);
+    close(fd);
+    return ret == 0;
+}
+
+} // namespace
+
+SnapshotSender::SnapshotSender(const std::filesystem::path& root, std::shared_ptr<spdlog::logger> logger)
+    : root(root), logger(std::move(logger)){}
+
+bool SnapshotSender::send(const std::string& from, const std::string& to, int fd){
+    volume vol{root};
+    if(!vol.load(*logger)){
+        return false;
+    }
+
+    const auto to_gen = vol.resolve(to);
+    const auto from_gen = from.empty() ? std::optional<uint64_t>(0) : vol.resolve(from);
+    if(!to_gen || !from_gen){
+        logger->error("No snapshot {} in {}", !to_gen ? to : from, root.string());
+        return false;
+    }
+    if(*from_gen >= *to_gen){
+        logger->error("Snapshot {} is not older than {}", from, to);
+        return false;
+    }
+    logger->info("Sending generation {} of {}{}", *to_gen, root.string(), from.empty() ? std::string(" in full") : " on top of generation " + std::to_string(*from_gen));
+
+    // What the other side already has, metadata only
+    std::unordered_set<fuse_ino_t> from_dirs;
+    std::unordered_set<uint32_t> from_data;
+    if(*from_gen > 0){
+        const bool ok = vol.walk(*from_gen, *logger, [&](fuse_ino_t dir, const json& j){
+            from_dirs.insert(dir);
+            for(const auto& file : j.at("files")){
+                const uint32_t data_id = file.at("data_id").get<uint32_t>();
+                if(data_id != INLINE_DATA_ID){
+                    from_data.insert(data_id);
+                }
+            }
+            return true;
+        });
+        if(!ok){
+            return false;
+        }
+    }
+
+    StreamWriter out(fd);
+    const json header = {
+        {"version", STREAM_VERSION},
+        {"from_gen", *from_gen},
+        {"to_gen", *to_gen},
+        {"from", from},
+        {"to", to}
+    };
+    if(!out.put(STREAM_MAGIC, sizeof(STREAM_MAGIC)) || !out.record(REC_HEADER, 0, json::to_cbor(header))){
+        logger->error("Failed to write stream header: {}", strerror(errno));
+        return false;
+    }
+
+    // A partition not rewritten since from_gen is byte for byte what the other side has, and so is every data object
+    // its files reference. Anything born after from_gen is new, and so is an object from didn't reference (a clone
+    // can pick up one the live tree had let go of).
+    std::unordered_set<fuse_ino_t> to_dirs;
+    std::unordered_map<uint32_t, std::vector<fuse_ino_t>> holders;
+    std::unordered_set<uint32_t> sent;
+    bool ok = vol.walk(*to_gen, *logger, [&](fuse_ino_t dir, const json& j){
+        if(j.at("dir").contains("clone")){
+            logger->error("Directory {} is a clone that hasn't been filled in, list it on the mounted tree before taking the snapshot", dir);
+            return false;
+        }
+        to_dirs.insert(dir);
+        const bool changed = j.value("gen", uint64_t(0)) > *from_gen || *from_gen == 0;
+
+        for(const auto& file : j.at("files")){
+            const uint32_t data_id = file.at("data_id").get<uint32_t>();
+            if(data_id == INLINE_DATA_ID){
+                continue;
+            }
+            holders[data_id].push_back(file.at("ino").get<fuse_ino_t>());
+            if(!sent.insert(data_id).second){
+                continue;
+            }
+            if(!changed || (file.value("data_gen", uint64_t(0)) <= *from_gen && from_data.contains(data_id))){
+                ++stats.unchanged_data;
+                continue;
+            }
+
+            int in = open(vol.data_path(data_id).c_str(), O_RDONLY);
+            struct stat st;
+            if(in == -1 || fstat(in, &st) == -1){
+                logger->error("Failed to open data object {}: {}", data_id, strerror(errno));
+                if(in != -1) close(in);
+                return false;
+            }
+            const bool sent_ok = out.record_header(REC_DATA, data_id, st.st_size) && out.file(in, st.st_size);
+            close(in);
+            if(!sent_ok){
+                logger->error("Failed to send data object {}: {}", data_id, strerror(errno));
+                return false;
+            }
+            ++stats.data_objects;
+            stats.data_bytes += st.st_size;
+        }
+
+        if(changed){
+            if(!out.record(REC_PARTITION, dir, json::to_cbor(j))){
+                logger->error("Failed to send partition {}: {}", dir, strerror(errno));
+                return false;
+            }
+            ++stats.partitions;
+        }
+        return true;
+    });
+    if(!ok){
+        return false;
+    }
+
+    for(fuse_ino_t dir : from_dirs){
+        if(!to_dirs.contains(dir)){
+            ok = ok && out.record(REC_REMOVE_PARTITION, dir);
+            ++stats.removed_partitions;
+        }
+    }
+    for(uint32_t data_id : from_data){
+        if(!holders.contains(data_id)){
+            ok = ok && out.record(REC_REMOVE_DATA, data_id);
+            ++stats.removed_data;
+        }
+    }
+
+    // The other side ends up as a plain tree without snapshots of its own, sharing data exactly where to does
+    std::unordered_map<uint32_t, std::vector<fuse_ino_t>> sharers;
+    for(auto& [data_id, inos] : holders){
+        if(inos.size() >= 2){
+            sharers.emplace(data_id, std::move(inos));
+        }
+    }
+    const json super = {
+        {"version", 1},
+        {"next_ino", vol.super.at("next_ino")},
+        {"next_data_id", vol.super.at("next_data_id")},
+        {"sharers", sharers},
+        {"gen", std::max(vol.super.value("gen", uint64_t(1)), *to_gen + 1)},
+        {"next_snapshot_id", 1},
+        {"snapshots", json::array()},
+        {"partition_versions", json::object()},
+        {"retired_data", json::array()},
+        {"received", {{"gen", *to_gen}, {"snapshot", to}}}
+    };
+    ok = ok && out.record(REC_END, 0, json::to_cbor(super)) && out.flush();
+    if(!ok){
+        logger->error("Failed to finish stream: {}", strerror(errno));
+        return false;
+    }
+
+    logger->info("Sent {} partitions and {} data objects ({} bytes), removed {} partitions and {} data objects, skipped {} unchanged data objects",
+        stats.partitions, stats.data_objects, stats.data_bytes, stats.removed_partitions, stats.removed_data, stats.unchanged_data);
+    return true;
+}
+
+SnapshotReceiver::SnapshotReceiver(const std::filesystem::path& root, std::shared_ptr<spdlog::logger> logger)
+    : root(root), logger(std::move(logger)){}
+
+bool SnapshotReceiver::receive(int fd){
+    const auto meta_dir = root / "meta";
+    const auto data_dir = root / "data";
+    const auto super_path = meta_dir / "super.json";
+    const auto journal_path = meta_dir / "journal.json";
+
+    std::error_code ec;
+    std::filesystem::create_directories(meta_dir, ec);
+    std::filesystem::create_directories(data_dir, ec);
+    if(ec){
+        logger->error("Failed to create {}: {}", root.string(), ec.message());
+        return false;
+    }
+
+    // Metadata is applied the way a mount replays an interrupted checkpoint, by the same code
+    auto replay = [&]() -> bool{
+        try{
+            SealFSConfig config;
+            config.fsck_mode = FSCK_OFF;
+            config.checkpoint_interval = 0;
+            SealFSData fs(root, config);
+        }
+        catch(const std::exception& e){
+            logger->error("Failed to open {}: {}", root.string(), e.what());
+        }
+        spdlog::drop("SealFS Logger");
+        if(std::filesystem::exists(journal_path)){
+            logger->error("Failed to apply {}, see {}", journal_path.string(), (root / "sealfs.log").string());
+            return false;
+        }
+        return true;
+    };
+
+    SealFSLock lock(root);
+    if(std::filesystem::exists(journal_path)){
+        logger->warn("Finishing an earlier interrupted receive");
+        if(!replay()){
+            return false;
+        }
+    }
+
+    StreamReader in(fd);
+    char magic[sizeof(STREAM_MAGIC)];
+    uint8_t type;
+    uint64_t id;
+    uint64_t len;
+    std::vector<uint8_t> payload;
+    json header;
+    try{
+        if(!in.get(magic, sizeof(magic)) || memcmp(magic, STREAM_MAGIC, sizeof(magic)) != 0 || !in.record_header(type, id, len) || type != REC_HEADER || !in.payload(len, payload)){
+            logger->error("Not a SealFS send stream");
+            return false;
+        }
+        header = json::from_cbor(payload);
+        if(header.at("version").get<uint64_t>() != STREAM_VERSION){
+            logger->error("Unsupported send stream version {}", header.at("version").get<uint64_t>());
+            return false;
+        }
+    }
+    catch(const std::exception& e){
+        logger->error("Bad send stream header: {}", e.what());
+        return false;
+    }
+
+    // Only apply on top of exactly what the stream was computed against
+    const uint64_t from_gen = header.at("from_gen").get<uint64_t>();
+    try{
+        std::optional<json> super;
+        if(std::filesystem::exists(super_path)){
+            std::ifstream super_in(super_path);
+            super.emplace();
+            super_in >> *super;
+        }
+        if(from_gen == 0 && super){
+            logger->error("{} is not empty, a full stream needs an empty persistence root", root.string());
+            return false;
+        }
+        if(from_gen != 0){
+            if(!super || !super->contains("received") || super->at("received").at("gen").get<uint64_t>() != from_gen){
+                logger->error("{} is not at generation {}, the stream's base snapshot {}", root.string(), from_gen, header.at("from").get<std::string>());
+                return false;
+            }
+            if(!super->value("snapshots", json::array()).empty()){
+                logger->error("{} has snapshots of its own, receiving would change what they see", root.string());
+                return false;
+            }
+        }
+    }
+    catch(const std::exception& e){
+        logger->error("Failed to read {}: {}", super_path.string(), e.what());
+        return false;
+    }
+
+    json checkpoint = {
+        {"super", nullptr},
+        {"partitions", json::array()},
+        {"preserve", json::array()},
+        {"removed", json::array()},
+        {"dead_data", json::array()},
+        {"dead_versions", json::array()}
+    };
+    bool done = false;
+    while(!done){
+        if(!in.record_header(type, id, len)){
+            logger->error("Send stream ends early");
+            return false;
+        }
+
+        try{
+            switch(type){
+                case REC_DATA: {
+                    // Nothing the receiving tree references yet, so written in place
+                    const auto path = data_dir / (std::to_string(id) + ".data");
+                    int out = open(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+                    if(out == -1){
+                        logger->error("Failed to create {}: {}", path.string(), strerror(errno));
+                        return false;
+                    }
+                    const bool ok = in.file(out, len) && fdatasync(out) == 0;
+                    close(out);
+                    if(!ok){
+                        logger->error("Failed to receive data object {}", id);
+                        return false;
+                    }
+                    ++stats.data_objects;
+                    stats.data_bytes += len;
+                    break;
+                }
+                case REC_PARTITION:
+                    if(!in.payload(len, payload)){
+                        logger->error("Send stream ends early");
+                        return false;
+                    }
+                    checkpoint["partitions"].push_back(json::from_cbor(payload));
+                    ++stats.partitions;
+                    break;
+                case REC_REMOVE_PARTITION:
+                    checkpoint["removed"].push_back(id);
+                    ++stats.removed_partitions;
+                    break;
+                case REC_REMOVE_DATA:
+                    checkpoint["dead_data"].push_back(id);
+                    ++stats.removed_data;
+                    break;
+                case REC_END:
+                    if(!in.payload(len, payload)){
+                        logger->error("Send stream ends early");
+                        return false;
+                    }
+                    checkpoint["super"] = json::from_cbor(payload);
+                    done = true;
+                    break;
+                default:
+                    logger->error("Unknown record type {} in send stream", static_cast<int>(type));
+                    return false;
+            }
+        }
+        catch(const std::exception& e){
+            logger->error("Bad record in send stream: {}", e.what());
+            return false;
+        }
+    }
+
+    if(!fsync_path(data_dir)){
+        logger->error("Failed to sync {}", data_dir.string());
+        return false;
+    }
+
+    auto tmp_path = journal_path;
+    tmp_path += ".tmp";
+    {
+        std::ofstream journal(tmp_path, std::ios::trunc);
+        journal << checkpoint.dump();
+        if(!journal){
+            logger->error("Failed to write {}", tmp_path.string());
+            return false;
+        }
+    }
+    if(!fsync_path(tmp_path) || rename(tmp_path.c_str(), journal_path.c_str()) == -1 || !fsync_path(meta_dir)){
+        logger->error("Failed to put {} in place", journal_path.string());
+        return false;
+    }
+
+    if(!replay()){
+        return false;
+    }
+    logger->info("Received {} partitions and {} data objects ({} bytes), removed {} partitions and {} data objects",
+        stats.partitions, stats.data_objects, stats.data_bytes, stats.removed_partitions, stats.removed_data);
+    return true;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "common.hpp"
+
+#include <memory>
+#include <string>
+#include <filesystem>
+
+#include <spdlog/spdlog.h>
+
+namespace SealFS{
+
+// What a send or receive moved
+struct stream_stats{
+    size_t partitions = 0;
+    size_t removed_partitions = 0;
+    size_t data_objects = 0;
+    uint64_t data_bytes = 0;
+    size_t removed_data = 0;
+    size_t unchanged_data = 0; // Referenced by the target snapshot but already on the other side, never read
+};
+
+// Replication of snapshots between persistence roots. A send stream carries everything that turns a copy of
+// snapshot `from` into a copy of snapshot `to`: the partitions written since from (by generation), the data objects
+// born since from or not referenced by it, and what to remove. Data objects from carries over unchanged are never
+// read, only metadata is walked.
+//
+// Stream layout, integers little endian:
+//   "SEALSEND", then records of u8 type, u64 id, u64 length, payload
+//   'H' header, CBOR {version, from_gen, to_gen, from, to}
+//   'D' data object id, raw contents
+//   'P' partition of directory id, CBOR of its meta/<id>.json
+//   'p' directory id was removed
+//   'd' data object id was removed
+//   'E' end, CBOR of the receiver's super.json
+class SnapshotSender{
+private:
+    std::filesystem::path root;
+    std::shared_ptr<spdlog::logger> logger;
+    stream_stats stats;
+
+public:
+    SnapshotSender(const std::filesystem::path& root, std::shared_ptr<spdlog::logger> logger);
+
+    // Stream the changes from snapshot from (empty for a full send) to snapshot to into fd. Snapshots are named
+    // as under .snapshots, or by generation number. Safe to run against a mounted root.
+    bool send(const std::string& from, const std::string& to, int fd);
+
+    inline const stream_stats& get_stats() const { return stats; }
+};
+
+// Applies a send stream to a persistence root that isn't mounted. A full stream needs an empty root, an incremental
+// one a root whose last receive was the stream's from snapshot. Data objects are written first, then the metadata goes
+// through the same checkpoint journal a mount replays. A receive cut short before the journal was written can simply
+// be run again, one cut short after it is finished by the next mount or receive.
+class SnapshotReceiver{
+private:
+    std::filesystem::path root;
+    std::shared_ptr<spdlog::logger> logger;
+    stream_stats stats;
+
+public:
+    SnapshotReceiver(const std::filesystem::path& root, std::shared_ptr<spdlog::logger> logger);
+
+    bool receive(int fd);
+
+    inline const stream_stats& get_stats() const { return stats; }
+};
+
+} // namespace SealFS
@@ -0,0 +1,472 @@
+#include "tier.hpp"
+#include "state.hpp"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+
+using namespace SealFS;
+
+namespace{
+
+// Migrations copy (and pace themselves) this many bytes at a time
+constexpr size_t MIGRATE_CHUNK = 8 * 1024 * 1024;
+
+bool fsync_dir(const std::filesystem::path& dir){
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd == -1){
+        return false;
+    }
+    int ret = fsync(fd);
+    close(fd);
+    return ret == 0;
+}
+
+inline bool same_time(const struct timespec& a, const struct timespec& b){
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+inline bool newer(const struct timespec& a, const struct timespec& b){
+    return a.tv_sec > b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec > b.tv_nsec);
+}
+
+// len bytes from src to dst at their current offsets, copy_file_range where the two filesystems allow it (tiers
+// usually are different filesystems, which older kernels and most filesystem pairs refuse) and read/write otherwise
+bool copy_chunk(int src, int dst, size_t len){
+    static std::atomic<bool> use_copy_range = true;
+    while(len > 0 && use_copy_range){
+        ssize_t bytes = copy_file_range(src, nullptr, dst, nullptr, len, 0);
+        if(bytes > 0){
+            len -= bytes;
+            continue;
+        }
+        if(bytes == 0){
+            return false;
+        }
+        if(errno != EXDEV && errno != EOPNOTSUPP && errno != ENOSYS && errno != EINVAL){
+            return false;
+        }
+        use_copy_range = false;
+    }
+
+    char buf[64 * 1024];
+    while(len > 0){
+        ssize_t bytes = read(src, buf, std::min(len, sizeof(buf)));
+        if(bytes <= 0){
+            return false;
+        }
+        for(ssize_t done = 0; done < bytes;){
+            ssize_t written = write(dst, buf + done, bytes - done);
+            if(written == -1){
+                return false;
+            }
+            done += written;
+        }
+        len -= bytes;
+    }
+    return true;
+}
+
+} // namespace
+
+
+std::filesystem::path SealFS::find_data_object(const std::filesystem::path& root, uint32_t data_id){
+    const std::string name = std::to_string(data_id) + ".data";
+    auto hot = root / "data" / name;
+    std::error_code ec;
+    if(std::filesystem::exists(hot, ec)){
+        return hot;
+    }
+    auto cold = root / COLD_DIR_NAME / name;
+    if(std::filesystem::exists(cold, ec)){
+        return cold;
+    }
+    return hot;
+}
+
+DataTiers::DataTiers(const std::filesystem::path& hot_dir, const std::filesystem::path& cold_dir, std::shared_ptr<spdlog::logger> logger)
+    : hot_dir(hot_dir), cold_dir(cold_dir), logger(std::move(logger)){}
+
+std::filesystem::path DataTiers::object_in(const std::filesystem::path& dir, uint32_t data_id){
+    return dir / (std::to_string(data_id) + ".data");
+}
+
+std::vector<std::filesystem::path> DataTiers::dirs() const{
+    if(!enabled()){
+        return {hot_dir};
+    }
+    return {hot_dir, cold_dir};
+}
+
+std::filesystem::path DataTiers::path(uint32_t data_id){
+    if(!enabled()){
+        return object_in(hot_dir, data_id);
+    }
+    std::lock_guard<std::mutex> lk(m);
+    return object_in(dir_of(cold.contains(data_id)), data_id);
+}
+
+bool DataTiers::is_cold(uint32_t data_id){
+    if(!enabled()){
+        return false;
+    }
+    std::lock_guard<std::mutex> lk(m);
+    return cold.contains(data_id);
+}
+
+bool DataTiers::exists(uint32_t data_id){
+    std::error_code ec;
+    if(!enabled()){
+        return std::filesystem::exists(object_in(hot_dir, data_id), ec);
+    }
+    // flip() moves the object and path() along with it under m, so whatever path() says is there
+    std::lock_guard<std::mutex> lk(m);
+    return std::filesystem::exists(object_in(dir_of(cold.contains(data_id)), data_id), ec);
+}
+
+void DataTiers::scan(){
+    if(!enabled()){
+        return;
+    }
+
+    size_t duplicates = 0;
+    for(const auto& dir : dirs()){
+        for(const auto& entry : std::filesystem::directory_iterator(dir)){
+            if(entry.path().filename().native().ends_with(STAGING_SUFFIX)){
+                std::error_code ec;
+                std::filesystem::remove(entry.path(), ec);
+            }
+        }
+    }
+
+    std::lock_guard<std::mutex> lk(m);
+    cold.clear();
+    for(const auto& entry : std::filesystem::directory_iterator(cold_dir)){
+        auto data_id = parse_id_filename<uint32_t>(entry.path().filename().native(), ".data");
+        if(!data_id){
+            continue;
+        }
+
+        const auto hot = object_in(hot_dir, *data_id);
+        struct stat hot_st;
+        struct stat cold_st;
+        if(stat(hot.c_str(), &hot_st) == -1){
+            cold.insert(*data_id);
+            continue;
+        }
+
+        // Interrupted migration: whichever copy was written after the other was copied is the live one
+        ++duplicates;
+        std::error_code ec;
+        if(stat(entry.path().c_str(), &cold_st) == 0 && newer(cold_st.st_mtim, hot_st.st_mtim)){
+            std::filesystem::remove(hot, ec);
+            cold.insert(*data_id);
+        }
+        else{
+            std::filesystem::remove(entry.path(), ec);
+        }
+    }
+    if(duplicates){
+        fsync_dir(hot_dir);
+        fsync_dir(cold_dir);
+        logger->warn("[tier] Dropped the stale copy of {} data objects found on both tiers", duplicates);
+    }
+    logger->info("[tier] {} data objects on the capacity tier {}", cold.size(), cold_dir.string());
+}
+
+void DataTiers::record_open(uint32_t data_id){
+    if(!enabled()){
+        return;
+    }
+    std::lock_guard<std::mutex> lk(m);
+    auto& access = accesses[data_id];
+    ++access.opens;
+    access.last = time(nullptr);
+}
+
+void DataTiers::remove(uint32_t data_id){
+    std::error_code ec;
+    if(!enabled()){
+        std::filesystem::remove(object_in(hot_dir, data_id), ec);
+        return;
+    }
+    std::lock_guard<std::mutex> lk(m);
+    std::filesystem::remove(object_in(hot_dir, data_id), ec);
+    std::filesystem::remove(object_in(cold_dir, data_id), ec);
+    cold.erase(data_id);
+    accesses.erase(data_id);
+}
+
+std::vector<DataTiers::move_t> DataTiers::plan(time_t cold_after, unsigned promote_opens){
+    std::vector<move_t> moves;
+    if(!enabled()){
+        return moves;
+    }
+    const time_t now = time(nullptr);
+
+    if(cold_after > 0){
+        std::vector<uint32_t> hot_ids;
+        try{
+            for(const auto& entry : std::filesystem::directory_iterator(hot_dir)){
+                if(auto data_id = parse_id_filename<uint32_t>(entry.path().filename().native(), ".data")){
+                    hot_ids.push_back(*data_id);
+                }
+            }
+        }
+        catch(const std::exception& e){
+            logger->error("[tier] Failed to list {}: {}", hot_dir.string(), e.what());
+        }
+
+        for(uint32_t data_id : hot_ids){
+            struct stat st;
+            if(stat(object_in(hot_dir, data_id).c_str(), &st) == -1){
+                continue;
+            }
+            // Opens are only tracked since mount, the file's own timestamps cover the time before
+            time_t last = std::max(st.st_atim.tv_sec, st.st_mtim.tv_sec);
+            {
+                std::lock_guard<std::mutex> lk(m);
+                if(cold.contains(data_id)){
+                    continue;
+                }
+                auto it = accesses.find(data_id);
+                if(it != accesses.end()){
+                    last = std::max(last, it->second.last);
+                }
+            }
+            if(now - last >= cold_after){
+                moves.push_back({data_id, true});
+            }
+        }
+    }
+
+    std::lock_guard<std::mutex> lk(m);
+    for(auto it = accesses.begin(); it != accesses.end();){
+        if(promote_opens > 0 && it->second.opens >= promote_opens && cold.contains(it->first)){
+            moves.push_back({it->first, false});
+        }
+        it->second.opens /= 2;
+        if(it->second.opens == 0 && (cold_after == 0 || now - it->second.last >= cold_after)){
+            it = accesses.erase(it);
+        }
+        else{
+            ++it;
+        }
+    }
+    return moves;
+}
+
+std::optional<DataTiers::staged_t> DataTiers::stage(const move_t& move, const std::function<bool(size_t)>& pace){
+    const auto src_path = object_in(dir_of(!move.to_cold), move.data_id);
+    const auto tmp = dir_of(move.to_cold) / (std::to_string(move.data_id) + std::string(STAGING_SUFFIX));
+
+    int src = traced_open(src_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(src == -1){
+        // Removed since it was planned
+        return std::nullopt;
+    }
+    struct stat st;
+    if(fstat(src, &st) == -1){
+        close(src);
+        return std::nullopt;
+    }
+    int dst = traced_open(tmp.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, st.st_mode & 07777);
+    if(dst == -1){
+        logger->error("[tier] Failed to create {}: {}", tmp.string(), strerror(errno));
+        close(src);
+        return std::nullopt;
+    }
+    posix_fadvise(src, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    bool ok = true;
+    for(off_t done = 0; ok && done < st.st_size;){
+        const size_t len = std::min<off_t>(MIGRATE_CHUNK, st.st_size - done);
+        ok = copy_chunk(src, dst, len) && pace(len);
+        done += len;
+    }
+    // Same mtime as the source, which is what the checksum sidecar is matched against
+    const struct timespec times[2] = {st.st_atim, st.st_mtim};
+    ok = ok && ftruncate(dst, st.st_size) == 0 && futimens(dst, times) == 0 && fsync(dst) == 0;
+    // Done with the source for a while, don't let the copy push hotter data out of the page cache
+    posix_fadvise(src, 0, 0, POSIX_FADV_DONTNEED);
+    close(src);
+    close(dst);
+
+    if(!ok){
+        logger->warn("[tier] Gave up copying data object {} to {}", move.data_id, dir_of(move.to_cold).string());
+        discard({tmp, st.st_ctim, st.st_size});
+        return std::nullopt;
+    }
+    return staged_t{tmp, st.st_ctim, st.st_size};
+}
+
+bool DataTiers::flip(const move_t& move, const staged_t& staged){
+    const auto src_path = object_in(dir_of(!move.to_cold), move.data_id);
+    const auto dst_path = object_in(dir_of(move.to_cold), move.data_id);
+
+    // Under m so a remove() can't slip in between the check and the rename and leave the copy behind
+    std::lock_guard<std::mutex> lk(m);
+    struct stat st;
+    if(cold.contains(move.data_id) == move.to_cold || stat(src_path.c_str(), &st) == -1 || st.st_size != staged.size || !same_time(st.st_ctim, staged.src_ctime)){
+        return false;
+    }
+    if(::rename(staged.tmp.c_str(), dst_path.c_str()) == -1){
+        logger->error("[tier] Failed to move staged copy into {}: {}", dst_path.string(), strerror(errno));
+        return false;
+    }
+
+    if(move.to_cold){
+        cold.insert(move.data_id);
+        ++demoted;
+    }
+    else{
+        cold.erase(move.data_id);
+        ++promoted;
+    }
+    bytes_moved += staged.size;
+    return true;
+}
+
+void DataTiers::retire_source(const move_t& move){
+    // Both copies are complete, so a crash anywhere in here leaves at least one behind for scan() to pick
+    if(!fsync_dir(dir_of(move.to_cold))){
+        logger->warn("[tier] Failed to sync {}, keeping the old copy of data object {}", dir_of(move.to_cold).string(), move.data_id);
+        return;
+    }
+    std::error_code ec;
+    std::filesystem::remove(object_in(dir_of(!move.to_cold), move.data_id), ec);
+    fsync_dir(dir_of(!move.to_cold));
+}
+
+void DataTiers::discard(const staged_t& staged){
+    ++aborted;
+    std::error_code ec;
+    std::filesystem::remove(staged.tmp, ec);
+}
+
+nlohmann::json DataTiers::stats_json(){
+    nlohmann::json j;
+    j["enabled"] = enabled();
+    j["hot_dir"] = hot_dir.string();
+    if(enabled()){
+        std::error_code ec;
+        auto target = std::filesystem::canonical(cold_dir, ec);
+        j["cold_dir"] = (ec ? cold_dir : target).string();
+    }
+    {
+        std::lock_guard<std::mutex> lk(m);
+        j["cold_objects"] = cold.size();
+        j["tracked"] = accesses.size();
+    }
+    j["demoted"] = demoted.load();
+    j["promoted"] = promoted.load();
+    j["bytes_moved"] = bytes_moved.load();
+    j["aborted"] = aborted.load();
+    return j;
+}
+
+
+// SealFSData's side: handles are counted per data object and the migrator leaves anything open (or written since the
+// last commit) alone. That is what lets it copy without holding the state lock, only the final rename needs it.
+
+int SealFSData::open_object(uint32_t data_id, int flags, mode_t mode){
+    const auto path = get_data_ent_path(data_id);
+    const int fd = traced_open(path.c_str(), flags, mode);
+    if(fd != -1){
+        ++object_handles[data_id];
+        tiers->record_open(data_id);
+    }
+    return fd;
+}
+
+void SealFSData::put_object(uint32_t data_id){
+    auto it = object_handles.find(data_id);
+    if(it != object_handles.end() && --it->second == 0){
+        object_handles.erase(it);
+    }
+}
+
+void SealFSData::start_migrator(){
+    // A frozen image opens objects without going through open_object, so nothing may move under it
+    if(!tiers->enabled() || config.tier_interval == 0 || config.frozen){
+        return;
+    }
+    migrator = std::jthread([this](std::stop_token stop){ migrate_loop(stop); });
+}
+
+void SealFSData::migrate_loop(std::stop_token stop){
+    logger->info("[tier] Migrating every {}s: objects idle for {}s to {}, back once opened {} times", config.tier_interval,
+                 config.cold_after, get_cold_path().string(), config.promote_opens);
+    const double bytes_per_sec = static_cast<double>(config.tier_mb) * 1024 * 1024;
+
+    while(!stop.stop_requested()){
+        {
+            std::unique_lock<std::mutex> lk(migrate_mutex);
+            migrate_cv.wait_for(lk, stop, std::chrono::seconds(config.tier_interval), []{ return false; });
+        }
+        if(stop.stop_requested()){
+            break;
+        }
+
+        const auto moves = tiers->plan(config.cold_after, config.promote_opens);
+        const auto start = std::chrono::steady_clock::now();
+        uint64_t paced = 0;
+        auto pace = [&](size_t bytes){
+            paced += bytes;
+            if(bytes_per_sec > 0){
+                const auto due = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(paced / bytes_per_sec));
+                if(due > std::chrono::steady_clock::now()){
+                    std::unique_lock<std::mutex> lk(migrate_mutex);
+                    migrate_cv.wait_until(lk, stop, due, []{ return false; });
+                }
+            }
+            return !stop.stop_requested();
+        };
+        // Open, about to be synced by a commit, or with writes a commit still has to sync
+        auto busy = [&](uint32_t data_id){
+            return object_handles.contains(data_id) || dirty_data.contains(data_id) || commit_writing;
+        };
+
+        size_t moved = 0;
+        for(const auto& move : moves){
+            if(stop.stop_requested()){
+                break;
+            }
+            {
+                auto guard = lock_state();
+                if(busy(move.data_id)){
+                    continue;
+                }
+            }
+
+            auto staged = tiers->stage(move, pace);
+            if(!staged){
+                continue;
+            }
+            bool flipped = false;
+            {
+                auto guard = lock_state();
+                if(!busy(move.data_id) && tiers->flip(move, *staged)){
+                    flipped = true;
+                    mmap_cache.invalidate(move.data_id);
+                    checksums->relocate(move.data_id);
+                }
+            }
+            if(flipped){
+                tiers->retire_source(move);
+                ++moved;
+            }
+            else{
+                tiers->discard(*staged);
+            }
+        }
+        if(!moves.empty()){
+            logger->info("[tier] Moved {} of {} data objects planned, {} MB copied in {}s", moved, moves.size(), paced / (1024 * 1024),
+                         std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - start).count());
+        }
+    }
+}
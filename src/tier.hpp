@@ -0,0 +1,111 @@
+#pragma once
+
+#include <sys/types.h>
+#include <time.h>
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include <filesystem>
+
+#include <spdlog/spdlog.h>
+#include <nlohmann/json.hpp>
+
+namespace SealFS{
+
+// Name of the capacity tier under the persistence root, a symlink to wherever -o cold_dir put it
+static constexpr const char* COLD_DIR_NAME = "cold";
+// Suffix of an object copy the migrator is still writing, see DataTiers::stage()
+static constexpr std::string_view STAGING_SUFFIX = ".migrating";
+
+// Where data_id's object is under an unmounted persistence root: data/, or the capacity tier if it was moved there.
+// For offline tools, nothing can be migrating the object meanwhile.
+std::filesystem::path find_data_object(const std::filesystem::path& root, uint32_t data_id);
+
+// Data objects live on one of two tiers: the hot one, <root>/data on the same (fast) device as the metadata and
+// journal, and optionally a capacity tier, <root>/cold. New objects are always created hot. The migrator
+// (SealFSData::migrate_loop) moves the ones nobody has touched in a while to the capacity tier and brings them back
+// once they get busy again. An object is only ever moved while no handle has it open, so an fd always stays good.
+class DataTiers{
+public:
+    // cold_dir is empty for a single tier
+    DataTiers(const std::filesystem::path& hot_dir, const std::filesystem::path& cold_dir, std::shared_ptr<spdlog::logger> logger);
+
+    inline bool enabled() const { return !cold_dir.empty(); }
+    // Every tier directory, hot first
+    std::vector<std::filesystem::path> dirs() const;
+    // Where data_id's object is, or is created if it doesn't exist yet
+    std::filesystem::path path(uint32_t data_id);
+    bool is_cold(uint32_t data_id);
+    // Whether data_id's object exists where path() says. Unlike a stat of path() this can't race with a migration.
+    bool exists(uint32_t data_id);
+
+    // Learn which objects are on the capacity tier, at mount. A crash mid-migration can leave an object on both
+    // tiers, the copy written last (by mtime, hot on a tie) is kept. Leftover staged copies are removed.
+    void scan();
+
+    // Count an open of data_id towards promoting it
+    void record_open(uint32_t data_id);
+    // The object is gone, from whichever tier had it
+    void remove(uint32_t data_id);
+
+    struct move_t{
+        uint32_t data_id;
+        bool to_cold;
+    };
+    // Objects worth moving: hot ones not opened (going by what was recorded since mount and the object's atime and
+    // mtime) for cold_after seconds, and cold ones opened at least promote_opens times since the previous plan().
+    // Open counts are halved by every call, so an object has to stay busy to stay hot.
+    std::vector<move_t> plan(time_t cold_after, unsigned promote_opens);
+
+    struct staged_t{
+        std::filesystem::path tmp;
+        struct timespec src_ctime;
+        off_t size;
+    };
+    // Copy the object to the other tier under a temporary name, calling pace with the size of every chunk copied
+    // (false gives up). Keeps the mtime, so the object's checksum sidecar stays valid. nullopt on failure.
+    std::optional<staged_t> stage(const move_t& move, const std::function<bool(size_t)>& pace);
+    // Put a staged copy in place and point path() at it, provided the source is still what stage() copied. Nothing
+    // may open or write the object meanwhile (the caller holds the state lock and no handle has it open).
+    bool flip(const move_t& move, const staged_t& staged);
+    // After a flip(): make the new copy's name durable, then drop the old copy
+    void retire_source(const move_t& move);
+    // A staged copy that didn't get flipped
+    void discard(const staged_t& staged);
+
+    // Where the capacity tier is, what is on it and migration counters, for user.sealfs.tiers
+    nlohmann::json stats_json();
+
+private:
+    struct access_t{
+        uint32_t opens = 0; // Since the last plan(), halved by each
+        time_t last = 0;
+    };
+
+    static std::filesystem::path object_in(const std::filesystem::path& dir, uint32_t data_id);
+    inline const std::filesystem::path& dir_of(bool cold) const { return cold ? cold_dir : hot_dir; }
+
+    std::filesystem::path hot_dir;
+    std::filesystem::path cold_dir;
+    std::shared_ptr<spdlog::logger> logger;
+
+    std::mutex m;
+    std::unordered_set<uint32_t> cold; // Objects on the capacity tier
+    std::unordered_map<uint32_t, access_t> accesses;
+
+    std::atomic<uint64_t> demoted = 0;
+    std::atomic<uint64_t> promoted = 0;
+    std::atomic<uint64_t> bytes_moved = 0;
+    std::atomic<uint64_t> aborted = 0; // Migrations given up on: copy failed, or the object changed or got opened meanwhile
+};
+
+} // namespace SealFS
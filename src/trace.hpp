@@ -0,0 +1,131 @@
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include <cstdint>
+#include <string>
+
+// USDT probes (provider "sealfs") for tracing live mounts with bpftrace, perf or SystemTap, see tools/trace/. A probe
+// is a single nop until a tracer attaches to it. Without <sys/sdt.h> (systemtap-sdt-dev / systemtap-sdt-devel) at
+// build time, or with SEALFS_NO_USDT defined, they compile to nothing.
+//
+// Probes, with their arguments:
+//   op__entry, op__return              op name (string), ino          every FUSE request handler
+//   io__pread__start, io__pread__done  fd, offset, size | fd, bytes or -errno
+//   io__pwrite__start, io__pwrite__done
+//   io__open__start, io__open__done    path (string) | fd or -errno
+//   lock__wait__start, lock__wait__done                                the state lock, only when contended
+//   range__wait__start, range__wait__done  start, end                  a file's byte range lock, only when contended
+//   commit__start, commit__done        data objects, partitions | 1 on success, 0 on failure
+//   commit__copy__start, commit__copy__done  - | entries copied      dirty partitions copied under the state lock
+//   commit__data__synced               data objects                    data fdatasync'd, metadata next
+//   partition__load__start, partition__load__done  dir ino | dir ino, 1 on success
+#if !defined(SEALFS_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define SEALFS_USDT 1
+#endif
+#endif
+
+#ifdef SEALFS_USDT
+#define SEALFS_TRACE(name) DTRACE_PROBE(sealfs, name)
+#define SEALFS_TRACE1(name, a) DTRACE_PROBE1(sealfs, name, a)
+#define SEALFS_TRACE2(name, a, b) DTRACE_PROBE2(sealfs, name, a, b)
+#define SEALFS_TRACE3(name, a, b, c) DTRACE_PROBE3(sealfs, name, a, b, c)
+#else
+#define SEALFS_TRACE(name) do{}while(0)
+#define SEALFS_TRACE1(name, a) do{ (void)(a); }while(0)
+#define SEALFS_TRACE2(name, a, b) do{ (void)(a); (void)(b); }while(0)
+#define SEALFS_TRACE3(name, a, b, c) do{ (void)(a); (void)(b); (void)(c); }while(0)
+#endif
+
+namespace SealFS{
+
+// Fires op__entry now and op__return when the handler returns, however it returns
+class OpTrace{
+public:
+    inline OpTrace(const char* op_, uint64_t ino_) : op(op_), ino(ino_){
+        SEALFS_TRACE2(op__entry, op, ino);
+    }
+    inline ~OpTrace(){
+        SEALFS_TRACE2(op__return, op, ino);
+    }
+
+    OpTrace(const OpTrace&) = delete;
+    OpTrace& operator=(const OpTrace&) = delete;
+
+private:
+    const char* op;
+    uint64_t ino;
+};
+
+// Backing file I/O wrapped in the io__* probes, errno is left as the call set it
+inline int traced_open(const char* path, int flags, mode_t mode = 0){
+    SEALFS_TRACE1(io__open__start, path);
+    const int fd = open(path, flags, mode);
+    const int err = errno;
+    SEALFS_TRACE1(io__open__done, fd == -1 ? -err : fd);
+    errno = err;
+    return fd;
+}
+
+inline ssize_t traced_pread(int fd, void* buf, size_t size, off_t off){
+    SEALFS_TRACE3(io__pread__start, fd, off, size);
+    const ssize_t bytes = pread(fd, buf, size, off);
+    const int err = errno;
+    SEALFS_TRACE2(io__pread__done, fd, bytes == -1 ? -err : bytes);
+    errno = err;
+    return bytes;
+}
+
+inline ssize_t traced_pwrite(int fd, const void* buf, size_t size, off_t off){
+    SEALFS_TRACE3(io__pwrite__start, fd, off, size);
+    const ssize_t bytes = pwrite(fd, buf, size, off);
+    const int err = errno;
+    SEALFS_TRACE2(io__pwrite__done, fd, bytes == -1 ? -err : bytes);
+    errno = err;
+    return bytes;
+}
+
+// A whole file read into out with the traced calls above, false (errno set) if it couldn't be opened or read
+inline bool traced_read_file(const char* path, std::string& out){
+    const int fd = traced_open(path, O_RDONLY | O_CLOEXEC);
+    if(fd == -1){
+        return false;
+    }
+    struct stat st;
+    if(fstat(fd, &st) == -1){
+        const int err = errno;
+        close(fd);
+        errno = err;
+        return false;
+    }
+    out.resize(st.st_size);
+    size_t done = 0;
+    while(done < out.size()){
+        const ssize_t bytes = traced_pread(fd, out.data() + done, out.size() - done, done);
+        if(bytes == -1 && errno == EINTR){
+            continue;
+        }
+        if(bytes == -1){
+            const int err = errno;
+            close(fd);
+            errno = err;
+            return false;
+        }
+        if(bytes == 0){
+            break;
+        }
+        done += bytes;
+    }
+    out.resize(done);
+    close(fd);
+    return true;
+}
+
+} // namespace SealFS
+
+#define SEALFS_TRACE_OP(op, ino) SealFS::OpTrace sealfs_op_trace_(op, ino)